@@ -0,0 +1,44 @@
+# Compares `image_dump/1`, which hands the buffer encoded by
+# GraphicsMagick to the VM without copying it, against the former
+# behaviour of copying it into a new binary (emulated here with
+# `:binary.copy/1`).
+#
+#     $ mix run bench/dump_blob.exs
+#
+# For each path the average wall time is reported along with the
+# memory held by the VM binary allocator and the process RSS (Linux
+# only) growth while keeping the encoded images alive.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.DumpBlob do
+  import Bench.Support, only: [rss_kb: 0]
+
+  @rounds 10
+
+  def run do
+    image = Bench.Support.image(4000, 3000) |> ExMagick.attr!(:magick, "TIFF")
+
+    IO.puts("source: 4000x3000 TIFF, #{byte_size(ExMagick.image_dump!(image))} bytes\n")
+
+    report("resource binary", fn -> ExMagick.image_dump!(image) end)
+    report("copied binary", fn -> image |> ExMagick.image_dump!() |> :binary.copy() end)
+  end
+
+  defp report(label, dump) do
+    :erlang.garbage_collect()
+    {bin0, rss0} = {:erlang.memory(:binary), rss_kb()}
+    {usecs, blobs} = :timer.tc(fn -> for _ <- 1..@rounds, do: dump.() end)
+    :erlang.garbage_collect()
+    {bin1, rss1} = {:erlang.memory(:binary), rss_kb()}
+
+    IO.puts(
+      "#{String.pad_trailing(label, 16)} #{div(usecs, @rounds * 1000)} ms/op, " <>
+        "binary alloc +#{div(bin1 - bin0, 1024)} KiB, rss +#{rss1 - rss0} KiB"
+    )
+
+    length(blobs)
+  end
+end
+
+Bench.DumpBlob.run()
@@ -0,0 +1,65 @@
+# Measures the size of the encoded image and the time spent encoding it
+# for each encoder setting (refer to `ExMagick.attr/3`), against the
+# defaults of GraphicsMagick.
+#
+#     $ mix run bench/encoder.exs
+#
+# The source is `test/images/elixir.png` upscaled to 1920x1080. Point
+# `BENCH_IMAGE` at a camera JPEG to see what stripping its EXIF/ICC
+# profiles saves.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.Encoder do
+  @rounds 10
+
+  def run do
+    image = Bench.Support.image(1920, 1080, System.get_env("BENCH_IMAGE", Bench.Support.source()))
+
+    IO.puts("source: 1920x1080, #{@rounds} rounds\n")
+
+    for {format, settings} <- settings() do
+      for {label, operations} <- [{"default", []} | settings] do
+        report(format, label, image, [{:magick, format} | operations])
+      end
+
+      IO.puts("")
+    end
+  end
+
+  defp settings do
+    [
+      {"JPEG",
+       [
+         {"quality 50", [{:attr, :quality, 50}]},
+         {"quality 85", [{:attr, :quality, 85}]},
+         {"progressive", [{:attr, :interlace, :line}]},
+         {"sampling 2x2", [{:attr, :sampling_factor, "2x2,1x1,1x1"}]},
+         {"sampling 1x1", [{:attr, :sampling_factor, "1x1,1x1,1x1"}]},
+         {"dct fast", [{:attr, :define, %{"jpeg:dct-method" => "fast"}}]},
+         {"strip", [{:convert, :strip, true}]}
+       ]},
+      {"PNG",
+       [
+         {"zlib 1", [{:attr, :quality, 10}]},
+         {"zlib 6", [{:attr, :quality, 65}]},
+         {"zlib 9", [{:attr, :quality, 95}]},
+         {"interlaced", [{:attr, :interlace, :line}]},
+         {"strip", [{:convert, :strip, true}]}
+       ]}
+    ]
+  end
+
+  defp report(format, label, image, operations) do
+    handle = image |> ExMagick.derive!() |> ExMagick.pipeline!(operations)
+
+    {usecs, blobs} = :timer.tc(fn -> for _ <- 1..@rounds, do: ExMagick.image_dump!(handle) end)
+
+    IO.puts(
+      "#{String.pad_trailing(format, 5)} #{String.pad_trailing(label, 14)} " <>
+        "#{byte_size(hd(blobs))} bytes, #{div(usecs, @rounds * 1000)} ms/op"
+    )
+  end
+end
+
+Bench.Encoder.run()
@@ -0,0 +1,53 @@
+# Compares `fingerprint/2` against hashing in Elixir: shrinking the
+# image to 8x8, dumping it as raw gray pixels and computing the average
+# hash out of the blob.
+#
+#     $ mix run bench/fingerprint.exs
+#
+# Each case runs on a copy of the loaded image, the average wall time
+# per image is reported for every source size.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.Fingerprint do
+  @rounds 20
+  @resolutions [{640, 480}, {1920, 1080}, {4000, 3000}]
+
+  def run do
+    for {width, height} <- @resolutions do
+      image = Bench.Support.image(width, height)
+      IO.puts("source: #{width}x#{height}, #{@rounds} rounds")
+
+      report("elixir ahash", image, &elixir_ahash/1)
+      report("native ahash", image, &ExMagick.fingerprint!(&1, [:ahash]))
+      report("native phash", image, &ExMagick.fingerprint!(&1, [:phash]))
+      report("native hashes", image, &ExMagick.fingerprint!(&1, [:ahash, :dhash, :phash]))
+      report("native all", image, &ExMagick.fingerprint!(&1, [:phash, :histogram, :stats]))
+      IO.puts("")
+    end
+  end
+
+  defp elixir_ahash(image) do
+    gray =
+      image
+      |> ExMagick.size!(8, 8)
+      |> ExMagick.convert!(:colorspace, :gray)
+      |> ExMagick.attr!(:magick, "GRAY")
+      |> ExMagick.image_dump!()
+
+    pixels = :binary.bin_to_list(gray)
+    mean = Enum.sum(pixels) / length(pixels)
+
+    Enum.reduce(pixels, 0, fn pixel, hash ->
+      if pixel > mean, do: hash * 2 + 1, else: hash * 2
+    end)
+  end
+
+  defp report(label, image, fun) do
+    copies = for _ <- 1..@rounds, do: ExMagick.derive!(image)
+    {usecs, _} = :timer.tc(fn -> Enum.each(copies, fun) end)
+    IO.puts("#{String.pad_trailing(label, 14)} #{div(usecs, @rounds)} us/image")
+  end
+end
+
+Bench.Fingerprint.run()
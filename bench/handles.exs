@@ -0,0 +1,53 @@
+# Counts the handles allocated by a load/thumb/dump cycle on a small
+# image, with handles left to the garbage collector against handles
+# given back with `ExMagick.release/1`.
+#
+#     $ mix run bench/handles.exs
+#
+# Each case reports the handles allocated and reused (refer to
+# `ExMagick.handle_stats/0`), the average wall time of a cycle and how
+# much the resident memory of the node grew (Linux only), which is
+# where the allocations of GraphicsMagick show up.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.Handles do
+  import Bench.Support, only: [fixture: 3, rss_kb: 0]
+
+  @rounds 20_000
+
+  def run do
+    blob = fixture("PNG", 64, 64)
+    IO.puts("source: 64x64 PNG, #{@rounds} rounds\n")
+
+    report("garbage collected", fn -> cycle(blob) end)
+    report("released", fn -> blob |> cycle() |> ExMagick.release() end)
+  end
+
+  defp cycle(blob) do
+    handle = ExMagick.init!()
+    handle |> ExMagick.image_load!({:blob, blob}) |> ExMagick.thumb!(16, 16)
+    ExMagick.image_dump!(handle)
+    handle
+  end
+
+  defp report(label, fun) do
+    :erlang.garbage_collect()
+    {:ok, before} = ExMagick.handle_stats()
+    rss = rss_kb()
+
+    {usecs, _} = :timer.tc(fn -> for _ <- 1..@rounds, do: fun.() end)
+
+    :erlang.garbage_collect()
+    {:ok, stats} = ExMagick.handle_stats()
+
+    IO.puts(
+      "#{String.pad_trailing(label, 18)} " <>
+        "#{stats.allocated - before.allocated} allocated, " <>
+        "#{stats.reused - before.reused} reused, " <>
+        "#{div(usecs, @rounds)} us/cycle, rss +#{rss_kb() - rss} kB"
+    )
+  end
+end
+
+Bench.Handles.run()
@@ -0,0 +1,59 @@
+# Compares decoding a large JPEG at full resolution against decoding it
+# with the `:max_size` hint, both followed by the same thumbnail.
+#
+#     $ mix run bench/load_max_size.exs
+#
+# For each path the size of the decoded image is reported along with
+# the pixel cache GraphicsMagick holds for it (refer to
+# `ExMagick.stats/0`), how much the peak resident memory of the node
+# grew over the rounds (Linux only) and the average wall time.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.LoadMaxSize do
+  import Bench.Support
+
+  @rounds 20
+  @thumb {256, 256}
+
+  def run do
+    jpg = fixture("JPEG", 6000, 4000)
+    IO.puts("source: 6000x4000 JPEG, #{byte_size(jpg)} bytes, #{@rounds} rounds\n")
+
+    report("max_size decode", fn ->
+      ExMagick.image_load!(ExMagick.init!(), {:blob, jpg}, max_size: @thumb)
+    end)
+
+    report("full decode", fn -> ExMagick.image_load!(ExMagick.init!(), {:blob, jpg}) end)
+  end
+
+  defp report(label, load) do
+    :erlang.garbage_collect()
+    cache = pixel_cache_bytes()
+    image = load.()
+    %{width: w, height: h} = ExMagick.size!(image)
+    cache = pixel_cache_bytes() - cache
+    ExMagick.release(image)
+
+    {w_thumb, h_thumb} = @thumb
+    :erlang.garbage_collect()
+    reset_peak_rss()
+    peak = peak_rss_kb()
+
+    # releasing each handle right away keeps a single decoded image alive
+    {usecs, _} =
+      :timer.tc(fn ->
+        for _ <- 1..@rounds do
+          load.() |> ExMagick.thumb!(w_thumb, h_thumb) |> ExMagick.release()
+        end
+      end)
+
+    IO.puts(
+      "#{String.pad_trailing(label, 16)} decoded #{w}x#{h}, " <>
+        "pixel cache #{div(cache, 1024)} KiB, peak rss +#{peak_rss_kb() - peak} KiB, " <>
+        "#{div(usecs, @rounds * 1000)} ms/op"
+    )
+  end
+end
+
+Bench.LoadMaxSize.run()
@@ -0,0 +1,48 @@
+# Compares the throughput of `thumb/3` (GraphicsMagick ThumbnailImage)
+# against `resize/4` with the GraphicsMagick and the fast engines, all
+# producing a 256x171 image out of a decoded 3000x2000 JPEG.
+#
+#     $ mix run bench/resize.exs
+#
+# Each round resizes a derived handle, so decoding is not measured.
+# The average wall time and the input megapixels per second are
+# reported for each path.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.Resize do
+  import Bench.Support, only: [fixture: 3]
+
+  @rounds 20
+  @size {256, 171}
+
+  def run do
+    source = ExMagick.init!() |> ExMagick.image_load!({:blob, fixture("JPEG", 3000, 2000)})
+    IO.puts("source: 3000x2000 JPEG, #{@rounds} rounds\n")
+
+    {w, h} = @size
+    report("thumb", source, &ExMagick.thumb!(&1, w, h))
+
+    for filter <- [:lanczos3, :bilinear, :box], engine <- [:magick, :fast] do
+      report("#{engine} #{filter}", source, fn image ->
+        ExMagick.resize!(image, w, h, filter: filter, engine: engine)
+      end)
+    end
+  end
+
+  defp report(label, source, resize) do
+    %{width: w, height: h} = ExMagick.size!(source)
+
+    {usecs, _} =
+      :timer.tc(fn ->
+        for _ <- 1..@rounds, do: source |> ExMagick.derive!() |> resize.()
+      end)
+
+    IO.puts(
+      "#{String.pad_trailing(label, 16)} #{div(usecs, @rounds * 1000)} ms/op, " <>
+        "#{Float.round(w * h * @rounds / usecs, 1)} MP/s"
+    )
+  end
+end
+
+Bench.Resize.run()
@@ -0,0 +1,129 @@
+# Measures the main operations of the library for every fixture format
+# and resolution, and the throughput of a whole load/thumb/dump cycle
+# at increasing numbers of concurrent processes.
+#
+#     $ mix run bench/suite.exs [output.csv]
+#
+# Fixtures are generated out of `test/images/elixir.png` when the suite
+# starts, so no network access is needed. Results are written as CSV
+# (to stdout unless a file is given), one line per case, so two runs
+# may be compared with `diff` or any spreadsheet:
+#
+#     case,format,width,height,concurrency,rounds,avg_us,min_us,max_us,ops_per_sec
+#
+# `BENCH_ROUNDS` (default 10) sets how many times each case runs and
+# `BENCH_FORMATS` (ex.: "JPEG,PNG") restricts the fixture formats.
+
+Code.require_file("support.exs", __DIR__)
+
+defmodule Bench.Suite do
+  import Bench.Support, only: [fixture: 3]
+
+  @formats ~w(JPEG PNG GIF TIFF PDF)
+  @resolutions [{640, 480}, {1920, 1080}, {4000, 3000}]
+  @header "case,format,width,height,concurrency,rounds,avg_us,min_us,max_us,ops_per_sec"
+
+  def run(args) do
+    rounds = "BENCH_ROUNDS" |> System.get_env() |> to_integer(10)
+    formats = "BENCH_FORMATS" |> System.get_env() |> to_list(@formats)
+    out = output(args)
+
+    IO.puts(out, @header)
+
+    for format <- formats, {width, height} <- @resolutions do
+      blob = fixture(format, width, height)
+      progress("#{format} #{width}x#{height}, #{byte_size(blob)} bytes")
+
+      for {name, fun} <- operations(blob, width, height) do
+        report(out, [name, format, width, height, 1], time(rounds, fun))
+      end
+    end
+
+    jpg = fixture("JPEG", 1920, 1080)
+
+    for concurrency <- concurrency_levels() do
+      progress("throughput at #{concurrency} processes")
+      stats = throughput(concurrency, rounds, jpg)
+      report(out, ["cycle", "JPEG", 1920, 1080, concurrency], stats)
+    end
+
+    if out != :stdio, do: File.close(out)
+  end
+
+  defp operations(blob, width, height) do
+    loaded = load(blob)
+
+    [
+      {"ping", fn -> ExMagick.ping!({:blob, blob}) end},
+      {"load", fn -> load(blob) end},
+      {"thumb", fn -> loaded |> ExMagick.derive!() |> ExMagick.thumb!(256, 256) end},
+      {"resize_fast",
+       fn -> loaded |> ExMagick.derive!() |> ExMagick.resize!(256, 256, engine: :fast) end},
+      {"crop",
+       fn ->
+         loaded
+         |> ExMagick.derive!()
+         |> ExMagick.crop!(div(width, 4), div(height, 4), div(width, 2), div(height, 2))
+       end},
+      {"convert",
+       fn -> loaded |> ExMagick.derive!() |> ExMagick.convert!(:threshold_image, 128.0) end},
+      {"dump", fn -> ExMagick.image_dump!(loaded) end}
+    ]
+  end
+
+  # runs `rounds` load/thumb/dump cycles in each of `concurrency`
+  # processes at once; the average is the time of a single cycle as
+  # seen by the node (total time / cycles)
+  defp throughput(concurrency, rounds, blob) do
+    cycle = fn ->
+      ExMagick.init!()
+      |> ExMagick.pipeline!([{:load, {:blob, blob}}, {:thumb, 256, 256}, :dump])
+    end
+
+    {usecs, times} =
+      :timer.tc(fn ->
+        1..concurrency
+        |> Enum.map(fn _ -> Task.async(fn -> time(rounds, cycle) end) end)
+        |> Enum.flat_map(&Task.await(&1, :infinity))
+      end)
+
+    {div(usecs, concurrency * rounds), Enum.min(times), Enum.max(times), length(times)}
+  end
+
+  defp time(rounds, fun) do
+    for _ <- 1..rounds do
+      {usecs, _} = :timer.tc(fun)
+      usecs
+    end
+  end
+
+  defp report(out, fields, {avg, min, max, count}) do
+    ops = if avg > 0, do: Float.round(1_000_000 / avg, 2), else: 0
+    IO.puts(out, Enum.join(fields ++ [count, avg, min, max, ops], ","))
+  end
+
+  defp report(out, fields, times) when is_list(times) do
+    stats = {div(Enum.sum(times), length(times)), Enum.min(times), Enum.max(times), length(times)}
+    report(out, fields, stats)
+  end
+
+  defp concurrency_levels do
+    max = 2 * System.schedulers_online()
+    1 |> Stream.iterate(&(&1 * 2)) |> Enum.take_while(&(&1 < max)) |> Kernel.++([max])
+  end
+
+  defp load(blob), do: ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+
+  defp output([path | _]), do: File.open!(path, [:write])
+  defp output([]), do: :stdio
+
+  defp progress(message), do: IO.puts(:stderr, message)
+
+  defp to_integer(nil, default), do: default
+  defp to_integer(value, _default), do: String.to_integer(value)
+
+  defp to_list(nil, default), do: default
+  defp to_list(value, _default), do: String.split(value, ",", trim: true)
+end
+
+Bench.Suite.run(System.argv())
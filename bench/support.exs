@@ -0,0 +1,50 @@
+# Helpers shared by the benchmarks, loaded by each of them with
+#
+#     Code.require_file("support.exs", __DIR__)
+#
+# Fixtures are generated out of `test/images/elixir.png`, so no network
+# access is needed.
+
+defmodule Bench.Support do
+  @source Path.expand("../test/images/elixir.png", __DIR__)
+
+  @doc "The image fixtures are generated from"
+  def source, do: @source
+
+  @doc "A handle holding the source scaled to `width`x`height`"
+  def image(width, height, source \\ @source) do
+    ExMagick.init!() |> ExMagick.image_load!(source) |> ExMagick.size!(width, height)
+  end
+
+  @doc "The source scaled to `width`x`height` and encoded as `format`"
+  def fixture(format, width, height) do
+    image(width, height) |> ExMagick.attr!(:magick, format) |> ExMagick.image_dump!()
+  end
+
+  @doc "The resident memory of the node in kB, 0 where unknown (not Linux)"
+  def rss_kb, do: status_kb("VmRSS")
+
+  @doc "The peak resident memory of the node in kB, refer to `rss_kb/0`"
+  def peak_rss_kb, do: status_kb("VmHWM")
+
+  @doc "Brings the peak resident memory back to the current one (Linux 4.0+)"
+  def reset_peak_rss do
+    _ = File.write("/proc/self/clear_refs", "5")
+    :ok
+  end
+
+  @doc "The bytes of pixel cache GraphicsMagick currently holds"
+  def pixel_cache_bytes do
+    %{memory: memory, map: map, disk: disk} = ExMagick.stats!()
+    memory + map + disk
+  end
+
+  defp status_kb(field) do
+    with {:ok, status} <- File.read("/proc/self/status"),
+         [_, kb] <- Regex.run(~r/#{field}:\s+(\d+) kB/, status) do
+      String.to_integer(kb)
+    else
+      _ -> 0
+    end
+  end
+end
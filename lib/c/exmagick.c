@@ -12,75 +12,810 @@
  * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* pipe, fdopen, posix_madvise */
+#define _POSIX_C_SOURCE 200112L
+
 #include "erl_nif.h"
 #include <magick/api.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <langinfo.h>
+#include <math.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define EXM_MAX_ATOM_SIZE 255
+#define EXM_LIMIT_PREFIX "resource_limit:"
+/* the widest (and tallest) image any operation may produce, so that the
+ * sizes of pixel buffers can not overflow */
+#define EXM_MAX_DIMENSION (1UL << 24)
+#define EXM_ABORT_PREFIX "abort:"
+
+/* fixed point precision of the weights of the fast resize engine */
+#define EXM_RESIZE_BITS 14
+#define EXM_PI 3.14159265358979323846
+/* side of the luma grid the hashes of `fingerprint/2` are computed from */
+#define EXM_FP_SIZE 32
+/* buckets of the index of the blob cache, refer to `exm_cache_t` */
+#define EXM_CACHE_BUCKETS 1024
+/* shards of the operation counters, refer to `exm_stat_shard_t` */
+#define EXM_STAT_SHARDS 16
+/* how often a stream waiting for a credit checks the deadline, in ms */
+#define EXM_STREAM_POLL 10
+/* levels of the deepest tile pyramid, one per bit of the widest side */
+#define EXM_TILES_LEVELS 65
 #define EXM_INIT char *errmsg = NULL
 #define EXM_FAIL(j, m) do { errmsg = m; goto j; } while (0)
 
+/* handles may be shared among processes: operations that change the
+ * handle hold the lock for writing while queries hold it for reading */
+#define EXM_RLOCK(r)   enif_rwlock_rlock((r)->lock)
+#define EXM_RUNLOCK(r) enif_rwlock_runlock((r)->lock)
+#define EXM_WLOCK(r)   enif_rwlock_rwlock((r)->lock)
+#define EXM_WUNLOCK(r) enif_rwlock_rwunlock((r)->lock)
+
+/* limits of a single handle, checked on top of the GraphicsMagick
+ * ones, zero meaning no limit. `deadline` is a time of the Erlang
+ * monotonic clock, in milliseconds, honored when `has_deadline` is set */
+typedef struct {
+  unsigned long width;
+  unsigned long height;
+  unsigned long pixels;
+  int has_deadline;
+  ErlNifTime deadline;
+} exm_limits_t;
+
+/* the kinds of `fingerprint/2`, refer to `exm_fingerprints` */
+typedef enum {
+  EXM_FP_AHASH     = 1,
+  EXM_FP_DHASH     = 2,
+  EXM_FP_PHASH     = 4,
+  EXM_FP_HISTOGRAM = 8,
+  EXM_FP_STATS     = 16
+} exm_fingerprint_kind_t;
+
+/* what a single pass over the pixels gathers for `fingerprint/2`: the
+ * mean luma of each cell of the grid, the histograms of the red, green
+ * and blue channels and their sums */
+typedef struct {
+  double gray[EXM_FP_SIZE * EXM_FP_SIZE];
+  unsigned long histogram[3][256];
+  double sum[3];
+  double sum_sq[3];
+  unsigned long pixels;
+} exm_fingerprint_t;
+
 typedef struct {
   Image *image;
   ImageInfo *i_info;
   ExceptionInfo e_info;
+  ErlNifRWLock *lock;
+  exm_limits_t limits;
+  /* guards the deadline of `limits`, so that `deadline/2` does not wait
+   * for the operations it may have to cut short */
+  ErlNifMutex *deadline_lock;
+  /* the handle plus the calls using the state, under `exm_handles.mutex`,
+   * refer to `exmagick_get_handle` */
+  unsigned int refs;
+  /* the definitions added by `attr/3`, which GraphicsMagick keeps in a
+   * map the cache key can not be built from */
+  char defines[MaxTextExtent];
 } exm_resource_t;
 
+/* what `exmagick_monitor` checks while an operation runs on the
+ * current thread, refer to `exmagick_watch_start`: `env` is the
+ * calling process (NULL on pool threads), `cancelled` is set once
+ * the caller of an async job goes down and the deadline of `resource`
+ * is read on every check, as it may change meanwhile */
+typedef struct {
+  ErlNifEnv *env;
+  volatile int *cancelled;
+  const exm_resource_t *resource;
+  char *abort;
+} exm_watch_t;
+
+/* the resource the VM sees as a handle. It points to the native state
+ * of the handle until `release/1` detaches it, later calls failing with
+ * "invalid handle"; the state goes back to `exm_handles` once the calls
+ * still using it are done */
+typedef struct {
+  exm_resource_t *resource;
+} exm_handle_t;
+
+/* an encoded image owned by GraphicsMagick, exposed to the VM as a
+ * resource binary so that it is not copied */
+typedef struct {
+  void *data;
+  size_t size;
+} exm_blob_t;
+
+typedef enum {
+  EXM_FILTER_BOX,
+  EXM_FILTER_BILINEAR,
+  EXM_FILTER_LANCZOS3
+} exm_filter_t;
+
+typedef enum {
+  EXM_ENGINE_MAGICK,
+  EXM_ENGINE_FAST
+} exm_engine_t;
+
+/* the weights of one pass of the fast resize engine: output pixel `k`
+ * is the sum of the `size[k]` input pixels starting at `first[k]`,
+ * weighted by `weights[k * ksize]` onwards in fixed point */
+typedef struct {
+  unsigned long *first;
+  unsigned long *size;
+  int *weights;
+  unsigned long ksize;
+} exm_kernel_t;
+
+typedef enum {
+  EXM_OP_SCALE,
+  EXM_OP_THUMB,
+  EXM_OP_RESIZE,
+  EXM_OP_CROP,
+  EXM_OP_CONVERT,
+  EXM_OP_MAGICK
+} exm_op_kind_t;
+
+/* an image operation whose arguments were already read from erlang
+ * terms, refer to `exmagick_compile_op` */
+typedef struct {
+  exm_op_kind_t kind;
+  RectangleInfo rect;
+  double value;
+  int choice;
+  unsigned int convert;
+  exm_filter_t filter;
+  exm_engine_t engine;
+  char text[MaxTextExtent];
+} exm_op_t;
+
+/* one of a set of atoms, refer to `exmagick_get_choice`. The atoms are
+ * created when the library is loaded */
+typedef struct {
+  const char *name;
+  int value;
+  ERL_NIF_TERM atom;
+} exm_choice_t;
+
+/* an option of `convert/3`: `read` compiles its value into an
+ * operation (`EXM_OP_CONVERT`) that `apply` runs later on. Options are
+ * found by their atom, refer to `exm_convert_ops` */
+typedef struct {
+  const char *name;
+  char *(*read) (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+  char *(*apply) (exm_resource_t *resource, const exm_op_t *op);
+  ERL_NIF_TERM atom;
+} exm_convert_t;
+
+/* an attribute of `attr/2` and `attr/3`, either of its functions may
+ * be NULL, refer to `exm_attrs` */
+typedef struct {
+  const char *name;
+  char *(*set) (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+  char *(*get) (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+  ERL_NIF_TERM atom;
+} exm_attr_t;
+
+/* a rendition requested to `renditions/3`, produced by a worker
+ * thread: on success `blob` holds the encoded image, otherwise
+ * `errmsg` tells what went wrong */
+typedef struct {
+  exm_op_t *ops;
+  unsigned int num_ops;
+  ImageInfo *i_info;
+  void *blob;
+  size_t size;
+  char errmsg[MaxTextExtent];
+} exm_rendition_t;
+
+/* `resource` is the handle the renditions are made of, whose deadline
+ * every rendition is watched against */
+typedef struct {
+  Image *source;
+  const exm_resource_t *resource;
+  exm_limits_t limits;
+  ErlNifMutex *mutex;
+  exm_rendition_t *renditions;
+  unsigned int count;
+  unsigned int next;
+} exm_renditions_job_t;
+
+/* the frames of a coalesced animation transformed by `animate/3`: the
+ * workers take the next frame and apply `ops` to it, the first error
+ * sticks */
+typedef struct {
+  Image **frames;
+  unsigned int count;
+  unsigned int next;
+  const exm_op_t *ops;
+  unsigned int num_ops;
+  const ImageInfo *i_info;
+  exm_limits_t limits;
+  ErlNifMutex *mutex;
+  ExceptionType severity;
+  char errmsg[MaxTextExtent];
+} exm_frames_job_t;
+
+/* the reading end of `image_dump_stream/4`: the encoder, on a pool
+ * thread, writes into a pipe and a thread forwards what it reads as
+ * `{Ref, {data, Chunk}}` messages. A chunk is only sent on a credit,
+ * which the consumer grants with `stream_ack/2`, so the thread stops
+ * reading and the encoder blocks on the pipe once the consumer lags
+ * behind. The consumer is monitored: once it goes down, or cancels the
+ * stream, or the deadline of the handle passes while waiting for a
+ * credit (`expired`), the thread drains the pipe without sending
+ * anything */
+typedef struct {
+  int fd;
+  size_t chunk_size;
+  ErlNifPid pid;
+  ErlNifEnv *env;
+  ERL_NIF_TERM ref;
+  int failed;
+  ErlNifMutex *mutex;
+  ErlNifCond *cond;
+  unsigned long credits;
+  int cancelled;
+  int expired;
+  const exm_resource_t *resource;
+  ErlNifMonitor monitor;
+  size_t bytes;
+} exm_stream_t;
+
+typedef enum {
+  EXM_STAT_LOAD,
+  EXM_STAT_DUMP,
+  EXM_STAT_SIZE,
+  EXM_STAT_THUMB,
+  EXM_STAT_RESIZE,
+  EXM_STAT_CROP,
+  EXM_STAT_CONVERT,
+  EXM_STAT_KINDS
+} exm_stat_kind_t;
+
+/* totals of an operation since the library was loaded, refer to
+ * `exmagick_stat` */
+typedef struct {
+  unsigned long calls;
+  unsigned long errors;
+  unsigned long usecs;
+  unsigned long max_usecs;
+  unsigned long pixels;
+  unsigned long bytes_in;
+  unsigned long bytes_out;
+} exm_stat_t;
+
+/* the counters are split in shards, each thread adding to its own one
+ * (refer to `exm_stats_key`) so that concurrent calls seldom contend
+ * for the same mutex */
+typedef struct {
+  ErlNifMutex *mutex;
+  exm_stat_t stats[EXM_STAT_KINDS];
+} exm_stat_shard_t;
+
+/* a `run_pipeline_async/2` or `image_dump_stream/4` call waiting for
+ * a pool thread: its terms live in `env`, which is also used to send
+ * the result back, and `stream` is set for the latter. Jobs are
+ * resources so that the caller can be monitored, `cancelled` being set
+ * when it goes down or gives up on the result (refer to
+ * `exmagick_cancel_async`). The job itself is the reference its result
+ * is tagged with */
+typedef struct {
+  ErlNifEnv *env;
+  ErlNifPid pid;
+  ERL_NIF_TERM handle;
+  ERL_NIF_TERM ops;
+  exm_handle_t *owner;
+  exm_stream_t *stream;
+  ErlNifMonitor monitor;
+  volatile int cancelled;
+} exm_job_t;
+
+/* the threads serving async calls, started by the first of them. The
+ * queue is a ring of `capacity` jobs and submissions fail once it is
+ * full rather than piling up */
+typedef struct {
+  ErlNifMutex *mutex;
+  ErlNifCond *cond;
+  ErlNifTid *threads;
+  unsigned int num_threads;
+  exm_job_t **queue;
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+  int stopping;
+} exm_pool_t;
+
+/* the threads `renditions/3` may start on top of the calling ones, as
+ * many as the async pool has and shared by all callers, refer to
+ * `exmagick_workers_acquire` */
+typedef struct {
+  ErlNifMutex *mutex;
+  unsigned int available;
+} exm_workers_t;
+
+/* a decoded image kept by the cache of `image_load_blob`, along with a
+ * copy of the blob it was decoded from and the load options that
+ * applied, refer to `exmagick_cache_key` */
+typedef struct exm_cache_entry_t {
+  ErlNifUInt64 hash;
+  unsigned char *blob;
+  size_t blob_size;
+  char key[MaxTextExtent];
+  Image *image;
+  size_t bytes;
+  struct exm_cache_entry_t *prev;
+  struct exm_cache_entry_t *next;
+  struct exm_cache_entry_t *chain;
+} exm_cache_entry_t;
+
+/* the decoded images most recently loaded from blobs, the most recently
+ * used first. Entries are evicted from the tail once they take more
+ * than `capacity` bytes, zero disabling the cache. Lookups go through
+ * `buckets`, entries of the same bucket being chained by hash */
+typedef struct {
+  ErlNifMutex *mutex;
+  exm_cache_entry_t *head;
+  exm_cache_entry_t *tail;
+  exm_cache_entry_t *buckets[EXM_CACHE_BUCKETS];
+  size_t capacity;
+  size_t bytes;
+  unsigned long entries;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} exm_cache_t;
+
+/* the native state of the handles given back by `release/1` or garbage
+ * collected, already reset, which `init/0` and `derive/1` hand out
+ * again instead of allocating new ones */
+typedef struct {
+  ErlNifMutex *mutex;
+  exm_resource_t **handles;
+  unsigned int capacity;
+  unsigned int count;
+  unsigned long allocated;
+  unsigned long reused;
+} exm_handles_t;
+
+/* a level of the pyramid written by `exmagick_op_tiles`, which gets its
+ * rows in strips from the top down: `window` holds the rows its next row
+ * of tiles still needs, the first one being row `top` of the level, and
+ * `odd` the last row of a strip of an odd height, waiting for the next
+ * strip to be scaled into the level below along with it */
+typedef struct {
+  Image *window;
+  Image *odd;
+  unsigned long width;
+  unsigned long height;
+  unsigned long top;
+  unsigned long received;
+  unsigned long row;
+} exm_level_t;
+
+/* a Deep Zoom pyramid being written into `dir`, level 0 being a single
+ * pixel and level `count - 1` the full size image */
+typedef struct {
+  const char *dir;
+  const char *format;
+  unsigned long tile_size;
+  unsigned long overlap;
+  unsigned int count;
+  exm_level_t levels[EXM_TILES_LEVELS];
+} exm_pyramid_t;
+
 static int    exmagick_load          (ErlNifEnv *env, void **data, ERL_NIF_TERM info);
 static void   exmagick_unload        (ErlNifEnv *env, void *data);
 static void   exmagick_destroy       (ErlNifEnv *env, void *data);
+static void   exmagick_blob_destroy  (ErlNifEnv *env, void *data);
+static void   exmagick_job_destroy   (ErlNifEnv *env, void *data);
+static void   exmagick_job_down      (ErlNifEnv *env, void *data, ErlNifPid *pid, ErlNifMonitor *monitor);
+static void   exmagick_stream_destroy (ErlNifEnv *env, void *data);
+static void   exmagick_stream_down   (ErlNifEnv *env, void *data, ErlNifPid *pid, ErlNifMonitor *monitor);
+static MagickPassFail exmagick_monitor (const char *text, const magick_int64_t quantum, const magick_uint64_t span, ExceptionInfo *exception);
 static char  *exmagick_utf8strcpy    (char *dst, ErlNifBinary *utf8, size_t len);
 static int    exmagick_get_utf8str   (ErlNifEnv *env, ERL_NIF_TERM arg, ErlNifBinary *utf8);
 static int    exmagick_get_boolean_u (ErlNifEnv *env, ERL_NIF_TERM arg, unsigned int *p);
+static int    exmagick_get_choice    (ERL_NIF_TERM term, const exm_choice_t *choices, int *value);
 
 static ERL_NIF_TERM exmagick_make_utf8str (ErlNifEnv *env, const char *data);
 
+static void  exmagick_pool_stop (void);
+static void  exmagick_free_handle (exm_resource_t *resource);
+static void  exmagick_put_handle  (exm_resource_t *resource);
+static void  exmagick_unpin_handle (exm_resource_t *resource);
+static exm_resource_t *exmagick_detach_handle (exm_handle_t *handle);
+static void  exmagick_cache_resize (size_t capacity);
+static char *exmagick_apply_resource_limits (ErlNifEnv *env, ERL_NIF_TERM limits);
+static void  exmagick_stat      (exm_stat_kind_t kind, ErlNifTime start, const char *errmsg, const Image *image, size_t bytes_in, size_t bytes_out);
+
+static char *exmagick_op_swap_image   (exm_resource_t *resource, Image *image);
+
+static char *exmagick_read_text       (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+static char *exmagick_read_number     (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+static char *exmagick_read_gamma      (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+static char *exmagick_read_boolean    (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+static char *exmagick_read_flip       (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+static char *exmagick_read_colorspace (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+static char *exmagick_read_delay      (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op);
+
+static char *exmagick_convert_black_threshold (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_threshold       (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_white_threshold (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_rotate          (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_flip            (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_sharpen         (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_blur            (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_strip           (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_auto_orient     (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_colorspace      (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_gamma           (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_convert_delay           (exm_resource_t *resource, const exm_op_t *op);
+
+static char *exmagick_set_adjoin  (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_set_magick  (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_set_density (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_get_adjoin  (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_get_density (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_set_quality (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_get_quality (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_set_interlace (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_get_interlace (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_set_sampling_factor (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_get_sampling_factor (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_set_define  (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value);
+static char *exmagick_get_rows    (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_get_columns (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_get_magick  (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value);
+static char *exmagick_set_load_opts   (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM opts);
+static void  exmagick_unset_load_opts (exm_resource_t *resource);
+static char *exmagick_load_region     (exm_resource_t *resource);
+static char *exmagick_op_load_blob    (ErlNifEnv *env, exm_resource_t *resource, ErlNifBinary *blob, const ERL_NIF_TERM *opts, int use_cache);
+static char *exmagick_op_load_file    (ErlNifEnv *env, exm_resource_t *resource, ErlNifBinary *path, const ERL_NIF_TERM *opts);
+static char *exmagick_op_load_mmap    (ErlNifEnv *env, exm_resource_t *resource, ErlNifBinary *path, const ERL_NIF_TERM *opts);
+static char *exmagick_op_dump_blob    (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *blob_term);
+static char *exmagick_op_dump_file    (exm_resource_t *resource, ErlNifBinary *path);
+static char *exmagick_op_scale        (exm_resource_t *resource, long width, long height);
+static char *exmagick_op_thumb        (exm_resource_t *resource, long width, long height);
+static char *exmagick_op_resize       (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_op_crop         (exm_resource_t *resource, RectangleInfo *rect);
+static char *exmagick_op_set_magick   (exm_resource_t *resource, const char *magick);
+static char *exmagick_op_tiles        (exm_resource_t *resource, exm_pyramid_t *pyramid, const char *source, const char *size);
+static char *exmagick_op_animate      (exm_resource_t *resource, const exm_op_t *ops, unsigned int num_ops, int optimize, unsigned int concurrency);
+static char *exmagick_compile_op      (ErlNifEnv *env, int arity, const ERL_NIF_TERM args[], exm_op_t *op);
+static char *exmagick_apply_op        (exm_resource_t *resource, const exm_op_t *op);
+static char *exmagick_pipeline_step   (ErlNifEnv *env, exm_resource_t *resource, int arity, const ERL_NIF_TERM op[], ERL_NIF_TERM *result);
+static char *exmagick_run_stream      (exm_resource_t *resource, exm_stream_t *stream);
+
 static ERL_NIF_TERM exmagick_crop            (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_set_attr        (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_get_attr        (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_set_size        (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_num_pages       (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_init_handle     (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_reset           (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_release         (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_handle_stats    (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_derive          (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_page            (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_image_thumb     (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_image_resize    (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_image_load_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_image_load_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_image_load_mmap (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_image_dump_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_image_dump_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM exmagick_convert         (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_pipeline        (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_pipeline_async  (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_cancel_async    (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_ping_file       (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_ping_blob       (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_renditions      (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_batch_convert   (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_composite       (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_montage         (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_image_dump_stream (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_stream_open     (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_stream_ack      (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_stream_cancel   (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_stats           (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_set_resource_limits (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_get_resource_limits (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_limit           (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_pixels          (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_from_pixels     (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_set_cache_size  (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_cache_stats     (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_set_deadline    (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_fingerprint     (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_tiles           (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_animate         (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM exmagick_frames          (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+static ErlNifResourceType *exm_blob_type;
+static ErlNifResourceType *exm_job_type;
+static ErlNifResourceType *exm_stream_type;
+static ErlNifTSDKey exm_watch_key;
+static exm_pool_t exm_pool;
+static exm_workers_t exm_workers;
+static exm_cache_t exm_cache;
+static exm_handles_t exm_handles;
+static ImageInfo *exm_default_info;
+
+static ErlNifTSDKey exm_stats_key;
+static int exm_has_stats_key;
+static int exm_has_watch_key;
+static unsigned int exm_stats_next;
+static exm_stat_shard_t exm_stats[EXM_STAT_SHARDS];
+static const char *exm_stat_names[EXM_STAT_KINDS] = {"load", "dump", "size", "thumb", "resize", "crop", "convert"};
+
+/* the GraphicsMagick resources `set_resource_limits/1` may change */
+static const struct {
+  const char *name;
+  ResourceType type;
+} exm_resource_types[] = {
+  {"memory", MemoryResource},
+  {"map", MapResource},
+  {"disk", DiskResource},
+  {"files", FileResource},
+  {"pixels", PixelsResource},
+  {"width", WidthResource},
+  {"height", HeightResource},
+  {"threads", ThreadsResource},
+  {NULL, UndefinedResource}
+};
+
+/* the operators of `composite/5` */
+static exm_choice_t exm_composite_ops[] = {
+  {"over", OverCompositeOp, 0},
+  {"in", InCompositeOp, 0},
+  {"out", OutCompositeOp, 0},
+  {"atop", AtopCompositeOp, 0},
+  {"xor", XorCompositeOp, 0},
+  {"plus", PlusCompositeOp, 0},
+  {"minus", MinusCompositeOp, 0},
+  {"add", AddCompositeOp, 0},
+  {"subtract", SubtractCompositeOp, 0},
+  {"difference", DifferenceCompositeOp, 0},
+  {"multiply", MultiplyCompositeOp, 0},
+  {"copy", CopyCompositeOp, 0},
+  {NULL, 0, 0}
+};
+
+static exm_choice_t exm_booleans[] = {
+  {"false", 0, 0},
+  {"true", 1, 0},
+  {NULL, 0, 0}
+};
+
+/* the filters and engines of `resize/5` */
+static exm_choice_t exm_resize_filters[] = {
+  {"box", EXM_FILTER_BOX, 0},
+  {"bilinear", EXM_FILTER_BILINEAR, 0},
+  {"lanczos3", EXM_FILTER_LANCZOS3, 0},
+  {NULL, 0, 0}
+};
+
+static exm_choice_t exm_resize_engines[] = {
+  {"magick", EXM_ENGINE_MAGICK, 0},
+  {"fast", EXM_ENGINE_FAST, 0},
+  {NULL, 0, 0}
+};
+
+/* the layouts of packed pixels, `value` indexes `exm_pixel_maps` */
+static exm_choice_t exm_pixel_layouts[] = {
+  {"rgb", 0, 0},
+  {"rgba", 1, 0},
+  {"gray", 2, 0},
+  {NULL, 0, 0}
+};
+
+static const char *exm_pixel_maps[] = {"RGB", "RGBA", "I"};
+
+static exm_convert_t exm_convert_ops[] = {
+  {"black_threshold_image", exmagick_read_text, exmagick_convert_black_threshold, 0},
+  {"threshold_image", exmagick_read_number, exmagick_convert_threshold, 0},
+  {"white_threshold_image", exmagick_read_text, exmagick_convert_white_threshold, 0},
+  {"rotate", exmagick_read_number, exmagick_convert_rotate, 0},
+  {"flip", exmagick_read_flip, exmagick_convert_flip, 0},
+  {"sharpen", exmagick_read_number, exmagick_convert_sharpen, 0},
+  {"blur", exmagick_read_number, exmagick_convert_blur, 0},
+  {"strip", exmagick_read_boolean, exmagick_convert_strip, 0},
+  {"auto_orient", exmagick_read_boolean, exmagick_convert_auto_orient, 0},
+  {"colorspace", exmagick_read_colorspace, exmagick_convert_colorspace, 0},
+  {"gamma", exmagick_read_gamma, exmagick_convert_gamma, 0},
+  {"delay", exmagick_read_delay, exmagick_convert_delay, 0},
+  {NULL, NULL, NULL, 0}
+};
+
+static exm_attr_t exm_attrs[] = {
+  {"adjoin", exmagick_set_adjoin, exmagick_get_adjoin, 0},
+  {"magick", exmagick_set_magick, exmagick_get_magick, 0},
+  {"density", exmagick_set_density, exmagick_get_density, 0},
+  {"quality", exmagick_set_quality, exmagick_get_quality, 0},
+  {"interlace", exmagick_set_interlace, exmagick_get_interlace, 0},
+  {"sampling_factor", exmagick_set_sampling_factor, exmagick_get_sampling_factor, 0},
+  {"define", exmagick_set_define, NULL, 0},
+  {"rows", NULL, exmagick_get_rows, 0},
+  {"columns", NULL, exmagick_get_columns, 0},
+  {NULL, NULL, NULL, 0}
+};
+
+/* `vertical` mirrors the rows (FlipImage), `horizontal` the columns
+ * (FlopImage) */
+static exm_choice_t exm_flips[] = {
+  {"vertical", 0, 0},
+  {"horizontal", 1, 0},
+  {NULL, 0, 0}
+};
+
+/* `line` and `plane` produce progressive JPEGs and interlaced PNGs */
+static exm_choice_t exm_interlaces[] = {
+  {"none", NoInterlace, 0},
+  {"line", LineInterlace, 0},
+  {"plane", PlaneInterlace, 0},
+  {"partition", PartitionInterlace, 0},
+  {NULL, 0, 0}
+};
+
+/* the order matters, refer to `exmagick_make_fingerprint` */
+static exm_choice_t exm_fingerprints[] = {
+  {"ahash", EXM_FP_AHASH, 0},
+  {"dhash", EXM_FP_DHASH, 0},
+  {"phash", EXM_FP_PHASH, 0},
+  {"histogram", EXM_FP_HISTOGRAM, 0},
+  {"stats", EXM_FP_STATS, 0},
+  {NULL, 0, 0}
+};
+
+/* indexed by `DisposeType` */
+static const char *exm_disposes[] = {"undefined", "none", "background", "previous"};
+
+static exm_choice_t exm_colorspaces[] = {
+  {"rgb", RGBColorspace, 0},
+  {"srgb", sRGBColorspace, 0},
+  {"gray", GRAYColorspace, 0},
+  {"cmyk", CMYKColorspace, 0},
+  {"hsl", HSLColorspace, 0},
+  {"lab", LABColorspace, 0},
+  {"ycbcr", Rec601YCbCrColorspace, 0},
+  {NULL, 0, 0}
+};
+
+/* atoms are created once in `exmagick_load` so that hot paths may
+ * compare terms with `enif_is_identical` instead of `strcmp` */
+static ERL_NIF_TERM exm_atom_load_blob;
+static ERL_NIF_TERM exm_atom_load_file;
+static ERL_NIF_TERM exm_atom_load_mmap;
+static ERL_NIF_TERM exm_atom_dump_blob;
+static ERL_NIF_TERM exm_atom_dump_file;
+static ERL_NIF_TERM exm_atom_size;
+static ERL_NIF_TERM exm_atom_thumb;
+static ERL_NIF_TERM exm_atom_resize;
+static ERL_NIF_TERM exm_atom_crop;
+static ERL_NIF_TERM exm_atom_convert;
+static ERL_NIF_TERM exm_atom_magick;
+static ERL_NIF_TERM exm_atom_attr;
+static ERL_NIF_TERM exm_atom_max_size;
+static ERL_NIF_TERM exm_atom_pages;
+static ERL_NIF_TERM exm_atom_region;
+static ERL_NIF_TERM exm_atom_infinity;
 
 #ifdef EXM_NO_DIRTY_SCHED
 ErlNifFunc exmagick_interface[] =
 {
   {"init", 0, exmagick_init_handle},
+  {"reset", 1, exmagick_reset},
+  {"release", 1, exmagick_release},
+  {"handle_stats", 0, exmagick_handle_stats},
+  {"derive", 1, exmagick_derive},
+  {"page", 2, exmagick_page},
   {"image_load_blob", 2, exmagick_image_load_blob},
   {"image_load_file", 2, exmagick_image_load_file},
+  {"image_load_blob", 3, exmagick_image_load_blob},
+  {"image_load_file", 3, exmagick_image_load_file},
+  {"image_load_mmap", 2, exmagick_image_load_mmap},
+  {"image_load_mmap", 3, exmagick_image_load_mmap},
   {"image_dump_file", 2, exmagick_image_dump_file},
   {"image_dump_blob", 1, exmagick_image_dump_blob},
   {"set_attr", 3, exmagick_set_attr},
   {"get_attr", 2, exmagick_get_attr},
-  {"thumb", 3, exmagick_image_thumb},
-  {"size", 3, exmagick_set_size},
+  {"image_thumb", 3, exmagick_image_thumb},
+  {"image_resize", 5, exmagick_image_resize},
+  {"image_size", 3, exmagick_set_size},
   {"num_pages", 1, exmagick_num_pages},
-  {"crop", 5, exmagick_crop},
-  {"convert", 3, exmagick_convert}
+  {"image_crop", 5, exmagick_crop},
+  {"image_convert", 3, exmagick_convert},
+  {"run_pipeline", 2, exmagick_pipeline},
+  {"run_pipeline_async", 2, exmagick_pipeline_async},
+  {"cancel_async", 1, exmagick_cancel_async},
+  {"ping_file", 2, exmagick_ping_file},
+  {"ping_blob", 2, exmagick_ping_blob},
+  {"run_renditions", 3, exmagick_renditions},
+  {"run_batch_convert", 3, exmagick_batch_convert},
+  {"image_composite", 5, exmagick_composite},
+  {"image_montage", 4, exmagick_montage},
+  {"image_dump_stream", 4, exmagick_image_dump_stream},
+  {"stream_open", 1, exmagick_stream_open},
+  {"stream_ack", 2, exmagick_stream_ack},
+  {"stream_cancel", 1, exmagick_stream_cancel},
+  {"stats", 0, exmagick_stats},
+  {"set_resource_limits", 1, exmagick_set_resource_limits},
+  {"resource_limits", 0, exmagick_get_resource_limits},
+  {"limit", 2, exmagick_limit},
+  {"image_pixels", 4, exmagick_pixels},
+  {"image_from_pixels", 6, exmagick_from_pixels},
+  {"set_cache_size", 1, exmagick_set_cache_size},
+  {"cache_stats", 0, exmagick_cache_stats},
+  {"set_deadline", 2, exmagick_set_deadline},
+  {"image_fingerprint", 2, exmagick_fingerprint},
+  {"image_animate", 4, exmagick_animate},
+  {"image_tiles", 7, exmagick_tiles},
+  {"image_frames", 1, exmagick_frames}
 };
 #else
 ErlNifFunc exmagick_interface[] =
 {
   {"init", 0, exmagick_init_handle, 0},
+  {"reset", 1, exmagick_reset, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"release", 1, exmagick_release, 0},
+  {"handle_stats", 0, exmagick_handle_stats, 0},
+  {"derive", 1, exmagick_derive, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"page", 2, exmagick_page, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"image_load_blob", 2, exmagick_image_load_blob, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"image_load_file", 2, exmagick_image_load_file, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_load_blob", 3, exmagick_image_load_blob, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_load_file", 3, exmagick_image_load_file, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_load_mmap", 2, exmagick_image_load_mmap, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_load_mmap", 3, exmagick_image_load_mmap, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"image_dump_file", 2, exmagick_image_dump_file, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"image_dump_blob", 1, exmagick_image_dump_blob, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"set_attr", 3, exmagick_set_attr, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"get_attr", 2, exmagick_get_attr, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-  {"thumb", 3, exmagick_image_thumb, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-  {"size", 3, exmagick_set_size, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_thumb", 3, exmagick_image_thumb, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_resize", 5, exmagick_image_resize, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_size", 3, exmagick_set_size, ERL_NIF_DIRTY_JOB_CPU_BOUND},
   {"num_pages", 1, exmagick_num_pages, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-  {"crop", 5, exmagick_crop, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-  {"convert", 3, exmagick_convert, ERL_NIF_DIRTY_JOB_CPU_BOUND}
+  {"image_crop", 5, exmagick_crop, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_convert", 3, exmagick_convert, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"run_pipeline", 2, exmagick_pipeline, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"run_pipeline_async", 2, exmagick_pipeline_async, 0},
+  {"cancel_async", 1, exmagick_cancel_async, 0},
+  {"ping_file", 2, exmagick_ping_file, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"ping_blob", 2, exmagick_ping_blob, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"run_renditions", 3, exmagick_renditions, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"run_batch_convert", 3, exmagick_batch_convert, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_composite", 5, exmagick_composite, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_montage", 4, exmagick_montage, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_dump_stream", 4, exmagick_image_dump_stream, 0},
+  {"stream_open", 1, exmagick_stream_open, 0},
+  {"stream_ack", 2, exmagick_stream_ack, 0},
+  {"stream_cancel", 1, exmagick_stream_cancel, 0},
+  {"stats", 0, exmagick_stats, 0},
+  {"set_resource_limits", 1, exmagick_set_resource_limits, 0},
+  {"resource_limits", 0, exmagick_get_resource_limits, 0},
+  {"limit", 2, exmagick_limit, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_pixels", 4, exmagick_pixels, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_from_pixels", 6, exmagick_from_pixels, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"set_cache_size", 1, exmagick_set_cache_size, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"cache_stats", 0, exmagick_cache_stats, 0},
+  {"set_deadline", 2, exmagick_set_deadline, 0},
+  {"image_fingerprint", 2, exmagick_fingerprint, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_animate", 4, exmagick_animate, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_tiles", 7, exmagick_tiles, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+  {"image_frames", 1, exmagick_frames, ERL_NIF_DIRTY_JOB_CPU_BOUND}
 };
 #endif
 
@@ -89,64 +824,303 @@ ERL_NIF_INIT(Elixir.ExMagick, exmagick_interface, exmagick_load, NULL, NULL, exm
 /**
  * Initializes the module once per VM
  * - creates a new type name "ExMagick"
- * - starts GraphicMagick
+ * - creates a new type name "ExMagick.Blob"
+ * - creates a new type name "ExMagick.Job", monitoring the callers of async jobs
+ * - creates the atoms used by the pipeline, `convert/3` and `attr/3`
+ * - reads the `{Threads, QueueSize, Limits, CacheSize, HandlePoolSize}` from `info`,
+ *   `Threads` bounding the rendition workers as well
+ * - resets the operation counters, the decoded image cache and the handle pool
+ * - starts GraphicMagick, applies the resource `Limits` and installs
+ *   `exmagick_monitor` to abort operations past their deadline
+ * - releases what it created through `exmagick_unload` when it fails
  */
 static
 int exmagick_load (ErlNifEnv *env, void **data, const ERL_NIF_TERM info)
 {
+  int k, arity;
+  unsigned long cache_size;
+  unsigned int handle_pool_size;
+  const ERL_NIF_TERM *pool_info;
+  ErlNifResourceTypeInit job_init;
   void *type = enif_open_resource_type(env, "Elixir", "ExMagick", exmagick_destroy, ERL_NIF_RT_CREATE, NULL);
   if (type == NULL)
   { return(-1); }
+
+  memset(&exm_pool, 0, sizeof(exm_pool_t));
+  memset(&exm_workers, 0, sizeof(exm_workers_t));
+  memset(&exm_cache, 0, sizeof(exm_cache_t));
+  memset(&exm_handles, 0, sizeof(exm_handles_t));
+  memset(exm_stats, 0, sizeof(exm_stats));
+  exm_stats_next    = 0;
+  exm_has_stats_key = 0;
+  exm_has_watch_key = 0;
+  exm_default_info  = NULL;
+  if (0 == enif_get_tuple(env, info, &arity, &pool_info) || arity != 5
+      || 0 == enif_get_uint(env, pool_info[0], &exm_pool.num_threads) || exm_pool.num_threads == 0
+      || 0 == enif_get_uint(env, pool_info[1], &exm_pool.capacity) || exm_pool.capacity == 0
+      || 0 == enif_get_ulong(env, pool_info[3], &cache_size)
+      || 0 == enif_get_uint(env, pool_info[4], &handle_pool_size))
+  { return(-1); }
+
+  /* a pool without a mutex has no condition variable either */
+  if (NULL == (exm_pool.mutex = enif_mutex_create("exmagick_pool")))
+  { goto ehandler; }
+  if (NULL == (exm_pool.cond = enif_cond_create("exmagick_pool")))
+  { goto ehandler; }
+  if (NULL == (exm_workers.mutex = enif_mutex_create("exmagick_workers")))
+  { goto ehandler; }
+  exm_workers.available = exm_pool.num_threads;
+
+  for (k = 0; k < EXM_STAT_SHARDS; k += 1)
+  {
+    if (NULL == (exm_stats[k].mutex = enif_mutex_create("exmagick_stats")))
+    { goto ehandler; }
+  }
+  if (0 != enif_tsd_key_create("exmagick_stats", &exm_stats_key))
+  { goto ehandler; }
+  exm_has_stats_key = 1;
+
+  exm_cache.mutex    = enif_mutex_create("exmagick_cache");
+  exm_cache.capacity = cache_size;
+  if (exm_cache.mutex == NULL)
+  { goto ehandler; }
+
+  exm_handles.mutex    = enif_mutex_create("exmagick_handles");
+  exm_handles.handles  = enif_alloc((handle_pool_size + 1) * sizeof(exm_resource_t *));
+  exm_handles.capacity = handle_pool_size;
+  if (exm_handles.mutex == NULL || exm_handles.handles == NULL)
+  { goto ehandler; }
+
+  /* the resource types opened by a failed load are dropped by the VM */
+  exm_blob_type = enif_open_resource_type(env, "Elixir", "ExMagick.Blob", exmagick_blob_destroy, ERL_NIF_RT_CREATE, NULL);
+  if (exm_blob_type == NULL)
+  { goto ehandler; }
+
+  job_init.dtor = exmagick_job_destroy;
+  job_init.stop = NULL;
+  job_init.down = exmagick_job_down;
+  exm_job_type  = enif_open_resource_type_x(env, "ExMagick.Job", &job_init, ERL_NIF_RT_CREATE, NULL);
+  if (exm_job_type == NULL || 0 != enif_tsd_key_create("exmagick_watch", &exm_watch_key))
+  { goto ehandler; }
+  exm_has_watch_key = 1;
+
+  job_init.dtor   = exmagick_stream_destroy;
+  job_init.down   = exmagick_stream_down;
+  exm_stream_type = enif_open_resource_type_x(env, "ExMagick.Stream", &job_init, ERL_NIF_RT_CREATE, NULL);
+  if (exm_stream_type == NULL)
+  { goto ehandler; }
+
+  exm_atom_load_blob = enif_make_atom(env, "load_blob");
+  exm_atom_load_file = enif_make_atom(env, "load_file");
+  exm_atom_load_mmap = enif_make_atom(env, "load_mmap");
+  exm_atom_dump_blob = enif_make_atom(env, "dump_blob");
+  exm_atom_dump_file = enif_make_atom(env, "dump_file");
+  exm_atom_size      = enif_make_atom(env, "size");
+  exm_atom_thumb     = enif_make_atom(env, "thumb");
+  exm_atom_resize    = enif_make_atom(env, "resize");
+  exm_atom_crop      = enif_make_atom(env, "crop");
+  exm_atom_convert   = enif_make_atom(env, "convert");
+  exm_atom_magick    = enif_make_atom(env, "magick");
+  exm_atom_attr      = enif_make_atom(env, "attr");
+  exm_atom_max_size  = enif_make_atom(env, "max_size");
+  exm_atom_pages     = enif_make_atom(env, "pages");
+  exm_atom_region    = enif_make_atom(env, "region");
+  exm_atom_infinity  = enif_make_atom(env, "infinity");
+
+  for (k = 0; exm_convert_ops[k].name != NULL; k += 1)
+  { exm_convert_ops[k].atom = enif_make_atom(env, exm_convert_ops[k].name); }
+  for (k = 0; exm_attrs[k].name != NULL; k += 1)
+  { exm_attrs[k].atom = enif_make_atom(env, exm_attrs[k].name); }
+  for (k = 0; exm_flips[k].name != NULL; k += 1)
+  { exm_flips[k].atom = enif_make_atom(env, exm_flips[k].name); }
+  for (k = 0; exm_colorspaces[k].name != NULL; k += 1)
+  { exm_colorspaces[k].atom = enif_make_atom(env, exm_colorspaces[k].name); }
+  for (k = 0; exm_interlaces[k].name != NULL; k += 1)
+  { exm_interlaces[k].atom = enif_make_atom(env, exm_interlaces[k].name); }
+  for (k = 0; exm_fingerprints[k].name != NULL; k += 1)
+  { exm_fingerprints[k].atom = enif_make_atom(env, exm_fingerprints[k].name); }
+  for (k = 0; exm_composite_ops[k].name != NULL; k += 1)
+  { exm_composite_ops[k].atom = enif_make_atom(env, exm_composite_ops[k].name); }
+  for (k = 0; exm_booleans[k].name != NULL; k += 1)
+  { exm_booleans[k].atom = enif_make_atom(env, exm_booleans[k].name); }
+  for (k = 0; exm_resize_filters[k].name != NULL; k += 1)
+  { exm_resize_filters[k].atom = enif_make_atom(env, exm_resize_filters[k].name); }
+  for (k = 0; exm_resize_engines[k].name != NULL; k += 1)
+  { exm_resize_engines[k].atom = enif_make_atom(env, exm_resize_engines[k].name); }
+  for (k = 0; exm_pixel_layouts[k].name != NULL; k += 1)
+  { exm_pixel_layouts[k].atom = enif_make_atom(env, exm_pixel_layouts[k].name); }
+
   InitializeMagick(NULL);
+  SetMonitorHandler(exmagick_monitor);
+  if (NULL != exmagick_apply_resource_limits(env, pool_info[2]))
+  { goto ehandler; }
+
+  /* what `exmagick_reset_handle` restores */
+  exm_default_info = CloneImageInfo(0);
+  if (exm_default_info == NULL)
+  { goto ehandler; }
+
   *data = type;
   return(0);
+
+ehandler:
+  exmagick_unload(env, NULL);
+  return(-1);
 }
 
 static
 int exmagick_get_boolean_u (ErlNifEnv *env, ERL_NIF_TERM arg, unsigned int *p)
 {
-  int ecode;
-  char atom[EXM_MAX_ATOM_SIZE];
-  if (0 != (ecode = enif_get_atom(env, arg, atom, EXM_MAX_ATOM_SIZE, ERL_NIF_LATIN1)))
-  {
-    if (strcmp("true", atom) == 0)
-    { *p = 1; }
-    else if (strcmp("false", atom) == 0)
-    { *p = 0; }
-    else
-    { ecode = 0; }
-  }
+  int value;
+  if (0 == exmagick_get_choice(arg, exm_booleans, &value))
+  { return(0); }
 
-  return(ecode);
+  *p = (unsigned int) value;
+  return(1);
 }
 
 static
 int exmagick_get_double (ErlNifEnv *env, ERL_NIF_TERM arg, double *dbl)
 {
   int ecode;
+  long integer;
 
-  ecode = enif_get_double(env, arg, dbl);
+  if (0 != (ecode = enif_get_double(env, arg, dbl)))
+  { return(ecode); }
 
+  if (0 != (ecode = enif_get_long(env, arg, &integer)))
+  { *dbl = (double) integer; }
   return(ecode);
 }
 
+/*
+  Garbage collects a handle: its native state goes back to the pool,
+  unless `release/1` already took care of it.
+ */
 static
 void exmagick_destroy (ErlNifEnv *env, void *data)
 {
-  exm_resource_t *resource = (exm_resource_t *) data;
-  if (resource->image != NULL)
-  { DestroyImage(resource->image); }
+  exm_handle_t *handle = (exm_handle_t *) data;
+  exmagick_unpin_handle(exmagick_detach_handle(handle));
+}
 
-  if (resource->i_info != NULL)
-  { DestroyImageInfo(resource->i_info); }
+static
+void exmagick_blob_destroy (ErlNifEnv *env, void *data)
+{
+  exm_blob_t *blob = (exm_blob_t *) data;
+  if (blob->data != NULL)
+  { MagickFree(blob->data); }
 
-  resource->image  = NULL;
-  resource->i_info = NULL;
+  blob->data = NULL;
+  blob->size = 0;
+}
+
+static
+void exmagick_job_destroy (ErlNifEnv *env, void *data)
+{
+  exm_job_t *job = (exm_job_t *) data;
+  if (job->owner != NULL)
+  { enif_release_resource(job->owner); }
+  if (job->stream != NULL)
+  { enif_release_resource(job->stream); }
+  if (job->env != NULL)
+  { enif_free_env(job->env); }
+
+  job->owner    = NULL;
+  job->stream   = NULL;
+  job->env      = NULL;
+}
+
+/*
+  The caller of a job went down: the job is aborted and so is the
+  stream it may be encoding into, which would otherwise wait for the
+  credits of a consumer that is not going to get the result.
+ */
+static
+void exmagick_job_down (ErlNifEnv *env, void *data, ErlNifPid *pid, ErlNifMonitor *monitor)
+{
+  exm_job_t *job = (exm_job_t *) data;
+
+  job->cancelled = 1;
+  if (job->stream != NULL)
+  { exmagick_stream_down(env, job->stream, pid, monitor); }
+}
+
+static
+void exmagick_stream_destroy (ErlNifEnv *env, void *data)
+{
+  exm_stream_t *stream = (exm_stream_t *) data;
+  if (stream->cond != NULL)
+  { enif_cond_destroy(stream->cond); }
+  if (stream->mutex != NULL)
+  { enif_mutex_destroy(stream->mutex); }
+  if (stream->env != NULL)
+  { enif_free_env(stream->env); }
+
+  stream->cond  = NULL;
+  stream->mutex = NULL;
+  stream->env   = NULL;
+}
+
+static
+void exmagick_stream_down (ErlNifEnv *env, void *data, ErlNifPid *pid, ErlNifMonitor *monitor)
+{
+  exm_stream_t *stream = (exm_stream_t *) data;
+
+  enif_mutex_lock(stream->mutex);
+  stream->cancelled = 1;
+  enif_cond_broadcast(stream->cond);
+  enif_mutex_unlock(stream->mutex);
 }
 
 static
 void exmagick_unload (ErlNifEnv *env, void *priv_data)
-{}
+{
+  int k;
+
+  exmagick_pool_stop();
+  if (exm_workers.mutex != NULL)
+  { enif_mutex_destroy(exm_workers.mutex); }
+  exm_workers.mutex = NULL;
+
+  for (k = 0; k < EXM_STAT_SHARDS; k += 1)
+  {
+    if (exm_stats[k].mutex != NULL)
+    { enif_mutex_destroy(exm_stats[k].mutex); }
+    exm_stats[k].mutex = NULL;
+  }
+  if (exm_has_stats_key)
+  { enif_tsd_key_destroy(exm_stats_key); }
+  exm_has_stats_key = 0;
+
+  if (exm_cache.mutex != NULL)
+  {
+    exmagick_cache_resize(0);
+    enif_mutex_destroy(exm_cache.mutex);
+  }
+  exm_cache.mutex = NULL;
+
+  if (exm_handles.handles != NULL)
+  {
+    while (exm_handles.count > 0)
+    {
+      exm_handles.count -= 1;
+      exmagick_free_handle(exm_handles.handles[exm_handles.count]);
+    }
+    enif_free(exm_handles.handles);
+  }
+  exm_handles.handles = NULL;
+  if (exm_handles.mutex != NULL)
+  { enif_mutex_destroy(exm_handles.mutex); }
+  exm_handles.mutex = NULL;
+
+  if (exm_default_info != NULL)
+  { DestroyImageInfo(exm_default_info); }
+  exm_default_info = NULL;
+  if (exm_has_watch_key)
+  { enif_tsd_key_destroy(exm_watch_key); }
+  exm_has_watch_key = 0;
+}
 
 static
 char *exmagick_utf8strcpy (char *dst, ErlNifBinary *utf8, size_t size)
@@ -168,6 +1142,19 @@ char *exmagick_utf8strdup (ErlNifBinary *utf8)
   return exmagick_utf8strcpy(dst, utf8, utf8->size + 1);
 }
 
+/*
+  The string returned in this function must be freed using MagickFree.
+ */
+static
+char *exmagick_strdup (const char *str)
+{
+  size_t len = strlen(str);
+  char *dst = MagickMalloc(len + 1);
+  if (dst == NULL) { return NULL; }
+  memcpy(dst, str, len + 1);
+  return dst;
+}
+
 static
 ERL_NIF_TERM exmagick_make_utf8str (ErlNifEnv *env, const char *data)
 {
@@ -185,461 +1172,5822 @@ static
 int exmagick_get_utf8str (ErlNifEnv *env, const ERL_NIF_TERM arg, ErlNifBinary *utf8)
 { return(enif_inspect_binary(env, arg, utf8)); }
 
+/*
+  Allocates the native state of a new handle with default values,
+  refer to `exmagick_make_handle`.
+ */
 static
-ERL_NIF_TERM exmagick_init_handle (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+exm_resource_t *exmagick_alloc_handle (void)
 {
-  ERL_NIF_TERM result;
-
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
-  exm_resource_t *resource = enif_alloc_resource(type, sizeof(exm_resource_t));
+  exm_resource_t *resource = enif_alloc(sizeof(exm_resource_t));
   if (resource == NULL)
-  { EXM_FAIL(ehandler, "enif_alloc_resource"); }
+  { return(NULL); }
 
   /* initializes exception to default values (badly named function) */
   GetExceptionInfo(&resource->e_info);
 
+  memset(&resource->limits, 0, sizeof(exm_limits_t));
+  resource->defines[0] = '\0';
+  resource->refs   = 0;
   resource->image  = NULL;
+  resource->lock   = enif_rwlock_create("exmagick.handle");
   resource->i_info = CloneImageInfo(0);
-  if (resource->i_info == NULL)
-  { EXM_FAIL(ehandler, "CloneImageInfo"); }
-
-  result = enif_make_resource(env, (void *) resource);
-  enif_release_resource(resource);
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
-
-ehandler:
-  if (resource != NULL)
+  resource->deadline_lock = enif_mutex_create("exmagick.deadline");
+  if (resource->lock == NULL || resource->i_info == NULL || resource->deadline_lock == NULL)
   {
-    if (resource->i_info != NULL)
-    { DestroyImageInfo(resource->i_info); }
-    enif_release_resource(resource);
+    exmagick_free_handle(resource);
+    return(NULL);
   }
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+
+  return(resource);
 }
 
 static
-ERL_NIF_TERM exmagick_set_size (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+void exmagick_free_handle (exm_resource_t *resource)
 {
-  long width, height;
-  Image* resized_image;
-  exm_resource_t *resource;
+  if (resource->image != NULL)
+  { DestroyImageList(resource->image); }
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  if (resource->i_info != NULL)
+  { DestroyImageInfo(resource->i_info); }
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+  if (resource->lock != NULL)
+  { enif_rwlock_destroy(resource->lock); }
 
-  if (resource->image == NULL)
-  { EXM_FAIL(ehandler, "image not loaded"); }
+  if (resource->deadline_lock != NULL)
+  { enif_mutex_destroy(resource->deadline_lock); }
 
-  if (0 == enif_get_long(env, argv[1], &width))
-  { EXM_FAIL(ehandler, "width: bad argument"); }
+  DestroyExceptionInfo(&resource->e_info);
+  enif_free(resource);
+}
 
-  if (0 == enif_get_long(env, argv[2], &height))
-  { EXM_FAIL(ehandler, "height: bad argument"); }
+/*
+  Brings a handle back to the state `exmagick_alloc_handle` leaves it
+  in, keeping its lock and its image info: the image is released and
+  the fields of the image info changed by `attr/3` and the load options
+  are restored from `exm_default_info`. The caller holds the write lock.
+ */
+static
+void exmagick_reset_handle (exm_resource_t *resource)
+{
+  ImageInfo *i_info = resource->i_info;
 
-  resized_image = ScaleImage(resource->image, width, height, &resource->e_info);
-  if (resized_image == NULL)
-  {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
-  }
-  DestroyImage(resource->image);
-  resource->image = resized_image;
+  if (resource->image != NULL)
+  { DestroyImageList(resource->image); }
+  resource->image = NULL;
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  MagickFree(i_info->size);
+  MagickFree(i_info->tile);
+  MagickFree(i_info->density);
+  MagickFree(i_info->sampling_factor);
+  i_info->size            = NULL;
+  i_info->tile            = NULL;
+  i_info->density         = NULL;
+  i_info->sampling_factor = NULL;
+  (void) RemoveDefinitions(i_info, "*");
+  resource->defines[0] = '\0';
 
-ehandler:
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+  i_info->subimage  = 0;
+  i_info->subrange  = 0;
+  i_info->adjoin    = exm_default_info->adjoin;
+  i_info->quality   = exm_default_info->quality;
+  i_info->interlace = exm_default_info->interlace;
+  strcpy(i_info->magick, exm_default_info->magick);
+  strcpy(i_info->filename, exm_default_info->filename);
+
+  /* releases the strings of the last exception */
+  DestroyExceptionInfo(&resource->e_info);
+  GetExceptionInfo(&resource->e_info);
+  enif_mutex_lock(resource->deadline_lock);
+  memset(&resource->limits, 0, sizeof(exm_limits_t));
+  enif_mutex_unlock(resource->deadline_lock);
 }
 
+/*
+  Takes the native state of a handle from the pool or allocates a new
+  one when the pool is empty. The state holds the reference of the
+  handle it is given to.
+ */
 static
-ERL_NIF_TERM exmagick_num_pages (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+exm_resource_t *exmagick_acquire_handle (void)
 {
-  exm_resource_t *resource;
-  Image* image;
-  int num_pages;
+  exm_resource_t *resource = NULL;
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  enif_mutex_lock(exm_handles.mutex);
+  if (exm_handles.count > 0)
+  {
+    exm_handles.count -= 1;
+    exm_handles.reused += 1;
+    resource = exm_handles.handles[exm_handles.count];
+  }
+  else
+  { exm_handles.allocated += 1; }
+  enif_mutex_unlock(exm_handles.mutex);
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+  if (resource == NULL)
+  { resource = exmagick_alloc_handle(); }
+  if (resource != NULL)
+  { resource->refs = 1; }
+  return(resource);
+}
 
-  if (resource->image == NULL)
-  { EXM_FAIL(ehandler, "image not loaded"); }
+/*
+  Resets the native state of a handle nobody uses anymore and gives it
+  to the pool, or frees it when the pool is full.
+ */
+static
+void exmagick_put_handle (exm_resource_t *resource)
+{
+  int pooled = 0;
 
-  image = resource->image;
-  num_pages = 1;
+  exmagick_reset_handle(resource);
+  if (exm_handles.mutex != NULL)
+  {
+    enif_mutex_lock(exm_handles.mutex);
+    if (exm_handles.count < exm_handles.capacity)
+    {
+      exm_handles.handles[exm_handles.count] = resource;
+      exm_handles.count += 1;
+      pooled = 1;
+    }
+    enif_mutex_unlock(exm_handles.mutex);
+  }
 
-  while((image = image->next))
-  { ++num_pages; }
+  if (0 == pooled)
+  { exmagick_free_handle(resource); }
+}
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_int(env, num_pages)));
+/*
+  Wraps the native state of a handle into the resource the VM sees. The
+  state is given back (`exmagick_put_handle`) on failure.
+ */
+static
+char *exmagick_make_handle (ErlNifEnv *env, ErlNifResourceType *type, exm_resource_t *resource, ERL_NIF_TERM *term)
+{
+  exm_handle_t *handle = enif_alloc_resource(type, sizeof(exm_handle_t));
+  if (handle == NULL)
+  {
+    exmagick_put_handle(resource);
+    return("enif_alloc_resource");
+  }
 
-ehandler:
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+  handle->resource = resource;
+  *term = enif_make_resource(env, handle);
+  enif_release_resource(handle);
+  return(NULL);
 }
 
+/*
+  Takes a reference to the native state of `handle`, NULL once it is
+  released. The state stays valid, and owned by this handle, until the
+  reference is dropped with `exmagick_unpin_handle`.
+ */
 static
-ERL_NIF_TERM exmagick_crop (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+exm_resource_t *exmagick_pin_handle (exm_handle_t *handle)
 {
-  Image* cropped_image;
-  RectangleInfo rect;
   exm_resource_t *resource;
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  enif_mutex_lock(exm_handles.mutex);
+  resource = handle->resource;
+  if (resource != NULL)
+  { resource->refs += 1; }
+  enif_mutex_unlock(exm_handles.mutex);
+  return(resource);
+}
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
+/*
+  Drops a reference taken by `exmagick_pin_handle`, or the one of the
+  handle itself (`exmagick_detach_handle`). The last one gives the
+  state back with `exmagick_put_handle`; NULL is ignored.
+ */
+static
+void exmagick_unpin_handle (exm_resource_t *resource)
+{
+  unsigned int refs;
+
+  if (resource == NULL)
+  { return; }
+
+  enif_mutex_lock(exm_handles.mutex);
+  resource->refs -= 1;
+  refs = resource->refs;
+  enif_mutex_unlock(exm_handles.mutex);
+  if (refs == 0)
+  { exmagick_put_handle(resource); }
+}
+
+/*
+  Detaches the native state from `handle`, returning it with the
+  reference of the handle, or NULL when it was already detached.
+ */
+static
+exm_resource_t *exmagick_detach_handle (exm_handle_t *handle)
+{
+  exm_resource_t *resource;
+
+  enif_mutex_lock(exm_handles.mutex);
+  resource = handle->resource;
+  handle->resource = NULL;
+  enif_mutex_unlock(exm_handles.mutex);
+  return(resource);
+}
+
+/*
+  Pins the native state of the handle `term`, failing for anything else
+  and for released handles. The caller drops the reference with
+  `exmagick_unpin_handle` once it released the lock of the state.
+ */
+static
+int exmagick_get_handle (ErlNifEnv *env, ERL_NIF_TERM term, ErlNifResourceType *type, exm_resource_t **resource)
+{
+  exm_handle_t *handle;
+
+  if (0 == enif_get_resource(env, term, type, (void **) &handle))
+  { return(0); }
+  *resource = exmagick_pin_handle(handle);
+  return(*resource != NULL);
+}
+
+/*
+  Builds `{error, Reason}`. The messages of `exmagick_check_limits` are
+  reported as `{error, {resource_limit, Kind}}` and the ones of
+  `exmagick_watch_check` as `{error, timeout | cancelled}`.
+ */
+static
+ERL_NIF_TERM exmagick_make_error (ErlNifEnv *env, const char *errmsg)
+{
+  size_t len = strlen(EXM_LIMIT_PREFIX);
+  ERL_NIF_TERM reason;
+
+  if (0 == strncmp(errmsg, EXM_LIMIT_PREFIX, len))
+  { reason = enif_make_tuple2(env, enif_make_atom(env, "resource_limit"), enif_make_atom(env, errmsg + len)); }
+  else if (0 == strncmp(errmsg, EXM_ABORT_PREFIX, strlen(EXM_ABORT_PREFIX)))
+  { reason = enif_make_atom(env, errmsg + strlen(EXM_ABORT_PREFIX)); }
+  else
+  { reason = exmagick_make_utf8str(env, errmsg); }
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), reason));
+}
+
+static
+ERL_NIF_TERM exmagick_make_result (ErlNifEnv *env, const char *errmsg, ERL_NIF_TERM value)
+{
+  if (errmsg != NULL)
+  { return(exmagick_make_error(env, errmsg)); }
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), value));
+}
+
+/*
+  Builds the result of the calls `measure/4` reports on,
+  `{ok, Value, Width, Height}` with the size of the image afterwards
+  (zero without image), so that it needs no `size/1` call. The caller
+  holds the lock of the handle.
+ */
+static
+ERL_NIF_TERM exmagick_make_measured (ErlNifEnv *env, const char *errmsg, ERL_NIF_TERM value, const exm_resource_t *resource)
+{
+  const Image *image = resource->image;
+
+  if (errmsg != NULL)
+  { return(exmagick_make_error(env, errmsg)); }
+  return(enif_make_tuple4(env, enif_make_atom(env, "ok"), value,
+                          enif_make_ulong(env, image == NULL ? 0 : image->columns),
+                          enif_make_ulong(env, image == NULL ? 0 : image->rows)));
+}
+
+/*
+  Tells which GraphicsMagick resource limit an image of `columns` x
+  `rows` (0 x 0 when not known) runs past, as a message of the form of
+  the ones of `exmagick_check_limits`. GraphicsMagick reports every
+  exhausted resource with the same exception type, so the limits are
+  checked again here: the dimensions and pixels first, then the disk
+  budget the pixel cache would spill to, the memory one otherwise.
+ */
+static
+char *exmagick_limit_reason (unsigned long columns, unsigned long rows)
+{
+  magick_int64_t limit;
+  magick_int64_t pixels = (magick_int64_t) columns * (magick_int64_t) rows;
+
+  limit = GetMagickResourceLimit(WidthResource);
+  if (limit > 0 && (magick_int64_t) columns > limit)
+  { return(EXM_LIMIT_PREFIX "width"); }
+  limit = GetMagickResourceLimit(HeightResource);
+  if (limit > 0 && (magick_int64_t) rows > limit)
+  { return(EXM_LIMIT_PREFIX "height"); }
+  limit = GetMagickResourceLimit(PixelsResource);
+  if (limit > 0 && pixels > limit)
+  { return(EXM_LIMIT_PREFIX "pixels"); }
+  limit = GetMagickResourceLimit(DiskResource);
+  if (limit > 0 && GetMagickResource(DiskResource) + pixels * (magick_int64_t) sizeof(PixelPacket) > limit)
+  { return(EXM_LIMIT_PREFIX "disk"); }
+  return(EXM_LIMIT_PREFIX "memory");
+}
+
+static
+int exmagick_is_limit_error (const ExceptionInfo *e_info)
+{ return(e_info->severity == ResourceLimitError || e_info->severity == ResourceLimitFatalError); }
+
+/*
+  Returns the reason of the exception GraphicsMagick has just thrown.
+  Resource limit errors are translated by `exmagick_limit_reason`
+  without an image size; the operations that know the size of the
+  image they failed on translate them again with it.
+ */
+static
+char *exmagick_exception_reason (ExceptionInfo *e_info)
+{
+  CatchException(e_info);
+  if (exmagick_is_limit_error(e_info))
+  { return(exmagick_limit_reason(0, 0)); }
+  return(e_info->reason);
+}
+
+/*
+  Multiplies the factors of a buffer size, failing (returning 0) when
+  the product does not fit.
+ */
+static
+int exmagick_mul_size (size_t a, size_t b, size_t *product)
+{
+  if (a != 0 && b > (size_t) -1 / a)
+  { return(0); }
+  *product = a * b;
+  return(1);
+}
+
+/*
+  Checks an image of `columns` x `rows` with `pixels` pixels in total
+  (all its frames) against the limits of a handle. Dimensions past
+  `EXM_MAX_DIMENSION` are always rejected, as is a single frame whose
+  pixels do not fit in an `unsigned long` (`pixels` would have wrapped).
+ */
+static
+char *exmagick_check_limits (const exm_limits_t *limits, unsigned long columns, unsigned long rows, unsigned long pixels)
+{
+  if (columns > EXM_MAX_DIMENSION || (limits->width != 0 && columns > limits->width))
+  { return(EXM_LIMIT_PREFIX "width"); }
+  if (rows > EXM_MAX_DIMENSION || (limits->height != 0 && rows > limits->height))
+  { return(EXM_LIMIT_PREFIX "height"); }
+  if (rows != 0 && columns > ULONG_MAX / rows)
+  { return(EXM_LIMIT_PREFIX "pixels"); }
+  if (limits->pixels != 0 && pixels > limits->pixels)
+  { return(EXM_LIMIT_PREFIX "pixels"); }
+  return(NULL);
+}
+
+/*
+  Checks every frame of an image against the limits of a handle.
+ */
+static
+char *exmagick_check_image (const exm_limits_t *limits, const Image *image)
+{
+  unsigned long columns = 0, rows = 0, pixels = 0;
+
+  for (; image != NULL; image = image->next)
+  {
+    columns = image->columns > columns ? image->columns : columns;
+    rows    = image->rows > rows ? image->rows : rows;
+    pixels += image->columns * image->rows;
+  }
+  return(exmagick_check_limits(limits, columns, rows, pixels));
+}
+
+/*
+  Checks the header of the image about to be read, as read by
+  `PingImage` or `PingBlob`, against the limits of the handle so that
+  oversized images get rejected before any pixel is decoded.
+ */
+static
+char *exmagick_check_ping (exm_resource_t *resource, Image *pinged)
+{
+  char *errmsg = NULL;
+
+  if (pinged == NULL)
+  { return(exmagick_exception_reason(&resource->e_info)); }
+
+  errmsg = exmagick_check_image(&resource->limits, pinged);
+  DestroyImageList(pinged);
+  return(errmsg);
+}
+
+static
+int exmagick_has_limits (const exm_limits_t *limits)
+{ return(limits->width != 0 || limits->height != 0 || limits->pixels != 0); }
+
+/*
+  Reads the deadline of a handle, returning 0 when it has none.
+ */
+static
+int exmagick_get_deadline (const exm_resource_t *resource, ErlNifTime *deadline)
+{
+  int has_deadline;
+
+  enif_mutex_lock(resource->deadline_lock);
+  has_deadline = resource->limits.has_deadline;
+  *deadline    = resource->limits.deadline;
+  enif_mutex_unlock(resource->deadline_lock);
+  return(has_deadline);
+}
+
+/*
+  Copies the limits of a handle, whose deadline may change while the
+  caller holds its lock.
+ */
+static
+void exmagick_copy_limits (exm_limits_t *limits, const exm_resource_t *resource)
+{
+  *limits = resource->limits;
+  limits->has_deadline = exmagick_get_deadline(resource, &limits->deadline);
+}
+
+/*
+  Tells whether the operation being watched should stop: its caller is
+  gone or its deadline has passed. The first reason found sticks.
+ */
+static
+char *exmagick_watch_check (exm_watch_t *watch)
+{
+  ErlNifTime deadline;
+
+  if (watch->abort == NULL && watch->cancelled != NULL && *watch->cancelled != 0)
+  { watch->abort = EXM_ABORT_PREFIX "cancelled"; }
+  if (watch->abort == NULL && watch->env != NULL && 0 == enif_is_current_process_alive(watch->env))
+  { watch->abort = EXM_ABORT_PREFIX "cancelled"; }
+  if (watch->abort == NULL && exmagick_get_deadline(watch->resource, &deadline) && enif_monotonic_time(ERL_NIF_MSEC) >= deadline)
+  { watch->abort = EXM_ABORT_PREFIX "timeout"; }
+  return(watch->abort);
+}
+
+/*
+  Checks the operation watched by the current thread, if any.
+ */
+static
+char *exmagick_watch_poll (void)
+{
+  exm_watch_t *watch = (exm_watch_t *) enif_tsd_get(exm_watch_key);
+  return(watch == NULL ? NULL : exmagick_watch_check(watch));
+}
+
+/*
+  The GraphicsMagick progress monitor: coders and image operations
+  call it every few rows and stop once it fails. It is called from
+  OpenMP threads too, where nothing is watched and it always passes,
+  so aborting relies on the thread that started the operation.
+ */
+static
+MagickPassFail exmagick_monitor (const char *text, const magick_int64_t quantum, const magick_uint64_t span, ExceptionInfo *exception)
+{ return(NULL == exmagick_watch_poll() ? MagickPass : MagickFail); }
+
+/*
+  Watches the operations the current thread runs until
+  `exmagick_watch_stop`, on behalf of the process of `env` (or of an
+  async job, refer to `exm_job_t`) and within the deadline of
+  `resource`. Returns the reason to give up right away, if any.
+ */
+static
+char *exmagick_watch_start (exm_watch_t *watch, ErlNifEnv *env, volatile int *cancelled, const exm_resource_t *resource)
+{
+  watch->env       = env;
+  watch->cancelled = cancelled;
+  watch->resource  = resource;
+  watch->abort     = NULL;
+  enif_tsd_set(exm_watch_key, watch);
+  return(exmagick_watch_check(watch));
+}
+
+/*
+  Stops watching the current thread. An operation that was aborted
+  reports why, whatever it returned, as coders may return a partial
+  image once the monitor fails.
+ */
+static
+char *exmagick_watch_stop (exm_watch_t *watch, char *errmsg)
+{
+  enif_tsd_set(exm_watch_key, NULL);
+  return(watch->abort != NULL ? watch->abort : errmsg);
+}
+
+/*
+  Returns the shard of the counters of the calling thread, assigning
+  one the first time.
+ */
+static
+exm_stat_shard_t *exmagick_stat_shard (void)
+{
+  exm_stat_shard_t *shard = (exm_stat_shard_t *) enif_tsd_get(exm_stats_key);
+
+  if (shard == NULL)
+  {
+    enif_mutex_lock(exm_stats[0].mutex);
+    shard = &exm_stats[exm_stats_next % EXM_STAT_SHARDS];
+    exm_stats_next += 1;
+    enif_mutex_unlock(exm_stats[0].mutex);
+    enif_tsd_set(exm_stats_key, shard);
+  }
+  return(shard);
+}
+
+/*
+  Adds a call of `kind` that started at `start` to the counters. The
+  pixels of `image` (every frame of it) are counted as the pixels the
+  operation produced.
+ */
+static
+void exmagick_stat (exm_stat_kind_t kind, ErlNifTime start, const char *errmsg, const Image *image, size_t bytes_in, size_t bytes_out)
+{
+  unsigned long pixels    = 0;
+  unsigned long usecs     = (unsigned long) (enif_monotonic_time(ERL_NIF_USEC) - start);
+  exm_stat_shard_t *shard = exmagick_stat_shard();
+  exm_stat_t *counters    = &shard->stats[kind];
+
+  for (; errmsg == NULL && image != NULL; image = image->next)
+  { pixels += image->columns * image->rows; }
+
+  enif_mutex_lock(shard->mutex);
+  counters->calls     += 1;
+  counters->errors    += errmsg == NULL ? 0 : 1;
+  counters->usecs     += usecs;
+  counters->max_usecs  = usecs > counters->max_usecs ? usecs : counters->max_usecs;
+  counters->pixels    += pixels;
+  counters->bytes_in  += bytes_in;
+  counters->bytes_out += bytes_out;
+  enif_mutex_unlock(shard->mutex);
+}
+
+static
+size_t exmagick_file_size (const char *filename)
+{
+  struct stat info;
+  if (0 != stat(filename, &info))
+  { return(0); }
+  return(info.st_size);
+}
+
+/*
+  Returns the counters of every operation since the library was loaded
+  along with the memory, memory-mapped and disk pixel cache currently
+  in use by GraphicsMagick.
+ */
+static
+ERL_NIF_TERM exmagick_stats (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int k, n;
+  exm_stat_t stats[EXM_STAT_KINDS];
+  const exm_stat_t *shard;
+  ERL_NIF_TERM op, result = enif_make_new_map(env);
+
+  memset(stats, 0, sizeof(stats));
+  for (n = 0; n < EXM_STAT_SHARDS; n += 1)
+  {
+    enif_mutex_lock(exm_stats[n].mutex);
+    for (k = 0; k < EXM_STAT_KINDS; k += 1)
+    {
+      shard = &exm_stats[n].stats[k];
+      stats[k].calls     += shard->calls;
+      stats[k].errors    += shard->errors;
+      stats[k].usecs     += shard->usecs;
+      stats[k].max_usecs  = shard->max_usecs > stats[k].max_usecs ? shard->max_usecs : stats[k].max_usecs;
+      stats[k].pixels    += shard->pixels;
+      stats[k].bytes_in  += shard->bytes_in;
+      stats[k].bytes_out += shard->bytes_out;
+    }
+    enif_mutex_unlock(exm_stats[n].mutex);
+  }
+
+  for (k = 0; k < EXM_STAT_KINDS; k += 1)
+  {
+    op = enif_make_new_map(env);
+    enif_make_map_put(env, op, enif_make_atom(env, "calls"), enif_make_ulong(env, stats[k].calls), &op);
+    enif_make_map_put(env, op, enif_make_atom(env, "errors"), enif_make_ulong(env, stats[k].errors), &op);
+    enif_make_map_put(env, op, enif_make_atom(env, "usecs"), enif_make_ulong(env, stats[k].usecs), &op);
+    enif_make_map_put(env, op, enif_make_atom(env, "max_usecs"), enif_make_ulong(env, stats[k].max_usecs), &op);
+    enif_make_map_put(env, op, enif_make_atom(env, "pixels"), enif_make_ulong(env, stats[k].pixels), &op);
+    enif_make_map_put(env, op, enif_make_atom(env, "bytes_in"), enif_make_ulong(env, stats[k].bytes_in), &op);
+    enif_make_map_put(env, op, enif_make_atom(env, "bytes_out"), enif_make_ulong(env, stats[k].bytes_out), &op);
+    enif_make_map_put(env, result, enif_make_atom(env, exm_stat_names[k]), op, &result);
+  }
+
+  enif_make_map_put(env, result, enif_make_atom(env, "memory"), enif_make_int64(env, GetMagickResource(MemoryResource)), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "map"), enif_make_int64(env, GetMagickResource(MapResource)), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "disk"), enif_make_int64(env, GetMagickResource(DiskResource)), &result);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+}
+
+/*
+  Reads a `{Resource, Limit}` entry, `k` being set to the index of the
+  resource in `exm_resource_types`.
+ */
+static
+char *exmagick_get_resource_limit (ErlNifEnv *env, ERL_NIF_TERM entry, int *k, ErlNifSInt64 *value)
+{
+  int arity;
+  const ERL_NIF_TERM *limit;
+  char atom[EXM_MAX_ATOM_SIZE];
+
+  if (0 == enif_get_tuple(env, entry, &arity, &limit) || arity != 2
+      || 0 == enif_get_atom(env, limit[0], atom, EXM_MAX_ATOM_SIZE, ERL_NIF_LATIN1)
+      || 0 == enif_get_int64(env, limit[1], value) || *value < 0)
+  { return("resource limits: bad argument"); }
+
+  for (*k = 0; exm_resource_types[*k].name != NULL; *k += 1)
+  {
+    if (strcmp(exm_resource_types[*k].name, atom) == 0)
+    { return(NULL); }
+  }
+  return("resource limits: unknown resource");
+}
+
+/*
+  Sets the node-wide GraphicsMagick resource limits given as a list of
+  `{Resource, Limit}`, refer to `exm_resource_types`. Either all of them
+  are set or none: the list is checked as a whole first, and the limits
+  set before one GraphicsMagick refuses are reverted.
+ */
+static
+char *exmagick_apply_resource_limits (ErlNifEnv *env, ERL_NIF_TERM limits)
+{
+  int k;
+  char *errmsg = NULL;
+  ErlNifSInt64 value;
+  ERL_NIF_TERM head, tail;
+  magick_int64_t previous[sizeof(exm_resource_types) / sizeof(exm_resource_types[0])];
+
+  tail = limits;
+  while (errmsg == NULL && enif_get_list_cell(env, tail, &head, &tail))
+  { errmsg = exmagick_get_resource_limit(env, head, &k, &value); }
+  if (errmsg == NULL && 0 == enif_is_list(env, tail))
+  { errmsg = "resource limits: bad argument"; }
+  if (errmsg != NULL)
+  { return(errmsg); }
+
+  for (k = 0; exm_resource_types[k].name != NULL; k += 1)
+  { previous[k] = GetMagickResourceLimit(exm_resource_types[k].type); }
+
+  tail = limits;
+  while (enif_get_list_cell(env, tail, &head, &tail))
+  {
+    (void) exmagick_get_resource_limit(env, head, &k, &value);
+    if (MagickFail == SetMagickResourceLimit(exm_resource_types[k].type, value))
+    {
+      for (k = 0; exm_resource_types[k].name != NULL; k += 1)
+      { (void) SetMagickResourceLimit(exm_resource_types[k].type, previous[k]); }
+      return("could not set the resource limit");
+    }
+  }
+  return(NULL);
+}
+
+static
+ERL_NIF_TERM exmagick_set_resource_limits (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  char *errmsg = exmagick_apply_resource_limits(env, argv[0]);
+  if (errmsg != NULL)
+  { return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg))); }
+  return(enif_make_atom(env, "ok"));
+}
+
+static
+ERL_NIF_TERM exmagick_get_resource_limits (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int k;
+  ERL_NIF_TERM limits = enif_make_new_map(env);
+
+  for (k = 0; exm_resource_types[k].name != NULL; k += 1)
+  {
+    enif_make_map_put(env, limits, enif_make_atom(env, exm_resource_types[k].name),
+                      enif_make_int64(env, GetMagickResourceLimit(exm_resource_types[k].type)), &limits);
+  }
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), limits));
+}
+
+/*
+  Sets the bytes the decoded image cache may hold, evicting the least
+  recently used images right away when it shrinks. Zero disables the
+  cache and releases all of its images.
+ */
+static
+ERL_NIF_TERM exmagick_set_cache_size (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  unsigned long capacity;
+
+  if (0 == enif_get_ulong(env, argv[0], &capacity))
+  { return(exmagick_make_error(env, "argv[0]: bad argument")); }
+
+  exmagick_cache_resize(capacity);
+  return(enif_make_atom(env, "ok"));
+}
+
+static
+ERL_NIF_TERM exmagick_cache_stats (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  size_t capacity, bytes;
+  unsigned long entries, hits, misses, evictions;
+  ERL_NIF_TERM result = enif_make_new_map(env);
+
+  enif_mutex_lock(exm_cache.mutex);
+  capacity  = exm_cache.capacity;
+  bytes     = exm_cache.bytes;
+  entries   = exm_cache.entries;
+  hits      = exm_cache.hits;
+  misses    = exm_cache.misses;
+  evictions = exm_cache.evictions;
+  enif_mutex_unlock(exm_cache.mutex);
+
+  enif_make_map_put(env, result, enif_make_atom(env, "size"), enif_make_ulong(env, capacity), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "bytes"), enif_make_ulong(env, bytes), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "entries"), enif_make_ulong(env, entries), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "hits"), enif_make_ulong(env, hits), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "misses"), enif_make_ulong(env, misses), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "evictions"), enif_make_ulong(env, evictions), &result);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+}
+
+/*
+  Reads a list of `{width | height | pixels, Limit}` into `limits`, the
+  limits not given being left unset (0).
+ */
+static
+char *exmagick_read_limits (ErlNifEnv *env, ERL_NIF_TERM list, exm_limits_t *limits)
+{
+  int arity;
+  unsigned long value, *field;
+  const ERL_NIF_TERM *limit;
+  ERL_NIF_TERM head, tail;
+  char atom[EXM_MAX_ATOM_SIZE];
+
+  memset(limits, 0, sizeof(exm_limits_t));
+  tail = list;
+  while (enif_get_list_cell(env, tail, &head, &tail))
+  {
+    if (0 == enif_get_tuple(env, head, &arity, &limit) || arity != 2
+        || 0 == enif_get_atom(env, limit[0], atom, EXM_MAX_ATOM_SIZE, ERL_NIF_LATIN1)
+        || 0 == enif_get_ulong(env, limit[1], &value) || value == 0)
+    { return("limits: bad argument"); }
+
+    if (strcmp("width", atom) == 0)
+    { field = &limits->width; }
+    else if (strcmp("height", atom) == 0)
+    { field = &limits->height; }
+    else if (strcmp("pixels", atom) == 0)
+    { field = &limits->pixels; }
+    else
+    { return("limits: unknown limit"); }
+    *field = value;
+  }
+
+  if (0 == enif_is_list(env, tail))
+  { return("limits: bad argument"); }
+  return(NULL);
+}
+
+/*
+  Lowers the `width`, `height` and `pixels` limits of a handle. Limits
+  are never raised, so code receiving a handle can not undo the limits
+  set by its owner.
+ */
+static
+ERL_NIF_TERM exmagick_limit (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_limits_t limits;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (NULL != (errmsg = exmagick_read_limits(env, argv[1], &limits)))
+  { goto ehandler; }
+
+  EXM_WLOCK(resource);
+  if (limits.width != 0 && (resource->limits.width == 0 || limits.width < resource->limits.width))
+  { resource->limits.width = limits.width; }
+  if (limits.height != 0 && (resource->limits.height == 0 || limits.height < resource->limits.height))
+  { resource->limits.height = limits.height; }
+  if (limits.pixels != 0 && (resource->limits.pixels == 0 || limits.pixels < resource->limits.pixels))
+  { resource->limits.pixels = limits.pixels; }
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Sets the deadline of the operations on a handle, a time of the
+  Erlang monotonic clock in milliseconds, or clears it (`infinity`).
+  Operations past the deadline are aborted, refer to `exmagick_monitor`,
+  the ones already running included: the deadline is guarded by its
+  own mutex rather than by the lock they hold.
+ */
+static
+ERL_NIF_TERM exmagick_set_deadline (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int has_deadline = 1;
+  ErlNifSInt64 deadline = 0;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (enif_is_identical(argv[1], exm_atom_infinity))
+  { has_deadline = 0; }
+  else if (0 == enif_get_int64(env, argv[1], &deadline))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  enif_mutex_lock(resource->deadline_lock);
+  resource->limits.has_deadline = has_deadline;
+  resource->limits.deadline     = (ErlNifTime) deadline;
+  enif_mutex_unlock(resource->deadline_lock);
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_init_handle (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM result;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  exm_resource_t *resource = exmagick_acquire_handle();
+  if (resource == NULL)
+  { EXM_FAIL(ehandler, "exmagick_alloc_handle"); }
+
+  if (NULL != (errmsg = exmagick_make_handle(env, type, resource, &result)))
+  { goto ehandler; }
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+
+ehandler:
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Brings the handle back to its initial state, refer to
+  `exmagick_reset_handle`.
+ */
+static
+ERL_NIF_TERM exmagick_reset (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  EXM_WLOCK(resource);
+  exmagick_reset_handle(resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Detaches the native state from the handle, any later call with the
+  handle failing with "invalid handle". The state goes to the pool,
+  unless the pool is full, once the calls still using it are done, so
+  that `init/0` hands it out again.
+ */
+static
+ERL_NIF_TERM exmagick_release (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_handle_t *handle;
+  exm_resource_t *resource;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == enif_get_resource(env, argv[0], type, (void **) &handle))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (NULL == (resource = exmagick_detach_handle(handle)))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  exmagick_unpin_handle(resource);
+  return(enif_make_atom(env, "ok"));
+
+ehandler:
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_handle_stats (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_handles_t handles;
+  ERL_NIF_TERM result = enif_make_new_map(env);
+
+  enif_mutex_lock(exm_handles.mutex);
+  memcpy(&handles, &exm_handles, sizeof(exm_handles_t));
+  enif_mutex_unlock(exm_handles.mutex);
+
+  enif_make_map_put(env, result, enif_make_atom(env, "size"), enif_make_uint(env, handles.capacity), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "pooled"), enif_make_uint(env, handles.count), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "allocated"), enif_make_ulong(env, handles.allocated), &result);
+  enif_make_map_put(env, result, enif_make_atom(env, "reused"), enif_make_ulong(env, handles.reused), &result);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+}
+
+/*
+  Creates a new handle sharing the image of another one. The image
+  list is cloned without copying its pixels, which GraphicsMagick only
+  copies once either image gets modified, so the source may keep
+  serving other derivations concurrently.
+ */
+static
+ERL_NIF_TERM exmagick_derive (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int has_image;
+  ERL_NIF_TERM result;
+  ImageInfo *i_info;
+  exm_resource_t *resource = NULL;
+  exm_resource_t *derived = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  derived = exmagick_acquire_handle();
+  if (derived == NULL)
+  { EXM_FAIL(ehandler, "exmagick_alloc_handle"); }
+
+  EXM_RLOCK(resource);
+  i_info    = CloneImageInfo(resource->i_info);
+  has_image = resource->image != NULL;
+  exmagick_copy_limits(&derived->limits, resource);
+  strcpy(derived->defines, resource->defines);
+  if (has_image)
+  { derived->image = CloneImageList(resource->image, &derived->e_info); }
+  EXM_RUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  resource = NULL;
+
+  if (i_info == NULL)
+  { EXM_FAIL(ehandler, "CloneImageInfo"); }
+  DestroyImageInfo(derived->i_info);
+  derived->i_info = i_info;
+
+  if (has_image && derived->image == NULL)
+  { EXM_FAIL(ehandler, exmagick_exception_reason(&derived->e_info)); }
+
+  errmsg  = exmagick_make_handle(env, type, derived, &result);
+  derived = NULL;
+  if (errmsg != NULL)
+  { goto ehandler; }
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+
+ehandler:
+  result = enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg));
+  exmagick_unpin_handle(resource);
+  if (derived != NULL)
+  { exmagick_put_handle(derived); }
+  return(result);
+}
+
+/*
+  Reads the layout of packed pixels: `map` is one of `rgb`, `rgba` or
+  `gray` and `depth` the bits of each channel, either 8 or 16 (in
+  native byte order). `pixel_size` receives the bytes of a pixel.
+ */
+static
+char *exmagick_get_pixel_layout (ErlNifEnv *env, ERL_NIF_TERM map, ERL_NIF_TERM depth, const char **gm_map, StorageType *storage, size_t *pixel_size)
+{
+  unsigned int bits;
+  int layout;
+
+  if (0 == enif_is_atom(env, map))
+  { return("map: bad argument"); }
+
+  if (0 == exmagick_get_choice(map, exm_pixel_layouts, &layout))
+  { return("map: unknown map"); }
+  *gm_map = exm_pixel_maps[layout];
+
+  if (0 == enif_get_uint(env, depth, &bits) || (bits != 8 && bits != 16))
+  { return("depth: bad argument"); }
+
+  *storage    = bits == 8 ? CharPixel : ShortPixel;
+  *pixel_size = strlen(*gm_map) * (bits / 8);
+  return(NULL);
+}
+
+/*
+  Exports the `{X, Y, W, H}` region (or `all` of the image) as packed
+  pixels, refer to `exmagick_get_pixel_layout`. Reading pixels goes
+  through the pixel cache of the image, which is not meant to be used
+  by many threads at once, hence the write lock.
+ */
+static
+ERL_NIF_TERM exmagick_pixels (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int arity;
+  long x = 0, y = 0;
+  unsigned long width = 0, height = 0;
+  size_t pixel_size, size;
+  const char *map;
+  const ERL_NIF_TERM *region = NULL;
+  StorageType storage;
+  ErlNifBinary pixels;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_is_atom(env, argv[1]))
+  {
+    if (0 == enif_get_tuple(env, argv[1], &arity, &region) || arity != 4
+        || 0 == enif_get_long(env, region[0], &x) || 0 == enif_get_long(env, region[1], &y)
+        || 0 == enif_get_ulong(env, region[2], &width) || 0 == enif_get_ulong(env, region[3], &height)
+        || x < 0 || y < 0)
+    { EXM_FAIL(ehandler, "region: bad argument"); }
+  }
+
+  if (NULL != (errmsg = exmagick_get_pixel_layout(env, argv[2], argv[3], &map, &storage, &pixel_size)))
+  { goto ehandler; }
+
+  result = argv[0];
+  EXM_WLOCK(resource);
+  if (resource->image == NULL)
+  { errmsg = "image not loaded"; }
+  else if (region == NULL)
+  {
+    width  = resource->image->columns;
+    height = resource->image->rows;
+  }
+  else if ((unsigned long) x >= resource->image->columns || width > resource->image->columns - x
+           || (unsigned long) y >= resource->image->rows || height > resource->image->rows - y)
+  { errmsg = "region: out of bounds"; }
+
+  if (errmsg == NULL && (0 == exmagick_mul_size(width, height, &size) || 0 == exmagick_mul_size(size, pixel_size, &size)))
+  { errmsg = "region: too large"; }
+
+  if (errmsg == NULL && 0 == enif_alloc_binary(size, &pixels))
+  { errmsg = "enif_alloc_binary"; }
+  else if (errmsg == NULL)
+  {
+    if (0 == DispatchImage(resource->image, x, y, width, height, map, storage, pixels.data, &resource->e_info))
+    {
+      errmsg = exmagick_exception_reason(&resource->e_info);
+      enif_release_binary(&pixels);
+    }
+    else
+    { result = enif_make_binary(env, &pixels); }
+  }
+
+  result = exmagick_make_result(env, errmsg, result);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Replaces the image of the handle by one made of the packed pixels
+  `argv[1]` of `argv[2]` x `argv[3]` pixels, refer to
+  `exmagick_get_pixel_layout`.
+ */
+static
+ERL_NIF_TERM exmagick_from_pixels (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  size_t pixel_size;
+  unsigned long width, height;
+  const char *map;
+  StorageType storage;
+  ErlNifBinary pixels;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_inspect_binary(env, argv[1], &pixels))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  if (0 == enif_get_ulong(env, argv[2], &width) || width == 0)
+  { EXM_FAIL(ehandler, "width: bad argument"); }
+
+  if (0 == enif_get_ulong(env, argv[3], &height) || height == 0)
+  { EXM_FAIL(ehandler, "height: bad argument"); }
+
+  if (NULL != (errmsg = exmagick_get_pixel_layout(env, argv[4], argv[5], &map, &storage, &pixel_size)))
+  { goto ehandler; }
+
+  if (pixels.size / pixel_size / width != height || pixels.size != width * height * pixel_size)
+  { EXM_FAIL(ehandler, "pixels: size does not match the dimensions"); }
+
+  EXM_WLOCK(resource);
+  errmsg = exmagick_check_limits(&resource->limits, width, height, width * height);
+  if (errmsg == NULL)
+  { errmsg = exmagick_op_swap_image(resource, ConstituteImage(width, height, map, storage, pixels.data, &resource->e_info)); }
+  result = exmagick_make_result(env, errmsg, argv[0]);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Creates a new handle holding a copy of the zero-based `argv[1]` frame
+  of another handle. Only that frame is cloned, and its pixels are
+  shared with the source until either image gets modified.
+ */
+static
+ERL_NIF_TERM exmagick_page (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  long index;
+  int has_image;
+  Image *frame;
+  ERL_NIF_TERM result;
+  ImageInfo *i_info;
+  exm_resource_t *resource = NULL;
+  exm_resource_t *derived = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_get_long(env, argv[1], &index) || index < 0)
+  { EXM_FAIL(ehandler, "page: bad argument"); }
+
+  derived = exmagick_acquire_handle();
+  if (derived == NULL)
+  { EXM_FAIL(ehandler, "exmagick_alloc_handle"); }
+
+  EXM_RLOCK(resource);
+  i_info    = CloneImageInfo(resource->i_info);
+  has_image = resource->image != NULL;
+  frame     = has_image ? GetImageFromList(resource->image, index) : NULL;
+  exmagick_copy_limits(&derived->limits, resource);
+  strcpy(derived->defines, resource->defines);
+  if (frame != NULL)
+  { derived->image = CloneImage(frame, 0, 0, 1, &derived->e_info); }
+  EXM_RUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  resource = NULL;
+
+  if (i_info == NULL)
+  { EXM_FAIL(ehandler, "CloneImageInfo"); }
+  DestroyImageInfo(derived->i_info);
+  derived->i_info = i_info;
+
+  if (frame == NULL)
+  { EXM_FAIL(ehandler, has_image ? "page not found" : "image not loaded"); }
+
+  if (derived->image == NULL)
+  { EXM_FAIL(ehandler, exmagick_exception_reason(&derived->e_info)); }
+
+  errmsg  = exmagick_make_handle(env, type, derived, &result);
+  derived = NULL;
+  if (errmsg != NULL)
+  { goto ehandler; }
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+
+ehandler:
+  result = enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg));
+  exmagick_unpin_handle(resource);
+  if (derived != NULL)
+  { exmagick_put_handle(derived); }
+  return(result);
+}
+
+/*
+  Draws the image of the handle `argv[1]` over the (first frame of the)
+  image of `argv[0]` at `argv[2]`, `argv[3]` using the operator
+  `argv[4]`, refer to `exm_composite_ops`. The overlay is copied, which
+  shares its pixels, before the handle gets locked, so handles never
+  wait on each other and a handle may be drawn over itself.
+ */
+static
+ERL_NIF_TERM exmagick_composite (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int op;
+  long x, y;
+  Image *overlay = NULL;
+  ExceptionInfo e_info;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL, *other = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == exmagick_get_handle(env, argv[1], type, &other))
+  { EXM_FAIL(ehandler, "argv[1]: invalid handle"); }
+
+  if (0 == enif_get_long(env, argv[2], &x) || 0 == enif_get_long(env, argv[3], &y))
+  { EXM_FAIL(ehandler, "composite: bad argument"); }
+
+  if (0 == enif_is_atom(env, argv[4]))
+  { EXM_FAIL(ehandler, "argv[4]: bad argument"); }
+  if (0 == exmagick_get_choice(argv[4], exm_composite_ops, &op))
+  { EXM_FAIL(ehandler, "composite: unknown operator"); }
+
+  GetExceptionInfo(&e_info);
+  EXM_RLOCK(other);
+  if (other->image != NULL)
+  { overlay = CloneImage(other->image, 0, 0, 1, &e_info); }
+  EXM_RUNLOCK(other);
+  exmagick_unpin_handle(other);
+
+  EXM_WLOCK(resource);
+  if (overlay == NULL)
+  { errmsg = e_info.severity == UndefinedException ? "overlay not loaded" : exmagick_exception_reason(&e_info); }
+  else if (resource->image == NULL)
+  { errmsg = "image not loaded"; }
+  else if (0 == CompositeImage(resource->image, (CompositeOperator) op, overlay, x, y))
+  { errmsg = exmagick_exception_reason(&resource->image->exception); }
+  result = exmagick_make_result(env, errmsg, argv[0]);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+
+  if (overlay != NULL)
+  { DestroyImage(overlay); }
+  DestroyExceptionInfo(&e_info);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  exmagick_unpin_handle(other);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Computes the span of `cells` cells of `size` pixels with `spacing`
+  pixels between them, failing (returning 0) when it does not fit.
+ */
+static
+int exmagick_montage_span (unsigned long cells, unsigned long size, unsigned long spacing, unsigned long *span)
+{
+  if (size > ULONG_MAX / cells || spacing > (ULONG_MAX - cells * size) / cells)
+  { return(0); }
+  *span = cells * size + (cells - 1) * spacing;
+  return(1);
+}
+
+/*
+  Builds a new handle out of the images of the handles in `argv[0]`,
+  laid out in rows of `argv[1]` cells with `argv[2]` pixels between
+  them over a background of color `argv[3]`. Every cell is as big as
+  the biggest image and images are drawn at the top left corner of
+  theirs, straight into a canvas allocated once. The canvas is checked
+  against the limits of the first handle, which the new one inherits,
+  before it is allocated.
+ */
+static
+ERL_NIF_TERM exmagick_montage (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  unsigned int k, count, columns, rows;
+  unsigned long spacing, width = 0, height = 0, canvas_width, canvas_height;
+  int has_image;
+  exm_limits_t limits;
+  char background[MaxTextExtent];
+  Image *canvas;
+  ErlNifBinary utf8;
+  ERL_NIF_TERM head, tail, result;
+  exm_resource_t *tile;
+  exm_resource_t *montage = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  memset(&limits, 0, sizeof(limits));
+  if (0 == enif_get_list_length(env, argv[0], &count) || count == 0)
+  { EXM_FAIL(ehandler, "argv[0]: bad argument"); }
+
+  if (0 == enif_get_uint(env, argv[1], &columns) || columns == 0)
+  { EXM_FAIL(ehandler, "columns: bad argument"); }
+
+  if (0 == enif_get_ulong(env, argv[2], &spacing))
+  { EXM_FAIL(ehandler, "spacing: bad argument"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[3], &utf8))
+  { EXM_FAIL(ehandler, "background: bad argument"); }
+  exmagick_utf8strcpy(background, &utf8, MaxTextExtent);
+
+  tail = argv[0];
+  for (k = 0; enif_get_list_cell(env, tail, &head, &tail); k += 1)
+  {
+    if (0 == exmagick_get_handle(env, head, type, &tile))
+    { EXM_FAIL(ehandler, "invalid handle"); }
+
+    EXM_RLOCK(tile);
+    if (k == 0)
+    { exmagick_copy_limits(&limits, tile); }
+    has_image = tile->image != NULL;
+    if (has_image)
+    {
+      width  = tile->image->columns > width ? tile->image->columns : width;
+      height = tile->image->rows > height ? tile->image->rows : height;
+    }
+    EXM_RUNLOCK(tile);
+    exmagick_unpin_handle(tile);
+
+    if (!has_image)
+    { EXM_FAIL(ehandler, "image not loaded"); }
+  }
+
+  columns = columns < count ? columns : count;
+  rows    = (count + columns - 1) / columns;
+
+  if (0 == exmagick_montage_span(columns, width, spacing, &canvas_width))
+  { EXM_FAIL(ehandler, EXM_LIMIT_PREFIX "width"); }
+  if (0 == exmagick_montage_span(rows, height, spacing, &canvas_height))
+  { EXM_FAIL(ehandler, EXM_LIMIT_PREFIX "height"); }
+  if (NULL != (errmsg = exmagick_check_limits(&limits, canvas_width, canvas_height, canvas_width * canvas_height)))
+  { goto ehandler; }
+
+  montage = exmagick_acquire_handle();
+  if (montage == NULL)
+  { EXM_FAIL(ehandler, "exmagick_alloc_handle"); }
+  montage->limits = limits;
+
+  canvas = montage->image = AllocateImage(montage->i_info);
+  if (canvas == NULL)
+  { EXM_FAIL(ehandler, "AllocateImage"); }
+
+  canvas->columns = canvas_width;
+  canvas->rows    = canvas_height;
+  if (0 == QueryColorDatabase(background, &canvas->background_color, &montage->e_info))
+  { EXM_FAIL(ehandler, "background: unknown color"); }
+  canvas->matte = canvas->background_color.opacity != OpaqueOpacity;
+  SetImage(canvas, canvas->background_color.opacity);
+
+  tail = argv[0];
+  for (k = 0; errmsg == NULL && enif_get_list_cell(env, tail, &head, &tail); k += 1)
+  {
+    if (0 == exmagick_get_handle(env, head, type, &tile))
+    {
+      errmsg = "invalid handle";
+      break;
+    }
+
+    EXM_RLOCK(tile);
+    if (tile->image == NULL)
+    { errmsg = "image not loaded"; }
+    else if (0 == CompositeImage(canvas, OverCompositeOp, tile->image,
+                                 (k % columns) * (width + spacing), (k / columns) * (height + spacing)))
+    { errmsg = exmagick_exception_reason(&canvas->exception); }
+    EXM_RUNLOCK(tile);
+    exmagick_unpin_handle(tile);
+  }
+  if (errmsg != NULL)
+  { goto ehandler; }
+
+  errmsg  = exmagick_make_handle(env, type, montage, &result);
+  montage = NULL;
+  if (errmsg != NULL)
+  { goto ehandler; }
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
+
+ehandler:
+  result = exmagick_make_error(env, errmsg);
+  if (montage != NULL)
+  { exmagick_put_handle(montage); }
+  return(result);
+}
+
+/*
+  Replaces the image held by the resource, releasing the previous one
+  right away. A NULL image means the GraphicsMagick call that produced
+  it failed and its reason is returned instead.
+ */
+static
+char *exmagick_op_swap_image (exm_resource_t *resource, Image *image)
+{
+  if (image == NULL)
+  { return(exmagick_exception_reason(&resource->e_info)); }
+
+  if (resource->image != NULL)
+  { DestroyImageList(resource->image); }
+  resource->image = image;
+  return(NULL);
+}
+
+/*
+  Applies the options given to `image_load/3` to the image info. They
+  only concern the next read and must be reverted using
+  `exmagick_unset_load_opts` afterwards.
+
+  - `{max_size, W, H}`: sets the size hint, which allows coders such as
+    JPEG to decode a downscaled image (never smaller than WxH) instead
+    of the full resolution one;
+
+  - `{pages, First, Count}`: reads only `Count` frames starting at the
+    zero-based `First` one, so multi-page coders (PDF, TIFF, GIF) skip
+    the pages nobody asked for;
+
+  - `{region, X, Y, W, H}`: sets the tile geometry, so coders that
+    support it (the raw ones, such as GRAY or RGB) read only that region
+    of the image. Refer to `exmagick_load_region` for the others, which
+    include JPEG, PNG and TIFF;
+ */
+static
+char *exmagick_set_load_opts (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM opts)
+{
+  int arity;
+  const ERL_NIF_TERM *opt;
+  ERL_NIF_TERM head, tail;
+  long x, y;
+  unsigned long width, height, first, count;
+  char size[MaxTextExtent];
+
+  tail = opts;
+  while (enif_get_list_cell(env, tail, &head, &tail))
+  {
+    if (0 == enif_get_tuple(env, head, &arity, &opt) || arity < 1)
+    { return("load options: bad argument"); }
+
+    if (arity == 3 && enif_is_identical(opt[0], exm_atom_max_size))
+    {
+      if (0 == enif_get_ulong(env, opt[1], &width) || 0 == enif_get_ulong(env, opt[2], &height))
+      { return("max_size: bad argument"); }
+
+      sprintf(size, "%lux%lu", width, height);
+      MagickFree(resource->i_info->size);
+      resource->i_info->size = exmagick_strdup(size);
+      if (resource->i_info->size == NULL)
+      { return("could not set max_size"); }
+    }
+    else if (arity == 3 && enif_is_identical(opt[0], exm_atom_pages))
+    {
+      if (0 == enif_get_ulong(env, opt[1], &first) || 0 == enif_get_ulong(env, opt[2], &count) || count == 0)
+      { return("pages: bad argument"); }
+
+      resource->i_info->subimage = first;
+      resource->i_info->subrange = count;
+    }
+    else if (arity == 5 && enif_is_identical(opt[0], exm_atom_region))
+    {
+      if (0 == enif_get_long(env, opt[1], &x) || 0 == enif_get_long(env, opt[2], &y) || x < 0 || y < 0
+          || 0 == enif_get_ulong(env, opt[3], &width) || 0 == enif_get_ulong(env, opt[4], &height)
+          || width == 0 || height == 0)
+      { return("region: bad argument"); }
+
+      sprintf(size, "%lux%lu+%ld+%ld", width, height, x, y);
+      MagickFree(resource->i_info->tile);
+      resource->i_info->tile = exmagick_strdup(size);
+      if (resource->i_info->tile == NULL)
+      { return("could not set region"); }
+    }
+    else
+    { return("load options: unknown option"); }
+  }
+
+  if (0 == enif_is_list(env, tail))
+  { return("load options: bad argument"); }
+  return(NULL);
+}
+
+static
+void exmagick_unset_load_opts (exm_resource_t *resource)
+{
+  MagickFree(resource->i_info->size);
+  MagickFree(resource->i_info->tile);
+  resource->i_info->size     = NULL;
+  resource->i_info->tile     = NULL;
+  resource->i_info->subimage = 0;
+  resource->i_info->subrange = 0;
+}
+
+/*
+  Coders that do not read regions (the tile geometry of the image info)
+  return the whole image, which is cropped here so that every coder
+  honors `{region, ...}`. Only those that do keep the memory usage down
+  to the size of the region. The image is taken as already cropped
+  when it fits in the region clipped to its bounds; a region starting
+  past them is left to `CropImage` to reject.
+ */
+static
+char *exmagick_load_region (exm_resource_t *resource)
+{
+  RectangleInfo rect;
+  unsigned long width, height;
+  const Image *image = resource->image;
+
+  if (resource->i_info->tile == NULL || image == NULL)
+  { return(NULL); }
+
+  GetGeometry(resource->i_info->tile, &rect.x, &rect.y, &rect.width, &rect.height);
+  if (rect.x >= 0 && rect.y >= 0 && (unsigned long) rect.x < image->columns && (unsigned long) rect.y < image->rows)
+  {
+    width  = image->columns - rect.x < rect.width ? image->columns - rect.x : rect.width;
+    height = image->rows - rect.y < rect.height ? image->rows - rect.y : rect.height;
+    if (image->columns <= width && image->rows <= height)
+    { return(NULL); }
+  }
+  return(exmagick_op_swap_image(resource, CropImage(resource->image, &rect, &resource->e_info)));
+}
+
+/*
+  A fast, non-cryptographic hash of the blobs the cache holds (FNV-1a
+  over words rather than bytes). Entries with the same hash are
+  compared byte by byte anyway.
+ */
+static
+ErlNifUInt64 exmagick_hash (const unsigned char *data, size_t size)
+{
+  size_t k;
+  ErlNifUInt64 word;
+  ErlNifUInt64 prime = ((ErlNifUInt64) 1 << 40) | 0x1b3;
+  ErlNifUInt64 hash  = ((ErlNifUInt64) 0xcbf29ce4UL << 32) | 0x84222325UL;
+
+  for (k = 0; k + sizeof(word) <= size; k += sizeof(word))
+  {
+    memcpy(&word, data + k, sizeof(word));
+    hash = (hash ^ word) * prime;
+  }
+  for (; k < size; k += 1)
+  { hash = (hash ^ data[k]) * prime; }
+  return(hash);
+}
+
+/*
+  Writes the part of the handle that changes how a blob gets decoded
+  (the load options, the type, the density and the definitions) into
+  `key`, which must hold `MaxTextExtent` bytes. Returns 0 when it does
+  not fit, the blob being decoded without the cache then.
+ */
+static
+int exmagick_cache_key (const exm_resource_t *resource, char *key)
+{
+  const ImageInfo *i_info = resource->i_info;
+  const char *size        = i_info->size == NULL ? "" : i_info->size;
+  const char *tile        = i_info->tile == NULL ? "" : i_info->tile;
+  const char *density     = i_info->density == NULL ? "" : i_info->density;
+
+  /* leaves room for the numbers and the separators */
+  if (strlen(size) + strlen(tile) + strlen(i_info->magick) + strlen(density) + strlen(resource->defines) + 64 >= MaxTextExtent)
+  { return(0); }
+
+  sprintf(key, "%lu:%lu:%s:%s:%s:%s:%s", i_info->subimage, i_info->subrange, size, tile, i_info->magick, density, resource->defines);
+  return(1);
+}
+
+/*
+  Returns the entry of `blob` decoded with `key`, if any. The caller
+  holds the mutex.
+ */
+static
+exm_cache_entry_t *exmagick_cache_find (const ErlNifBinary *blob, ErlNifUInt64 hash, const char *key)
+{
+  exm_cache_entry_t *entry;
+
+  for (entry = exm_cache.buckets[hash % EXM_CACHE_BUCKETS]; entry != NULL; entry = entry->chain)
+  {
+    if (entry->hash == hash && entry->blob_size == blob->size && strcmp(entry->key, key) == 0
+        && 0 == memcmp(entry->blob, blob->data, blob->size))
+    { return(entry); }
+  }
+  return(NULL);
+}
+
+/*
+  Removes an entry from its bucket. The caller holds the mutex.
+ */
+static
+void exmagick_cache_unchain (exm_cache_entry_t *entry)
+{
+  exm_cache_entry_t **link = &exm_cache.buckets[entry->hash % EXM_CACHE_BUCKETS];
+
+  while (*link != entry)
+  { link = &(*link)->chain; }
+  *link = entry->chain;
+  entry->chain = NULL;
+}
+
+/*
+  Detaches an entry from the cache list. The caller holds the mutex.
+ */
+static
+void exmagick_cache_unlink (exm_cache_entry_t *entry)
+{
+  if (entry->prev != NULL)
+  { entry->prev->next = entry->next; }
+  else
+  { exm_cache.head = entry->next; }
+
+  if (entry->next != NULL)
+  { entry->next->prev = entry->prev; }
+  else
+  { exm_cache.tail = entry->prev; }
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static
+void exmagick_cache_push (exm_cache_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = exm_cache.head;
+  if (exm_cache.head != NULL)
+  { exm_cache.head->prev = entry; }
+  exm_cache.head = entry;
+  if (exm_cache.tail == NULL)
+  { exm_cache.tail = entry; }
+}
+
+static
+void exmagick_cache_entry_free (exm_cache_entry_t *entry)
+{
+  if (entry->image != NULL)
+  { DestroyImageList(entry->image); }
+  if (entry->blob != NULL)
+  { enif_free(entry->blob); }
+  enif_free(entry);
+}
+
+/*
+  Evicts the least recently used entries until the cache holds at most
+  `capacity` bytes. The caller holds the mutex.
+ */
+static
+void exmagick_cache_evict (size_t capacity)
+{
+  exm_cache_entry_t *entry;
+
+  while (exm_cache.tail != NULL && exm_cache.bytes > capacity)
+  {
+    entry = exm_cache.tail;
+    exmagick_cache_unlink(entry);
+    exmagick_cache_unchain(entry);
+    exm_cache.bytes     -= entry->bytes;
+    exm_cache.entries   -= 1;
+    exm_cache.evictions += 1;
+    exmagick_cache_entry_free(entry);
+  }
+}
+
+static
+void exmagick_cache_resize (size_t capacity)
+{
+  enif_mutex_lock(exm_cache.mutex);
+  exm_cache.capacity = capacity;
+  exmagick_cache_evict(capacity);
+  enif_mutex_unlock(exm_cache.mutex);
+}
+
+/*
+  Returns a copy of the image decoded from `blob` with the same `key`,
+  or NULL when the cache does not have it. Copies share the pixels of
+  the cached image until either of them changes, so a hit costs about
+  as much as `derive/1`.
+ */
+static
+Image *exmagick_cache_get (const ErlNifBinary *blob, ErlNifUInt64 hash, const char *key, ExceptionInfo *e_info)
+{
+  Image *image = NULL;
+  exm_cache_entry_t *entry;
+
+  enif_mutex_lock(exm_cache.mutex);
+  if (exm_cache.capacity == 0)
+  {
+    enif_mutex_unlock(exm_cache.mutex);
+    return(NULL);
+  }
+
+  entry = exmagick_cache_find(blob, hash, key);
+  if (entry != NULL)
+  { image = CloneImageList(entry->image, e_info); }
+
+  if (image != NULL)
+  {
+    exmagick_cache_unlink(entry);
+    exmagick_cache_push(entry);
+    exm_cache.hits += 1;
+  }
+  else
+  { exm_cache.misses += 1; }
+  enif_mutex_unlock(exm_cache.mutex);
+  return(image);
+}
+
+/*
+  Keeps a copy of `image`, just decoded from `blob`, unless the cache
+  is disabled, it already has it or the image alone is bigger than the
+  cache. The size of an entry is the size of its pixels plus the size
+  of the blob.
+ */
+static
+void exmagick_cache_put (const ErlNifBinary *blob, ErlNifUInt64 hash, const char *key, const Image *image, ExceptionInfo *e_info)
+{
+  const Image *frame;
+  exm_cache_entry_t *entry, *other;
+  size_t bytes = blob->size + sizeof(exm_cache_entry_t);
+
+  for (frame = image; frame != NULL; frame = frame->next)
+  { bytes += frame->columns * frame->rows * sizeof(PixelPacket); }
+
+  enif_mutex_lock(exm_cache.mutex);
+  if (bytes > exm_cache.capacity)
+  {
+    enif_mutex_unlock(exm_cache.mutex);
+    return;
+  }
+  enif_mutex_unlock(exm_cache.mutex);
+
+  if (NULL == (entry = enif_alloc(sizeof(exm_cache_entry_t))))
+  { return; }
+  memset(entry, 0, sizeof(exm_cache_entry_t));
+  entry->hash      = hash;
+  entry->blob_size = blob->size;
+  entry->bytes     = bytes;
+  strcpy(entry->key, key);
+  entry->blob  = enif_alloc(blob->size == 0 ? 1 : blob->size);
+  entry->image = CloneImageList(image, e_info);
+  if (entry->blob == NULL || entry->image == NULL)
+  {
+    exmagick_cache_entry_free(entry);
+    return;
+  }
+  memcpy(entry->blob, blob->data, blob->size);
+
+  enif_mutex_lock(exm_cache.mutex);
+  other = exmagick_cache_find(blob, hash, key);
+  if (other == NULL && bytes <= exm_cache.capacity)
+  {
+    exmagick_cache_evict(exm_cache.capacity - bytes);
+    exmagick_cache_push(entry);
+    entry->chain = exm_cache.buckets[hash % EXM_CACHE_BUCKETS];
+    exm_cache.buckets[hash % EXM_CACHE_BUCKETS] = entry;
+    exm_cache.bytes   += bytes;
+    exm_cache.entries += 1;
+    entry = NULL;
+  }
+  enif_mutex_unlock(exm_cache.mutex);
+
+  if (entry != NULL)
+  { exmagick_cache_entry_free(entry); }
+}
+
+/*
+  Translates a failed read again when GraphicsMagick refused it for a
+  resource limit, pinging the header of the image (`blob`, or the file
+  named by the image info when NULL) for its dimensions. Other errors
+  are returned as is.
+ */
+static
+char *exmagick_load_limit_reason (exm_resource_t *resource, const ErlNifBinary *blob, char *errmsg)
+{
+  Image *pinged;
+  ExceptionInfo e_info;
+  unsigned long columns = 0, rows = 0;
+
+  if (0 == exmagick_is_limit_error(&resource->e_info))
+  { return(errmsg); }
+
+  GetExceptionInfo(&e_info);
+  pinged = blob == NULL ? PingImage(resource->i_info, &e_info)
+                        : PingBlob(resource->i_info, blob->data, blob->size, &e_info);
+  if (pinged != NULL)
+  {
+    columns = pinged->columns;
+    rows    = pinged->rows;
+    DestroyImageList(pinged);
+  }
+  DestroyExceptionInfo(&e_info);
+  return(exmagick_limit_reason(columns, rows));
+}
+
+/*
+  Decodes `blob`, through the cache unless `use_cache` is 0 or the cache
+  is disabled.
+ */
+static
+char *exmagick_op_load_blob (ErlNifEnv *env, exm_resource_t *resource, ErlNifBinary *blob, const ERL_NIF_TERM *opts, int use_cache)
+{
+  char *errmsg = NULL;
+  char key[MaxTextExtent];
+  ErlNifUInt64 hash = 0;
+  ErlNifTime start;
+  Image *cached = NULL;
+  int cacheable;
+
+  if (resource->image != NULL)
+  {
+    DestroyImageList(resource->image);
+    resource->image = NULL;
+  }
+
+  if (opts != NULL && NULL != (errmsg = exmagick_set_load_opts(env, resource, *opts)))
+  {
+    exmagick_unset_load_opts(resource);
+    return(errmsg);
+  }
+
+  enif_mutex_lock(exm_cache.mutex);
+  cacheable = use_cache && exm_cache.capacity != 0;
+  enif_mutex_unlock(exm_cache.mutex);
+
+  start = enif_monotonic_time(ERL_NIF_USEC);
+  if (cacheable && 0 != (cacheable = exmagick_cache_key(resource, key)))
+  {
+    hash   = exmagick_hash(blob->data, blob->size);
+    cached = exmagick_cache_get(blob, hash, key, &resource->e_info);
+  }
+
+  if (cached != NULL)
+  {
+    if (NULL != (errmsg = exmagick_check_image(&resource->limits, cached)))
+    { DestroyImageList(cached); }
+    else
+    { resource->image = cached; }
+  }
+  else
+  {
+    if (exmagick_has_limits(&resource->limits))
+    { errmsg = exmagick_check_ping(resource, PingBlob(resource->i_info, blob->data, blob->size, &resource->e_info)); }
+    if (errmsg == NULL && NULL != (errmsg = exmagick_op_swap_image(resource, BlobToImage(resource->i_info, blob->data, blob->size, &resource->e_info))))
+    { errmsg = exmagick_load_limit_reason(resource, blob, errmsg); }
+    if (errmsg == NULL)
+    { errmsg = exmagick_load_region(resource); }
+    /* an aborted decode may still return what it read so far */
+    if (errmsg == NULL)
+    { errmsg = exmagick_watch_poll(); }
+    if (errmsg == NULL && cacheable)
+    { exmagick_cache_put(blob, hash, key, resource->image, &resource->e_info); }
+  }
+  exmagick_stat(EXM_STAT_LOAD, start, errmsg, resource->image, blob->size, 0);
+  if (opts != NULL)
+  { exmagick_unset_load_opts(resource); }
+  return(errmsg);
+}
+
+static
+char *exmagick_op_load_file (ErlNifEnv *env, exm_resource_t *resource, ErlNifBinary *path, const ERL_NIF_TERM *opts)
+{
+  char *errmsg = NULL;
+  ErlNifTime start;
+
+  exmagick_utf8strcpy(resource->i_info->filename, path, MaxTextExtent);
+  if (resource->image != NULL)
+  {
+    DestroyImageList(resource->image);
+    resource->image = NULL;
+  }
+
+  if (opts != NULL && NULL != (errmsg = exmagick_set_load_opts(env, resource, *opts)))
+  {
+    exmagick_unset_load_opts(resource);
+    return(errmsg);
+  }
+
+  start = enif_monotonic_time(ERL_NIF_USEC);
+  if (exmagick_has_limits(&resource->limits))
+  { errmsg = exmagick_check_ping(resource, PingImage(resource->i_info, &resource->e_info)); }
+  if (errmsg == NULL && NULL != (errmsg = exmagick_op_swap_image(resource, ReadImage(resource->i_info, &resource->e_info))))
+  { errmsg = exmagick_load_limit_reason(resource, NULL, errmsg); }
+  if (errmsg == NULL)
+  { errmsg = exmagick_load_region(resource); }
+  exmagick_stat(EXM_STAT_LOAD, start, errmsg, resource->image, exmagick_file_size(resource->i_info->filename), 0);
+  if (opts != NULL)
+  { exmagick_unset_load_opts(resource); }
+  return(errmsg);
+}
+
+/*
+  Loads a file through a read-only mapping of it, which `BlobToImage`
+  decodes straight from: the file is neither read into a buffer nor
+  into a binary, and its pages may be dropped by the kernel under
+  memory pressure as they are backed by the file itself. The path is
+  still set as the file name, so its extension hints the image type.
+  The cache is bypassed: hashing and copying the mapping would undo
+  its point. A file truncated while being decoded makes the next read
+  of a page past its new end raise SIGBUS, which takes the VM down.
+ */
+static
+char *exmagick_op_load_mmap (ErlNifEnv *env, exm_resource_t *resource, ErlNifBinary *path, const ERL_NIF_TERM *opts)
+{
+  int fd;
+  void *data;
+  char *errmsg;
+  struct stat info;
+  ErlNifBinary blob;
+
+  exmagick_utf8strcpy(resource->i_info->filename, path, MaxTextExtent);
+  if (-1 == (fd = open(resource->i_info->filename, O_RDONLY)))
+  { return("could not open the file"); }
+
+  if (0 != fstat(fd, &info) || info.st_size == 0)
+  {
+    close(fd);
+    return("could not read the file");
+  }
+
+  data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  { return("could not map the file"); }
+  posix_madvise(data, info.st_size, POSIX_MADV_SEQUENTIAL);
+
+  blob.data = data;
+  blob.size = info.st_size;
+  errmsg = exmagick_op_load_blob(env, resource, &blob, opts, 0);
+  munmap(data, info.st_size);
+  return(errmsg);
+}
+
+/*
+  Hands a buffer allocated by GraphicsMagick over to the VM as a
+  resource binary, which releases it once the binary gets garbage
+  collected. The buffer is released right away on failure.
+ */
+static
+char *exmagick_make_blob (ErlNifEnv *env, void *data, size_t size, ERL_NIF_TERM *blob_term)
+{
+  exm_blob_t *blob = enif_alloc_resource(exm_blob_type, sizeof(exm_blob_t));
+  if (NULL == blob)
+  {
+    MagickFree(data);
+    return("enif_alloc_resource");
+  }
+
+  blob->data = data;
+  blob->size = size;
+  *blob_term = enif_make_resource_binary(env, blob, blob->data, blob->size);
+  enif_release_resource(blob);
+  return(NULL);
+}
+
+/*
+  Encodes the image without copying the resulting buffer, refer to
+  `exmagick_make_blob`.
+ */
+static
+char *exmagick_op_dump_blob (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *blob_term)
+{
+  void *blob_image;
+  size_t size = 0;
+  char *errmsg = NULL;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  blob_image = ImageToBlob(resource->i_info, resource->image, &size, &resource->e_info);
+  if (NULL == blob_image)
+  { errmsg = exmagick_exception_reason(&resource->e_info); }
+  exmagick_stat(EXM_STAT_DUMP, start, errmsg, NULL, 0, size);
+
+  if (errmsg != NULL)
+  { return(errmsg); }
+  return(exmagick_make_blob(env, blob_image, size, blob_term));
+}
+
+static
+char *exmagick_op_dump_file (exm_resource_t *resource, ErlNifBinary *path)
+{
+  char filename[MaxTextExtent];
+  char *errmsg = NULL;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  exmagick_utf8strcpy (filename, path, MaxTextExtent);
+  if (0 == WriteImages(resource->i_info, resource->image, filename, &resource->e_info))
+  { errmsg = exmagick_exception_reason(&resource->e_info); }
+  exmagick_stat(EXM_STAT_DUMP, start, errmsg, NULL, 0, errmsg == NULL ? exmagick_file_size(filename) : 0);
+  return(errmsg);
+}
+
+static
+char *exmagick_op_set_magick (exm_resource_t *resource, const char *magick)
+{
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  strncpy(resource->image->magick, magick, MaxTextExtent - 1);
+  resource->image->magick[MaxTextExtent - 1] = '\0';
+  return(NULL);
+}
+
+/*
+  Finds the value of the atom `term` among `choices`.
+ */
+static
+int exmagick_get_choice (ERL_NIF_TERM term, const exm_choice_t *choices, int *value)
+{
+  for (; choices->name != NULL; choices += 1)
+  {
+    if (enif_is_identical(term, choices->atom))
+    {
+      *value = choices->value;
+      return(1);
+    }
+  }
+  return(0);
+}
+
+static
+char *exmagick_read_text (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  ErlNifBinary utf8;
+
+  if (0 == exmagick_get_utf8str(env, value, &utf8))
+  { return("argv[2]: bad argument"); }
+  exmagick_utf8strcpy(op->text, &utf8, MaxTextExtent);
+  return(NULL);
+}
+
+static
+char *exmagick_read_number (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  if (0 == exmagick_get_double(env, value, &op->value))
+  { return("argv[2]: bad argument"); }
+  return(NULL);
+}
+
+static
+char *exmagick_read_delay (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  unsigned long delay;
+
+  if (0 == enif_get_ulong(env, value, &delay))
+  { return("delay: bad argument"); }
+  op->value = (double) delay;
+  return(NULL);
+}
+
+/*
+  Reads either a single gamma (a number) or a `"R,G,B"` string.
+ */
+static
+char *exmagick_read_gamma (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  if (0 == exmagick_get_double(env, value, &op->value))
+  { return(exmagick_read_text(env, value, op)); }
+  if (op->value <= 0)
+  { return("gamma: bad argument"); }
+  sprintf(op->text, "%g", op->value);
+  return(NULL);
+}
+
+static
+char *exmagick_read_boolean (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  unsigned int flag;
+
+  if (0 == exmagick_get_boolean_u(env, value, &flag))
+  { return("argv[2]: bad argument"); }
+  op->choice = flag;
+  return(NULL);
+}
+
+static
+char *exmagick_read_flip (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  if (0 == exmagick_get_choice(value, exm_flips, &op->choice))
+  { return("flip: bad argument"); }
+  return(NULL);
+}
+
+static
+char *exmagick_read_colorspace (ErlNifEnv *env, ERL_NIF_TERM value, exm_op_t *op)
+{
+  if (0 == exmagick_get_choice(value, exm_colorspaces, &op->choice))
+  { return("colorspace: unknown colorspace"); }
+  return(NULL);
+}
+
+/*
+  Compiles the `option` of `convert/3` and its value. The option is
+  looked up by its atom in `exm_convert_ops`.
+ */
+static
+char *exmagick_compile_convert (ErlNifEnv *env, ERL_NIF_TERM option, ERL_NIF_TERM value, exm_op_t *op)
+{
+  unsigned int k;
+
+  if (0 == enif_is_atom(env, option))
+  { return("argv[1]: bad argument"); }
+
+  for (k = 0; exm_convert_ops[k].name != NULL; k += 1)
+  {
+    if (enif_is_identical(option, exm_convert_ops[k].atom))
+    {
+      op->kind    = EXM_OP_CONVERT;
+      op->convert = k;
+      return(exm_convert_ops[k].read(env, value, op));
+    }
+  }
+  return("argv[1]: unknown option");
+}
+
+/*
+  Replaces every frame of the image with the one `transform` makes out
+  of it, so that the operations producing a new image apply to whole
+  animations just like the ones changing frames in place.
+ */
+static
+char *exmagick_map_frames (exm_resource_t *resource, const exm_op_t *op, Image *(*transform)(const Image *, const exm_op_t *, ExceptionInfo *))
+{
+  Image *frame, *result, *frames = NULL;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  {
+    if (NULL == (result = transform(frame, op, &resource->e_info)))
+    {
+      if (frames != NULL)
+      { DestroyImageList(frames); }
+      return(exmagick_exception_reason(&resource->e_info));
+    }
+    AppendImageToList(&frames, result);
+  }
+  return(exmagick_op_swap_image(resource, frames));
+}
+
+static
+char *exmagick_convert_black_threshold (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  {
+    if (0 == BlackThresholdImage(frame, op->text))
+    { return("failed to apply BlackThresholdImage"); }
+  }
+  return(NULL);
+}
+
+static
+char *exmagick_convert_threshold (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  {
+    if (0 == ThresholdImage(frame, op->value))
+    { return("failed to apply ThresholdImage"); }
+  }
+  return(NULL);
+}
+
+static
+char *exmagick_convert_white_threshold (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  {
+    if (0 == WhiteThresholdImage(frame, op->text))
+    { return("failed to apply WhiteThresholdImage"); }
+  }
+  return(NULL);
+}
+
+static
+Image *exmagick_rotate_frame (const Image *frame, const exm_op_t *op, ExceptionInfo *e_info)
+{ return(RotateImage(frame, op->value, e_info)); }
+
+static
+char *exmagick_convert_rotate (exm_resource_t *resource, const exm_op_t *op)
+{ return(exmagick_map_frames(resource, op, exmagick_rotate_frame)); }
+
+static
+Image *exmagick_flip_frame (const Image *frame, const exm_op_t *op, ExceptionInfo *e_info)
+{ return(op->choice ? FlopImage(frame, e_info) : FlipImage(frame, e_info)); }
+
+static
+char *exmagick_convert_flip (exm_resource_t *resource, const exm_op_t *op)
+{ return(exmagick_map_frames(resource, op, exmagick_flip_frame)); }
+
+/* the radius is left for GraphicsMagick to choose */
+static
+Image *exmagick_sharpen_frame (const Image *frame, const exm_op_t *op, ExceptionInfo *e_info)
+{ return(SharpenImage(frame, 0.0, op->value, e_info)); }
+
+static
+char *exmagick_convert_sharpen (exm_resource_t *resource, const exm_op_t *op)
+{ return(exmagick_map_frames(resource, op, exmagick_sharpen_frame)); }
+
+static
+Image *exmagick_blur_frame (const Image *frame, const exm_op_t *op, ExceptionInfo *e_info)
+{ return(BlurImage(frame, 0.0, op->value, e_info)); }
+
+static
+char *exmagick_convert_blur (exm_resource_t *resource, const exm_op_t *op)
+{ return(exmagick_map_frames(resource, op, exmagick_blur_frame)); }
+
+static
+char *exmagick_convert_strip (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; op->choice && frame != NULL; frame = frame->next)
+  {
+    if (0 == StripImage(frame))
+    { return("failed to apply StripImage"); }
+  }
+  return(NULL);
+}
+
+/*
+  Sets the delay of every frame, in centiseconds.
+ */
+static
+char *exmagick_convert_delay (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  { frame->delay = (unsigned long) op->value; }
+  return(NULL);
+}
+
+static
+Image *exmagick_auto_orient_frame (const Image *frame, const exm_op_t *op, ExceptionInfo *e_info)
+{ return(AutoOrientImage(frame, frame->orientation, e_info)); }
+
+static
+char *exmagick_convert_auto_orient (exm_resource_t *resource, const exm_op_t *op)
+{
+  if (!op->choice)
+  { return(NULL); }
+  return(exmagick_map_frames(resource, op, exmagick_auto_orient_frame));
+}
+
+static
+char *exmagick_convert_colorspace (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  {
+    if (0 == TransformColorspace(frame, (ColorspaceType) op->choice))
+    { return("failed to apply TransformColorspace"); }
+  }
+  return(NULL);
+}
+
+static
+char *exmagick_convert_gamma (exm_resource_t *resource, const exm_op_t *op)
+{
+  Image *frame;
+
+  for (frame = resource->image; frame != NULL; frame = frame->next)
+  {
+    if (0 == GammaImage(frame, op->text))
+    { return("failed to apply GammaImage"); }
+  }
+  return(NULL);
+}
+
+/*
+  Reads the filter (`box`, `bilinear` or `lanczos3`) and the engine
+  (`magick` or `fast`) of a resize.
+ */
+static
+char *exmagick_compile_resize (ErlNifEnv *env, ERL_NIF_TERM filter, ERL_NIF_TERM engine, exm_op_t *op)
+{
+  int value;
+
+  if (0 == enif_is_atom(env, filter))
+  { return("filter: bad argument"); }
+  if (0 == exmagick_get_choice(filter, exm_resize_filters, &value))
+  { return("filter: unknown filter"); }
+  op->filter = value;
+
+  if (0 == enif_is_atom(env, engine))
+  { return("engine: bad argument"); }
+  if (0 == exmagick_get_choice(engine, exm_resize_engines, &value))
+  { return("engine: unknown engine"); }
+  op->engine = value;
+  return(NULL);
+}
+
+/*
+  Parses an operation tuple into `op`, which can then be applied by
+  `exmagick_apply_op` without access to the environment (ex.: from a
+  thread other than the one running the NIF). The first element of
+  `args` is the operation name:
+
+  - `{size, W, H}`;
+  - `{thumb, W, H}`;
+  - `{resize, W, H, Filter, Engine}`;
+  - `{crop, X, Y, W, H}`;
+  - `{convert, Option, Value}`;
+  - `{magick, Type}`;
+ */
+static
+char *exmagick_compile_op (ErlNifEnv *env, int arity, const ERL_NIF_TERM args[], exm_op_t *op)
+{
+  ErlNifBinary utf8;
+
+  op->rect.x = op->rect.y = 0;
+  if (arity == 3 && (enif_is_identical(args[0], exm_atom_size) || enif_is_identical(args[0], exm_atom_thumb)))
+  {
+    op->kind = enif_is_identical(args[0], exm_atom_size) ? EXM_OP_SCALE : EXM_OP_THUMB;
+    if (0 == enif_get_ulong(env, args[1], &op->rect.width))
+    { return("width: bad argument"); }
+    if (0 == enif_get_ulong(env, args[2], &op->rect.height))
+    { return("height: bad argument"); }
+    return(NULL);
+  }
+
+  if (arity == 5 && enif_is_identical(args[0], exm_atom_resize))
+  {
+    op->kind = EXM_OP_RESIZE;
+    if (0 == enif_get_ulong(env, args[1], &op->rect.width) || op->rect.width == 0)
+    { return("width: bad argument"); }
+    if (0 == enif_get_ulong(env, args[2], &op->rect.height) || op->rect.height == 0)
+    { return("height: bad argument"); }
+    return(exmagick_compile_resize(env, args[3], args[4], op));
+  }
+
+  if (arity == 5 && enif_is_identical(args[0], exm_atom_crop))
+  {
+    op->kind = EXM_OP_CROP;
+    if (0 == enif_get_long(env, args[1], &op->rect.x))
+    { return("x0: bad argument"); }
+    if (0 == enif_get_long(env, args[2], &op->rect.y))
+    { return("y0: bad argument"); }
+    if (0 == enif_get_ulong(env, args[3], &op->rect.width))
+    { return("width: bad argument"); }
+    if (0 == enif_get_ulong(env, args[4], &op->rect.height))
+    { return("height: bad argument"); }
+    return(NULL);
+  }
+
+  if (arity == 3 && enif_is_identical(args[0], exm_atom_convert))
+  { return(exmagick_compile_convert(env, args[1], args[2], op)); }
+
+  if (arity == 2 && enif_is_identical(args[0], exm_atom_magick))
+  {
+    op->kind = EXM_OP_MAGICK;
+    if (0 == exmagick_get_utf8str(env, args[1], &utf8))
+    { return("magick: bad argument"); }
+    exmagick_utf8strcpy(op->text, &utf8, MaxTextExtent);
+    return(NULL);
+  }
+
+  return("unknown operation");
+}
+
+static
+char *exmagick_apply_op (exm_resource_t *resource, const exm_op_t *op)
+{
+  RectangleInfo rect;
+  char *errmsg = NULL;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  switch (op->kind)
+  {
+  case EXM_OP_SCALE:
+    return(exmagick_op_scale(resource, op->rect.width, op->rect.height));
+
+  case EXM_OP_THUMB:
+    return(exmagick_op_thumb(resource, op->rect.width, op->rect.height));
+
+  case EXM_OP_RESIZE:
+    return(exmagick_op_resize(resource, op));
+
+  case EXM_OP_CROP:
+    rect = op->rect;
+    return(exmagick_op_crop(resource, &rect));
+
+  case EXM_OP_CONVERT:
+    errmsg = exm_convert_ops[op->convert].apply(resource, op);
+    exmagick_stat(EXM_STAT_CONVERT, start, errmsg, resource->image, 0, 0);
+    return(errmsg);
+
+  case EXM_OP_MAGICK:
+    return(exmagick_op_set_magick(resource, op->text));
+  }
+
+  return("unknown operation");
+}
+
+static
+double exmagick_filter_box (double x)
+{ return(x > -0.5 && x <= 0.5 ? 1.0 : 0.0); }
+
+static
+double exmagick_filter_bilinear (double x)
+{
+  x = fabs(x);
+  return(x < 1.0 ? 1.0 - x : 0.0);
+}
+
+static
+double exmagick_sinc (double x)
+{
+  if (x == 0.0)
+  { return(1.0); }
+  x = x * EXM_PI;
+  return(sin(x) / x);
+}
+
+static
+double exmagick_filter_lanczos3 (double x)
+{ return(x > -3.0 && x < 3.0 ? exmagick_sinc(x) * exmagick_sinc(x / 3.0) : 0.0); }
+
+/* indexed by `exm_filter_t` */
+static const struct {
+  double (*fn)(double);
+  double support;
+} exm_filters[] = {
+  {exmagick_filter_box, 0.5},
+  {exmagick_filter_bilinear, 1.0},
+  {exmagick_filter_lanczos3, 3.0}
+};
+
+static
+void exmagick_kernel_free (exm_kernel_t *kernel)
+{
+  if (kernel->first != NULL)
+  { enif_free(kernel->first); }
+  if (kernel->size != NULL)
+  { enif_free(kernel->size); }
+  if (kernel->weights != NULL)
+  { enif_free(kernel->weights); }
+  memset(kernel, 0, sizeof(exm_kernel_t));
+}
+
+/*
+  Precomputes the weights to resample `in_size` pixels into `out_size`
+  ones. The filter is stretched when downscaling so that every input
+  pixel contributes to the result (no aliasing), and the weights of
+  each output pixel are normalized before being converted to fixed
+  point.
+ */
+static
+char *exmagick_kernel_init (exm_kernel_t *kernel, unsigned long in_size, unsigned long out_size, exm_filter_t filter)
+{
+  long first, last;
+  unsigned long k, j;
+  size_t weights_size;
+  double center, total, *w;
+  double scale       = (double) in_size / out_size;
+  double filterscale = scale < 1.0 ? 1.0 : scale;
+  double support     = exm_filters[filter].support * filterscale;
+
+  kernel->ksize   = (unsigned long) ceil(support) * 2 + 1;
+  if (0 == exmagick_mul_size(out_size, kernel->ksize, &weights_size)
+      || 0 == exmagick_mul_size(weights_size, sizeof(int), &weights_size)
+      || out_size > (size_t) -1 / sizeof(unsigned long))
+  { return("resize: size too large"); }
+
+  kernel->first   = enif_alloc(out_size * sizeof(unsigned long));
+  kernel->size    = enif_alloc(out_size * sizeof(unsigned long));
+  kernel->weights = enif_alloc(weights_size);
+  w               = enif_alloc(kernel->ksize * sizeof(double));
+  if (kernel->first == NULL || kernel->size == NULL || kernel->weights == NULL || w == NULL)
+  {
+    if (w != NULL)
+    { enif_free(w); }
+    exmagick_kernel_free(kernel);
+    return("enif_alloc");
+  }
+
+  for (k = 0; k < out_size; k += 1)
+  {
+    center = (k + 0.5) * scale;
+    first  = (long) floor(center - support + 0.5);
+    last   = (long) floor(center + support + 0.5);
+    first  = first < 0 ? 0 : first;
+    last   = last > (long) in_size ? (long) in_size : last;
+    last   = last - first > (long) kernel->ksize ? first + (long) kernel->ksize : last;
+
+    total = 0.0;
+    for (j = 0; j < (unsigned long) (last - first); j += 1)
+    {
+      w[j]   = exm_filters[filter].fn((first + j - center + 0.5) / filterscale);
+      total += w[j];
+    }
+
+    kernel->first[k] = first;
+    kernel->size[k]  = last - first;
+    for (j = 0; j < kernel->size[k]; j += 1)
+    {
+      kernel->weights[k * kernel->ksize + j] = total == 0.0 ? (j == 0 ? 1 << EXM_RESIZE_BITS : 0)
+                                                            : (int) floor(w[j] / total * (1 << EXM_RESIZE_BITS) + 0.5);
+    }
+  }
+
+  enif_free(w);
+  return(NULL);
+}
+
+static
+unsigned char exmagick_clamp8 (int acc)
+{
+  if (acc < 0)
+  { return(0); }
+  acc = acc >> EXM_RESIZE_BITS;
+  return(acc > 255 ? 255 : (unsigned char) acc);
+}
+
+#ifdef __SSE2__
+/*
+  Loads a pixel of up to 4 bytes into the 16-bit lanes of a register,
+  without reading past its last byte.
+ */
+static
+__m128i exmagick_load_pixel (const unsigned char *p, unsigned int channels)
+{
+  int pixel = 0;
+
+  memcpy(&pixel, p, channels);
+  return(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), _mm_setzero_si128()));
+}
+
+/*
+  Computes a row of output pixels of up to 4 channels, one pixel per
+  register, two input pixels per multiply-add: their channels are
+  interleaved so that each 32-bit lane sums a channel of both. Returns
+  how many pixels of the row were computed, the remaining ones are left
+  to the scalar loop.
+ */
+static
+unsigned long exmagick_resample_h_sse2 (const unsigned char *row, unsigned char *dst, unsigned long out_cols, unsigned int channels, const exm_kernel_t *kernel)
+{
+  int pixel;
+  unsigned long x, j;
+  const int *w;
+  const unsigned char *p;
+  __m128i zero = _mm_setzero_si128();
+  __m128i b, weights, acc;
+
+  if (channels > 4)
+  { return(0); }
+
+  for (x = 0; x < out_cols; x += 1)
+  {
+    w   = kernel->weights + x * kernel->ksize;
+    p   = row + kernel->first[x] * channels;
+    acc = _mm_set1_epi32(1 << (EXM_RESIZE_BITS - 1));
+    for (j = 0; j < kernel->size[x]; j += 2)
+    {
+      if (j + 1 < kernel->size[x])
+      {
+        b       = exmagick_load_pixel(p + (j + 1) * channels, channels);
+        weights = _mm_set1_epi32((int) (((unsigned int) w[j + 1] << 16) | ((unsigned int) w[j] & 0xffff)));
+      }
+      else
+      {
+        b       = zero;
+        weights = _mm_set1_epi32((int) ((unsigned int) w[j] & 0xffff));
+      }
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(exmagick_load_pixel(p + j * channels, channels), b), weights));
+    }
+
+    acc   = _mm_packs_epi32(_mm_srai_epi32(acc, EXM_RESIZE_BITS), zero);
+    pixel = _mm_cvtsi128_si32(_mm_packus_epi16(acc, zero));
+    memcpy(dst + x * channels, &pixel, channels);
+  }
+
+  return(x);
+}
+#endif
+
+/*
+  Resamples each row of `src`, made of `in_cols` pixels of `channels`
+  bytes, into `out_cols` pixels in `dst`.
+ */
+static
+void exmagick_resample_h (const unsigned char *src, unsigned char *dst, unsigned long rows, unsigned long in_cols, unsigned long out_cols, unsigned int channels, const exm_kernel_t *kernel)
+{
+  int acc;
+  unsigned int c;
+  unsigned long y, x, j;
+  const int *w;
+  const unsigned char *p;
+
+  for (y = 0; y < rows; y += 1)
+  {
+    x = 0;
+#ifdef __SSE2__
+    x = exmagick_resample_h_sse2(src + y * in_cols * channels, dst + y * out_cols * channels, out_cols, channels, kernel);
+#endif
+    for (; x < out_cols; x += 1)
+    {
+      w = kernel->weights + x * kernel->ksize;
+      p = src + (y * in_cols + kernel->first[x]) * channels;
+      for (c = 0; c < channels; c += 1)
+      {
+        acc = 1 << (EXM_RESIZE_BITS - 1);
+        for (j = 0; j < kernel->size[x]; j += 1)
+        { acc += p[j * channels + c] * w[j]; }
+        dst[(y * out_cols + x) * channels + c] = exmagick_clamp8(acc);
+      }
+    }
+  }
+}
+
+#ifdef __SSE2__
+/*
+  Computes 8 bytes of an output row at a time out of `size` input
+  rows, two rows per multiply-add. Returns how many bytes of the row
+  were computed, the remaining ones are left to the scalar loop.
+ */
+static
+unsigned long exmagick_resample_v_sse2 (const unsigned char *rows, unsigned char *dst, unsigned long stride, unsigned long size, const int *w)
+{
+  unsigned long x, j;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a, b, weights, lo, hi;
+
+  for (x = 0; x + 8 <= stride; x += 8)
+  {
+    lo = _mm_set1_epi32(1 << (EXM_RESIZE_BITS - 1));
+    hi = lo;
+    for (j = 0; j < size; j += 2)
+    {
+      a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (rows + j * stride + x)), zero);
+      if (j + 1 < size)
+      {
+        b       = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (rows + (j + 1) * stride + x)), zero);
+        weights = _mm_set1_epi32((int) (((unsigned int) w[j + 1] << 16) | ((unsigned int) w[j] & 0xffff)));
+      }
+      else
+      {
+        b       = zero;
+        weights = _mm_set1_epi32((int) ((unsigned int) w[j] & 0xffff));
+      }
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+    }
+
+    lo = _mm_packs_epi32(_mm_srai_epi32(lo, EXM_RESIZE_BITS), _mm_srai_epi32(hi, EXM_RESIZE_BITS));
+    _mm_storel_epi64((__m128i *) (dst + x), _mm_packus_epi16(lo, lo));
+  }
+
+  return(x);
+}
+#endif
+
+/*
+  Resamples the columns of `src`, whose rows are `stride` bytes long,
+  into `out_rows` rows in `dst`.
+ */
+static
+void exmagick_resample_v (const unsigned char *src, unsigned char *dst, unsigned long stride, unsigned long out_rows, const exm_kernel_t *kernel)
+{
+  int acc;
+  unsigned long y, x, j;
+  const int *w;
+  const unsigned char *rows;
+
+  for (y = 0; y < out_rows; y += 1)
+  {
+    w    = kernel->weights + y * kernel->ksize;
+    rows = src + kernel->first[y] * stride;
+    x    = 0;
+#ifdef __SSE2__
+    x = exmagick_resample_v_sse2(rows, dst + y * stride, stride, kernel->size[y], w);
+#endif
+    for (; x < stride; x += 1)
+    {
+      acc = 1 << (EXM_RESIZE_BITS - 1);
+      for (j = 0; j < kernel->size[y]; j += 1)
+      { acc += rows[j * stride + x] * w[j]; }
+      dst[y * stride + x] = exmagick_clamp8(acc);
+    }
+  }
+}
+
+/*
+  The fast engine works on a single frame of 8-bit RGB or gray pixels,
+  other images go through GraphicsMagick.
+ */
+static
+int exmagick_fast_resize_supported (const Image *image)
+{
+  return(image->next == NULL && image->depth <= 8
+         && (image->colorspace == RGBColorspace || image->colorspace == GRAYColorspace));
+}
+
+/*
+  Resizes the image with a separable resampler working on packed 8-bit
+  pixels: the image is exported once, resampled horizontally and then
+  vertically using precomputed weights, and written into a copy of the
+  source (so it keeps its type and attributes).
+ */
+static
+char *exmagick_fast_resize (const Image *source, unsigned long width, unsigned long height, exm_filter_t filter, ExceptionInfo *e_info, Image **resized)
+{
+  unsigned long x, y;
+  char *errmsg = NULL;
+  const char *map = source->matte ? "RGBA" : "RGB";
+  unsigned int channels = source->matte ? 4 : 3;
+  unsigned char *src = NULL, *tmp = NULL, *dst = NULL;
+  size_t src_size, tmp_size, dst_size;
+  const unsigned char *p;
+  exm_kernel_t horizontal, vertical;
+  PixelPacket *q;
+  Image *image = NULL;
+
+  memset(&horizontal, 0, sizeof(exm_kernel_t));
+  memset(&vertical, 0, sizeof(exm_kernel_t));
+  if (0 == exmagick_mul_size(source->columns, source->rows, &src_size) || 0 == exmagick_mul_size(src_size, channels, &src_size)
+      || 0 == exmagick_mul_size(width, source->rows, &tmp_size) || 0 == exmagick_mul_size(tmp_size, channels, &tmp_size)
+      || 0 == exmagick_mul_size(width, height, &dst_size) || 0 == exmagick_mul_size(dst_size, channels, &dst_size))
+  { EXM_FAIL(done, "resize: size too large"); }
+
+  src = enif_alloc(src_size);
+  tmp = enif_alloc(tmp_size);
+  dst = enif_alloc(dst_size);
+  if (src == NULL || tmp == NULL || dst == NULL)
+  { EXM_FAIL(done, "enif_alloc"); }
+
+  if (NULL != (errmsg = exmagick_kernel_init(&horizontal, source->columns, width, filter))
+      || NULL != (errmsg = exmagick_kernel_init(&vertical, source->rows, height, filter)))
+  { goto done; }
+
+  if (0 == DispatchImage(source, 0, 0, source->columns, source->rows, map, CharPixel, src, e_info))
+  { EXM_FAIL(done, exmagick_exception_reason(e_info)); }
+
+  exmagick_resample_h(src, tmp, source->rows, source->columns, width, channels, &horizontal);
+  exmagick_resample_v(tmp, dst, width * channels, height, &vertical);
+
+  image = CloneImage(source, width, height, 1, e_info);
+  if (image == NULL)
+  { EXM_FAIL(done, exmagick_exception_reason(e_info)); }
+
+  for (y = 0; errmsg == NULL && y < height; y += 1)
+  {
+    if (NULL == (q = SetImagePixels(image, 0, y, width, 1)))
+    { EXM_FAIL(done, "SetImagePixels"); }
+
+    p = dst + y * width * channels;
+    for (x = 0; x < width; x += 1, p += channels)
+    {
+      q[x].red     = ScaleCharToQuantum(p[0]);
+      q[x].green   = ScaleCharToQuantum(p[1]);
+      q[x].blue    = ScaleCharToQuantum(p[2]);
+      q[x].opacity = channels == 4 ? ScaleCharToQuantum(255 - p[3]) : OpaqueOpacity;
+    }
+
+    if (0 == SyncImagePixels(image))
+    { EXM_FAIL(done, "SyncImagePixels"); }
+  }
+
+done:
+  if (errmsg != NULL && image != NULL)
+  { DestroyImage(image); }
+  else
+  { *resized = image; }
+
+  exmagick_kernel_free(&horizontal);
+  exmagick_kernel_free(&vertical);
+  if (src != NULL)
+  { enif_free(src); }
+  if (tmp != NULL)
+  { enif_free(tmp); }
+  if (dst != NULL)
+  { enif_free(dst); }
+  return(errmsg);
+}
+
+/*
+  Sums `size` bytes, 16 at a time with SSE2 (`psadbw` against zero adds
+  up the bytes of each half of the register).
+ */
+static
+unsigned long exmagick_sum_u8 (const unsigned char *p, unsigned long size)
+{
+  unsigned long k = 0, sum = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+
+  for (; k + 16 <= size; k += 16)
+  { acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (p + k)), _mm_setzero_si128())); }
+  sum = (unsigned long) _mm_cvtsi128_si32(acc) + (unsigned long) _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+  for (; k < size; k += 1)
+  { sum += p[k]; }
+  return(sum);
+}
+
+/*
+  Splits `size` pixels into `EXM_FP_SIZE` ranges `[first[k], last[k])`
+  of at least one pixel, so that images smaller than the grid repeat
+  their pixels.
+ */
+static
+void exmagick_fingerprint_ranges (unsigned long size, unsigned long *first, unsigned long *last)
+{
+  unsigned long k;
+
+  for (k = 0; k < EXM_FP_SIZE; k += 1)
+  {
+    first[k] = k * size / EXM_FP_SIZE;
+    last[k]  = (k + 1) * size / EXM_FP_SIZE;
+    last[k]  = last[k] > first[k] ? last[k] : first[k] + 1;
+  }
+}
+
+/*
+  Adds a row of 8-bit RGB pixels to the histograms and the sums of the
+  channels.
+ */
+static
+void exmagick_fingerprint_count (exm_fingerprint_t *fp, const unsigned char *rgb, unsigned long columns)
+{
+  unsigned int c;
+  unsigned long x, sum[3] = {0, 0, 0}, sum_sq[3] = {0, 0, 0};
+
+  for (x = 0; x < columns; x += 1, rgb += 3)
+  {
+    for (c = 0; c < 3; c += 1)
+    {
+      fp->histogram[c][rgb[c]] += 1;
+      sum[c]                   += rgb[c];
+      sum_sq[c]                += rgb[c] * rgb[c];
+    }
+  }
+
+  for (c = 0; c < 3; c += 1)
+  {
+    fp->sum[c]    += sum[c];
+    fp->sum_sq[c] += sum_sq[c];
+  }
+  fp->pixels += columns;
+}
+
+/*
+  Reads the pixels of the first frame of `image` once, row by row:
+  rows are converted to luma and downsampled by averaging into the
+  `EXM_FP_SIZE` x `EXM_FP_SIZE` grid the hashes are computed from, and
+  counted into the histograms and channel statistics when `kinds` asks
+  for them.
+ */
+static
+char *exmagick_fingerprint_scan (const Image *image, unsigned int kinds, exm_fingerprint_t *fp, ExceptionInfo *e_info)
+{
+  unsigned long y, x, cx, cy, fetched, counted = 0;
+  unsigned long x_first[EXM_FP_SIZE], x_last[EXM_FP_SIZE], y_first[EXM_FP_SIZE], y_last[EXM_FP_SIZE];
+  unsigned long cells[EXM_FP_SIZE];
+  char *errmsg = NULL;
+  unsigned char *rgb, *gray;
+
+  rgb  = enif_alloc(image->columns * 3);
+  gray = enif_alloc(image->columns);
+  if (rgb == NULL || gray == NULL)
+  { EXM_FAIL(done, "enif_alloc"); }
+
+  exmagick_fingerprint_ranges(image->columns, x_first, x_last);
+  exmagick_fingerprint_ranges(image->rows, y_first, y_last);
+
+  fetched = image->rows;
+  for (cy = 0; cy < EXM_FP_SIZE; cy += 1)
+  {
+    memset(cells, 0, sizeof(cells));
+    for (y = y_first[cy]; y < y_last[cy]; y += 1)
+    {
+      if (y != fetched)
+      {
+        if (0 == DispatchImage(image, 0, y, image->columns, 1, "RGB", CharPixel, rgb, e_info))
+        { EXM_FAIL(done, exmagick_exception_reason(e_info)); }
+        for (x = 0; x < image->columns; x += 1)
+        { gray[x] = (unsigned char) ((77 * rgb[3 * x] + 150 * rgb[3 * x + 1] + 29 * rgb[3 * x + 2] + 128) >> 8); }
+        fetched = y;
+      }
+
+      if ((kinds & (EXM_FP_HISTOGRAM | EXM_FP_STATS)) && y == counted)
+      {
+        exmagick_fingerprint_count(fp, rgb, image->columns);
+        counted = y + 1;
+      }
+
+      for (cx = 0; cx < EXM_FP_SIZE; cx += 1)
+      { cells[cx] += exmagick_sum_u8(gray + x_first[cx], x_last[cx] - x_first[cx]); }
+    }
+
+    for (cx = 0; cx < EXM_FP_SIZE; cx += 1)
+    { fp->gray[cy * EXM_FP_SIZE + cx] = (double) cells[cx] / ((x_last[cx] - x_first[cx]) * (y_last[cy] - y_first[cy])); }
+  }
+
+done:
+  if (rgb != NULL)
+  { enif_free(rgb); }
+  if (gray != NULL)
+  { enif_free(gray); }
+  return(errmsg);
+}
+
+/*
+  Averages the cells of the grid into `columns` x `rows` values.
+ */
+static
+void exmagick_fingerprint_shrink (const exm_fingerprint_t *fp, unsigned int columns, unsigned int rows, double *values)
+{
+  unsigned int x, y, i, j, i0, i1, j0, j1;
+  double sum;
+
+  for (y = 0; y < rows; y += 1)
+  {
+    j0 = y * EXM_FP_SIZE / rows;
+    j1 = (y + 1) * EXM_FP_SIZE / rows;
+    for (x = 0; x < columns; x += 1)
+    {
+      i0  = x * EXM_FP_SIZE / columns;
+      i1  = (x + 1) * EXM_FP_SIZE / columns;
+      sum = 0.0;
+      for (j = j0; j < j1; j += 1)
+      {
+        for (i = i0; i < i1; i += 1)
+        { sum += fp->gray[j * EXM_FP_SIZE + i]; }
+      }
+      values[y * columns + x] = sum / ((i1 - i0) * (j1 - j0));
+    }
+  }
+}
+
+/*
+  Sets the bits of a 64-bit hash, the first value being the most
+  significant bit, where `values[k] > threshold[k]`.
+ */
+static
+ErlNifUInt64 exmagick_fingerprint_bits (const double *values, const double *thresholds, unsigned int stride)
+{
+  unsigned int k;
+  ErlNifUInt64 hash = 0;
+
+  for (k = 0; k < 64; k += 1)
+  { hash = (hash << 1) | (values[k] > thresholds[k * stride] ? 1 : 0); }
+  return(hash);
+}
+
+/*
+  aHash: the 8x8 average of the image compared to its mean.
+ */
+static
+ErlNifUInt64 exmagick_ahash (const exm_fingerprint_t *fp)
+{
+  unsigned int k;
+  double values[64], mean = 0.0;
+
+  exmagick_fingerprint_shrink(fp, 8, 8, values);
+  for (k = 0; k < 64; k += 1)
+  { mean += values[k] / 64; }
+  return(exmagick_fingerprint_bits(values, &mean, 0));
+}
+
+/*
+  dHash: the horizontal gradient of the 9x8 average of the image, each
+  bit telling whether a cell is brighter than its right neighbour.
+ */
+static
+ErlNifUInt64 exmagick_dhash (const exm_fingerprint_t *fp)
+{
+  unsigned int x, y;
+  double values[72], left[64], right[64];
+
+  exmagick_fingerprint_shrink(fp, 9, 8, values);
+  for (y = 0; y < 8; y += 1)
+  {
+    for (x = 0; x < 8; x += 1)
+    {
+      left[y * 8 + x]  = values[y * 9 + x];
+      right[y * 8 + x] = values[y * 9 + x + 1];
+    }
+  }
+  return(exmagick_fingerprint_bits(left, right, 1));
+}
+
+/*
+  pHash: the 8x8 lowest frequencies of the DCT-II of the grid compared
+  to their median. The transform is separable and only the 8 lowest
+  frequencies of each direction are computed.
+ */
+static
+ErlNifUInt64 exmagick_phash (const exm_fingerprint_t *fp)
+{
+  unsigned int u, v, k, j;
+  double cosines[8][EXM_FP_SIZE], rows[EXM_FP_SIZE][8], dct[64], sorted[64], swap, median;
+
+  for (u = 0; u < 8; u += 1)
+  {
+    for (k = 0; k < EXM_FP_SIZE; k += 1)
+    { cosines[u][k] = cos((2 * k + 1) * u * EXM_PI / (2 * EXM_FP_SIZE)); }
+  }
+
+  for (k = 0; k < EXM_FP_SIZE; k += 1)
+  {
+    for (u = 0; u < 8; u += 1)
+    {
+      rows[k][u] = 0.0;
+      for (j = 0; j < EXM_FP_SIZE; j += 1)
+      { rows[k][u] += fp->gray[k * EXM_FP_SIZE + j] * cosines[u][j]; }
+    }
+  }
+
+  for (v = 0; v < 8; v += 1)
+  {
+    for (u = 0; u < 8; u += 1)
+    {
+      dct[v * 8 + u] = 0.0;
+      for (k = 0; k < EXM_FP_SIZE; k += 1)
+      { dct[v * 8 + u] += rows[k][u] * cosines[v][k]; }
+      sorted[v * 8 + u] = dct[v * 8 + u];
+    }
+  }
+
+  for (k = 1; k < 64; k += 1)
+  {
+    for (j = k; j > 0 && sorted[j - 1] > sorted[j]; j -= 1)
+    {
+      swap          = sorted[j];
+      sorted[j]     = sorted[j - 1];
+      sorted[j - 1] = swap;
+    }
+  }
+
+  median = (sorted[31] + sorted[32]) / 2;
+  return(exmagick_fingerprint_bits(dct, &median, 0));
+}
+
+/*
+  Builds the map returned by `fingerprint/2` out of a scan: hashes are
+  64-bit integers, the histogram is a binary of 256 32-bit big-endian
+  counts per channel (red, green then blue) and the statistics are the
+  mean and standard deviation of each channel in 0..255.
+ */
+static
+ERL_NIF_TERM exmagick_make_fingerprint (ErlNifEnv *env, const exm_fingerprint_t *fp, unsigned int kinds)
+{
+  unsigned int c, k;
+  unsigned char *bin;
+  double mean[3], stddev[3];
+  ERL_NIF_TERM term, stats, result = enif_make_new_map(env);
+
+  if (kinds & EXM_FP_AHASH)
+  { enif_make_map_put(env, result, exm_fingerprints[0].atom, enif_make_uint64(env, exmagick_ahash(fp)), &result); }
+  if (kinds & EXM_FP_DHASH)
+  { enif_make_map_put(env, result, exm_fingerprints[1].atom, enif_make_uint64(env, exmagick_dhash(fp)), &result); }
+  if (kinds & EXM_FP_PHASH)
+  { enif_make_map_put(env, result, exm_fingerprints[2].atom, enif_make_uint64(env, exmagick_phash(fp)), &result); }
+
+  if (kinds & EXM_FP_HISTOGRAM)
+  {
+    bin = enif_make_new_binary(env, 3 * 256 * 4, &term);
+    for (c = 0; c < 3; c += 1)
+    {
+      for (k = 0; k < 256; k += 1, bin += 4)
+      {
+        bin[0] = (unsigned char) (fp->histogram[c][k] >> 24);
+        bin[1] = (unsigned char) (fp->histogram[c][k] >> 16);
+        bin[2] = (unsigned char) (fp->histogram[c][k] >> 8);
+        bin[3] = (unsigned char) fp->histogram[c][k];
+      }
+    }
+    enif_make_map_put(env, result, exm_fingerprints[3].atom, term, &result);
+  }
+
+  if (kinds & EXM_FP_STATS)
+  {
+    for (c = 0; c < 3; c += 1)
+    {
+      mean[c]   = fp->sum[c] / fp->pixels;
+      stddev[c] = fp->sum_sq[c] / fp->pixels - mean[c] * mean[c];
+      stddev[c] = stddev[c] > 0.0 ? sqrt(stddev[c]) : 0.0;
+    }
+    stats = enif_make_new_map(env);
+    enif_make_map_put(env, stats, enif_make_atom(env, "mean"),
+                      enif_make_tuple3(env, enif_make_double(env, mean[0]), enif_make_double(env, mean[1]), enif_make_double(env, mean[2])),
+                      &stats);
+    enif_make_map_put(env, stats, enif_make_atom(env, "stddev"),
+                      enif_make_tuple3(env, enif_make_double(env, stddev[0]), enif_make_double(env, stddev[1]), enif_make_double(env, stddev[2])),
+                      &stats);
+    enif_make_map_put(env, result, exm_fingerprints[4].atom, stats, &result);
+  }
+
+  return(result);
+}
+
+/*
+  Computes the `kinds` of fingerprints (a list of atoms, refer to
+  `exm_fingerprints`) of the image in a single pass over its pixels.
+  Reading pixels goes through the pixel cache, hence the write lock.
+ */
+static
+ERL_NIF_TERM exmagick_fingerprint (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int kind;
+  unsigned int kinds = 0;
+  ERL_NIF_TERM head, tail, result;
+  exm_resource_t *resource = NULL;
+  exm_fingerprint_t *fp = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  tail = argv[1];
+  while (enif_get_list_cell(env, tail, &head, &tail))
+  {
+    if (0 == exmagick_get_choice(head, exm_fingerprints, &kind))
+    { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+    kinds |= (unsigned int) kind;
+  }
+  if (0 == enif_is_list(env, tail))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  fp = enif_alloc(sizeof(exm_fingerprint_t));
+  if (fp == NULL)
+  { EXM_FAIL(ehandler, "enif_alloc"); }
+  memset(fp, 0, sizeof(exm_fingerprint_t));
+
+  EXM_WLOCK(resource);
+  if (resource->image == NULL)
+  { errmsg = "image not loaded"; }
+  else
+  { errmsg = exmagick_fingerprint_scan(resource->image, kinds, fp, &resource->e_info); }
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+
+  result = errmsg == NULL ? exmagick_make_result(env, NULL, exmagick_make_fingerprint(env, fp, kinds))
+                          : exmagick_make_error(env, errmsg);
+  enif_free(fp);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  if (fp != NULL)
+  { enif_free(fp); }
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+char *exmagick_op_resize (exm_resource_t *resource, const exm_op_t *op)
+{
+  char *errmsg;
+  Image *resized = NULL;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+  FilterTypes filters[] = {BoxFilter, TriangleFilter, LanczosFilter};
+  unsigned long width = op->rect.width, height = op->rect.height;
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  if (NULL != (errmsg = exmagick_check_limits(&resource->limits, width, height, width * height)))
+  { return(errmsg); }
+
+  if (op->engine == EXM_ENGINE_FAST && exmagick_fast_resize_supported(resource->image))
+  {
+    errmsg = exmagick_fast_resize(resource->image, width, height, op->filter, &resource->e_info, &resized);
+    if (errmsg == NULL)
+    { errmsg = exmagick_op_swap_image(resource, resized); }
+  }
+  else
+  { errmsg = exmagick_op_swap_image(resource, ResizeImage(resource->image, width, height, filters[op->filter], 1.0, &resource->e_info)); }
+  if (errmsg != NULL && exmagick_is_limit_error(&resource->e_info))
+  { errmsg = exmagick_limit_reason(width, height); }
+
+  exmagick_stat(EXM_STAT_RESIZE, start, errmsg, resource->image, 0, 0);
+  return(errmsg);
+}
+
+static
+char *exmagick_op_scale (exm_resource_t *resource, long width, long height)
+{
+  char *errmsg;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  if (NULL != (errmsg = exmagick_check_limits(&resource->limits, width, height, width * height)))
+  { return(errmsg); }
+
+  errmsg = exmagick_op_swap_image(resource, ScaleImage(resource->image, width, height, &resource->e_info));
+  if (errmsg != NULL && exmagick_is_limit_error(&resource->e_info))
+  { errmsg = exmagick_limit_reason(width, height); }
+  exmagick_stat(EXM_STAT_SIZE, start, errmsg, resource->image, 0, 0);
+  return(errmsg);
+}
+
+static
+char *exmagick_op_thumb (exm_resource_t *resource, long width, long height)
+{
+  char *errmsg;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  if (NULL != (errmsg = exmagick_check_limits(&resource->limits, width, height, width * height)))
+  { return(errmsg); }
+
+  errmsg = exmagick_op_swap_image(resource, ThumbnailImage(resource->image, width, height, &resource->e_info));
+  if (errmsg != NULL && exmagick_is_limit_error(&resource->e_info))
+  { errmsg = exmagick_limit_reason(width, height); }
+  exmagick_stat(EXM_STAT_THUMB, start, errmsg, resource->image, 0, 0);
+  return(errmsg);
+}
+
+static
+char *exmagick_op_crop (exm_resource_t *resource, RectangleInfo *rect)
+{
+  char *errmsg;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  errmsg = exmagick_op_swap_image(resource, CropImage(resource->image, rect, &resource->e_info));
+  exmagick_stat(EXM_STAT_CROP, start, errmsg, resource->image, 0, 0);
+  return(errmsg);
+}
+
+static
+char *exmagick_set_adjoin (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  if (0 == exmagick_get_boolean_u(env, value, &resource->i_info->adjoin))
+  { return("argv[2]: bad argument"); }
+  return(NULL);
+}
+
+static
+char *exmagick_set_magick (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  ErlNifBinary utf8;
+  char magick[MaxTextExtent];
+
+  if (0 == exmagick_get_utf8str(env, value, &utf8))
+  { return("argv[2]: bad argument"); }
+  exmagick_utf8strcpy(magick, &utf8, MaxTextExtent);
+  return(exmagick_op_set_magick(resource, magick));
+}
+
+static
+char *exmagick_set_density (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  ErlNifBinary utf8;
+
+  if (0 == exmagick_get_utf8str(env, value, &utf8))
+  { return("argv[2]: bad argument"); }
+  MagickFree(resource->i_info->density);
+  resource->i_info->density=exmagick_utf8strdup(&utf8);
+  if (resource->i_info->density == NULL)
+  { return("could not set density"); }
+  return(NULL);
+}
+
+/*
+  The quality of the encoder: the JPEG quality, or the zlib level (tens)
+  and filter (units) of PNG.
+ */
+static
+char *exmagick_set_quality (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  unsigned long quality;
+
+  if (0 == enif_get_ulong(env, value, &quality) || quality > 100)
+  { return("argv[2]: bad argument"); }
+  resource->i_info->quality = quality;
+  return(NULL);
+}
+
+static
+char *exmagick_set_interlace (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  int interlace;
+
+  if (0 == exmagick_get_choice(value, exm_interlaces, &interlace))
+  { return("argv[2]: bad argument"); }
+  resource->i_info->interlace = (InterlaceType) interlace;
+  return(NULL);
+}
+
+static
+char *exmagick_set_sampling_factor (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  ErlNifBinary utf8;
+
+  if (0 == exmagick_get_utf8str(env, value, &utf8))
+  { return("argv[2]: bad argument"); }
+  MagickFree(resource->i_info->sampling_factor);
+  resource->i_info->sampling_factor=exmagick_utf8strdup(&utf8);
+  if (resource->i_info->sampling_factor == NULL)
+  { return("could not set sampling_factor"); }
+  return(NULL);
+}
+
+/*
+  Adds coder definitions (`"key=value,..."`, ex.: `jpeg:dct-method=fast`)
+  to the ones the handle already has.
+ */
+static
+char *exmagick_set_define (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM value)
+{
+  ErlNifBinary utf8;
+  char definitions[MaxTextExtent];
+
+  if (0 == exmagick_get_utf8str(env, value, &utf8))
+  { return("argv[2]: bad argument"); }
+  exmagick_utf8strcpy(definitions, &utf8, MaxTextExtent);
+  if (strlen(resource->defines) + strlen(definitions) + 1 >= MaxTextExtent)
+  { return("define: too many definitions"); }
+  if (MagickFail == AddDefinitions(resource->i_info, definitions, &resource->e_info))
+  { return(exmagick_exception_reason(&resource->e_info)); }
+
+  if (resource->defines[0] != '\0')
+  { strcat(resource->defines, ","); }
+  strcat(resource->defines, definitions);
+  return(NULL);
+}
+
+static
+char *exmagick_get_adjoin (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  *value = enif_make_atom(env, resource->i_info->adjoin == 0 ? "false" : "true");
+  return(NULL);
+}
+
+static
+char *exmagick_get_density (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  *value = exmagick_make_utf8str(env, resource->i_info->density);
+  return(NULL);
+}
+
+static
+char *exmagick_get_quality (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  *value = enif_make_ulong(env, resource->i_info->quality);
+  return(NULL);
+}
+
+static
+char *exmagick_get_interlace (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  unsigned int k;
+
+  for (k = 0; exm_interlaces[k].name != NULL; k += 1)
+  {
+    if (exm_interlaces[k].value == (int) resource->i_info->interlace)
+    {
+      *value = exm_interlaces[k].atom;
+      return(NULL);
+    }
+  }
+  *value = enif_make_atom(env, "undefined");
+  return(NULL);
+}
+
+static
+char *exmagick_get_sampling_factor (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  *value = exmagick_make_utf8str(env, resource->i_info->sampling_factor);
+  return(NULL);
+}
+
+static
+char *exmagick_get_rows (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+  *value = enif_make_long(env, resource->image->rows);
+  return(NULL);
+}
+
+static
+char *exmagick_get_columns (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+  *value = enif_make_long(env, resource->image->columns);
+  return(NULL);
+}
+
+static
+char *exmagick_get_magick (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM *value)
+{
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+  *value = exmagick_make_utf8str(env, resource->image->magick);
+  return(NULL);
+}
+
+/*
+  Finds an attribute by its atom, NULL if there is no such attribute.
+ */
+static
+const exm_attr_t *exmagick_find_attr (ERL_NIF_TERM attr)
+{
+  unsigned int k;
+
+  for (k = 0; exm_attrs[k].name != NULL; k += 1)
+  {
+    if (enif_is_identical(attr, exm_attrs[k].atom))
+    { return(&exm_attrs[k]); }
+  }
+  return(NULL);
+}
+
+/*
+  Attributes that can not be set are silently ignored.
+ */
+static
+char *exmagick_op_set_attr (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM attr, ERL_NIF_TERM value)
+{
+  const exm_attr_t *found;
+
+  if (0 == enif_is_atom(env, attr))
+  { return("argv[1]: bad argument"); }
+
+  found = exmagick_find_attr(attr);
+  if (found == NULL || found->set == NULL)
+  { return(NULL); }
+  return(found->set(env, resource, value));
+}
+
+static
+char *exmagick_op_get_attr (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM attr, ERL_NIF_TERM *value)
+{
+  const exm_attr_t *found = exmagick_find_attr(attr);
+
+  if (found == NULL || found->get == NULL)
+  { return("invalid attribute"); }
+  return(found->get(env, resource, value));
+}
+
+static
+char *exmagick_op_num_pages (exm_resource_t *resource, int *num_pages)
+{
+  Image *image;
+
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  image = resource->image;
+  *num_pages = 1;
+
+  while((image = image->next))
+  { ++(*num_pages); }
+
+  return(NULL);
+}
+
+static
+ERL_NIF_TERM exmagick_set_size (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  long width, height;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_get_long(env, argv[1], &width))
+  { EXM_FAIL(ehandler, "width: bad argument"); }
+
+  if (0 == enif_get_long(env, argv[2], &height))
+  { EXM_FAIL(ehandler, "height: bad argument"); }
+
+  EXM_WLOCK(resource);
+  result = exmagick_make_measured(env, exmagick_op_scale(resource, width, height), argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_num_pages (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_resource_t *resource = NULL;
+  int num_pages;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  EXM_RLOCK(resource);
+  errmsg = exmagick_op_num_pages(resource, &num_pages);
+  EXM_RUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  resource = NULL;
+
+  if (errmsg != NULL)
+  { goto ehandler; }
+
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_int(env, num_pages)));
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Crops `rows` rows of the image, all its columns, starting at row `y`.
+ */
+static
+Image *exmagick_crop_rows (const Image *image, unsigned long y, unsigned long rows, ExceptionInfo *e_info)
+{
+  RectangleInfo rect;
+
+  rect.x      = 0;
+  rect.y      = (long) y;
+  rect.width  = image->columns;
+  rect.height = rows;
+  return(CropImage(image, &rect, e_info));
+}
+
+/*
+  Stacks `bottom` under `top`, both single images, into a new image.
+ */
+static
+Image *exmagick_stack_images (Image *top, Image *bottom, ExceptionInfo *e_info)
+{
+  Image *result;
+
+  top->next        = bottom;
+  bottom->previous = top;
+  result = AppendImages(top, 1, e_info);
+  top->next        = NULL;
+  bottom->previous = NULL;
+  return(result);
+}
+
+/*
+  Sizes the levels of a pyramid for an image of `columns`x`rows`, each
+  level being half the size of the one above, rounded up.
+ */
+static
+void exmagick_init_pyramid (exm_pyramid_t *pyramid, unsigned long columns, unsigned long rows)
+{
+  unsigned int k;
+  unsigned long size;
+
+  for (pyramid->count = 1, size = 1; pyramid->count < EXM_TILES_LEVELS && (size < columns || size < rows); size *= 2)
+  { pyramid->count += 1; }
+
+  for (k = pyramid->count; k > 0; k -= 1)
+  {
+    pyramid->levels[k - 1].window   = NULL;
+    pyramid->levels[k - 1].odd      = NULL;
+    pyramid->levels[k - 1].width    = columns;
+    pyramid->levels[k - 1].height   = rows;
+    pyramid->levels[k - 1].top      = 0;
+    pyramid->levels[k - 1].received = 0;
+    pyramid->levels[k - 1].row      = 0;
+    columns = (columns + 1) / 2;
+    rows    = (rows + 1) / 2;
+  }
+}
+
+static
+void exmagick_free_pyramid (exm_pyramid_t *pyramid)
+{
+  unsigned int k;
+
+  for (k = 0; k < pyramid->count; k += 1)
+  {
+    if (pyramid->levels[k].window != NULL)
+    { DestroyImageList(pyramid->levels[k].window); }
+    if (pyramid->levels[k].odd != NULL)
+    { DestroyImageList(pyramid->levels[k].odd); }
+  }
+  pyramid->count = 0;
+}
+
+/*
+  Writes the row of tiles `row` of level `index` out of the rows of the
+  level held in its window. Tiles overlap their neighbours by `overlap`
+  pixels on each inner side.
+ */
+static
+char *exmagick_write_tiles (exm_resource_t *resource, const exm_pyramid_t *pyramid, unsigned int index)
+{
+  char *errmsg;
+  Image *tile;
+  RectangleInfo rect;
+  unsigned long col;
+  unsigned long size    = pyramid->tile_size;
+  unsigned long overlap = pyramid->overlap;
+  const exm_level_t *level = &pyramid->levels[index];
+  char filename[MaxTextExtent];
+
+  sprintf(filename, "%.*s/%u", MaxTextExtent - 16, pyramid->dir, index);
+  if (level->row == 0 && 0 != mkdir(filename, 0755) && errno != EEXIST)
+  { return("could not create the level directory"); }
+
+  rect.y      = (long) (level->row * size - (level->row > 0 ? overlap : 0));
+  rect.height = size + (level->row > 0 ? overlap : 0) + overlap;
+  if (rect.y + rect.height > level->height)
+  { rect.height = level->height - rect.y; }
+  rect.y -= (long) level->top;
+
+  for (col = 0; col * size < level->width; col += 1)
+  {
+    if (NULL != (errmsg = exmagick_watch_poll()))
+    { return(errmsg); }
+
+    rect.x     = (long) (col * size - (col > 0 ? overlap : 0));
+    rect.width = size + (col > 0 ? overlap : 0) + overlap;
+    if (rect.x + rect.width > level->width)
+    { rect.width = level->width - rect.x; }
+
+    tile = CropImage(level->window, &rect, &resource->e_info);
+    if (tile == NULL)
+    { return(exmagick_exception_reason(&resource->e_info)); }
+
+    sprintf(filename, "%.*s/%u/%lu_%lu.%.8s", MaxTextExtent - 64, pyramid->dir, index, col, level->row, pyramid->format);
+    strncpy(tile->magick, pyramid->format, MaxTextExtent - 1);
+    if (0 == WriteImages(resource->i_info, tile, filename, &resource->e_info))
+    {
+      DestroyImageList(tile);
+      return(exmagick_exception_reason(&resource->e_info));
+    }
+    DestroyImageList(tile);
+  }
+  return(NULL);
+}
+
+/*
+  Hands the next rows of level `index` over to it. They are scaled into
+  the level below first, pairs of rows into one, down to level `last`,
+  then added to the window of the level, out of which every row of tiles
+  they complete is written. The rows no row of tiles needs anymore are
+  dropped, so a level never holds much more than a row of tiles. The
+  strip is left to the caller.
+ */
+static
+char *exmagick_feed_level (exm_resource_t *resource, exm_pyramid_t *pyramid, unsigned int index, unsigned int last, Image *strip)
+{
+  int split = 0;
+  char *errmsg;
+  Image *pending, *paired, *scaled = NULL, *window;
+  unsigned long rows, first;
+  exm_level_t *level = &pyramid->levels[index];
+
+  level->received += strip->rows;
+  if (index > last)
+  {
+    pending = strip;
+    if (level->odd != NULL)
+    {
+      pending = exmagick_stack_images(level->odd, strip, &resource->e_info);
+      DestroyImageList(level->odd);
+      level->odd = NULL;
+      if (pending == NULL)
+      { return(exmagick_exception_reason(&resource->e_info)); }
+    }
+
+    rows   = pending->rows;
+    paired = pending;
+    if (rows % 2 != 0 && level->received < level->height)
+    {
+      split      = 1;
+      rows      -= 1;
+      level->odd = exmagick_crop_rows(pending, rows, 1, &resource->e_info);
+      paired     = rows > 0 ? exmagick_crop_rows(pending, 0, rows, &resource->e_info) : NULL;
+    }
+    if (paired != NULL)
+    { scaled = ScaleImage(paired, pyramid->levels[index - 1].width, (rows + 1) / 2, &resource->e_info); }
+
+    if (paired != NULL && paired != pending)
+    { DestroyImageList(paired); }
+    if (pending != strip)
+    { DestroyImageList(pending); }
+    if ((split && level->odd == NULL) || (rows > 0 && scaled == NULL))
+    {
+      if (scaled != NULL)
+      { DestroyImageList(scaled); }
+      return(exmagick_exception_reason(&resource->e_info));
+    }
+
+    if (scaled != NULL)
+    {
+      errmsg = exmagick_feed_level(resource, pyramid, index - 1, last, scaled);
+      DestroyImageList(scaled);
+      if (errmsg != NULL)
+      { return(errmsg); }
+    }
+  }
+
+  window = level->window == NULL ? CloneImage(strip, 0, 0, 1, &resource->e_info)
+                                 : exmagick_stack_images(level->window, strip, &resource->e_info);
+  if (window == NULL)
+  { return(exmagick_exception_reason(&resource->e_info)); }
+  if (level->window != NULL)
+  { DestroyImageList(level->window); }
+  level->window = window;
+
+  for (errmsg = NULL; errmsg == NULL && level->row * pyramid->tile_size < level->height; level->row += 1)
+  {
+    if (level->received < level->height && level->received < (level->row + 1) * pyramid->tile_size + pyramid->overlap)
+    { break; }
+    errmsg = exmagick_write_tiles(resource, pyramid, index);
+  }
+  if (errmsg != NULL)
+  { return(errmsg); }
+
+  first = level->row * pyramid->tile_size - (level->row > 0 ? pyramid->overlap : 0);
+  if (first >= level->received)
+  {
+    DestroyImageList(level->window);
+    level->window = NULL;
+  }
+  else if (first > level->top)
+  {
+    window = exmagick_crop_rows(level->window, first - level->top, level->received - first, &resource->e_info);
+    if (window == NULL)
+    { return(exmagick_exception_reason(&resource->e_info)); }
+    DestroyImageList(level->window);
+    level->window = window;
+    level->top    = first;
+  }
+  return(NULL);
+}
+
+/*
+  Hands an image of the size of level `index` over to the pyramid, a row
+  of tiles at a time, refer to `exmagick_feed_level`.
+ */
+static
+char *exmagick_feed_image (exm_resource_t *resource, exm_pyramid_t *pyramid, unsigned int index, unsigned int last, const Image *image)
+{
+  char *errmsg = NULL;
+  Image *strip;
+  unsigned long y, rows;
+
+  for (y = 0; errmsg == NULL && y < image->rows; y += rows)
+  {
+    rows = image->rows - y < pyramid->tile_size ? image->rows - y : pyramid->tile_size;
+    if (NULL == (strip = exmagick_crop_rows(image, y, rows, &resource->e_info)))
+    { return(exmagick_exception_reason(&resource->e_info)); }
+    errmsg = exmagick_feed_level(resource, pyramid, index, last, strip);
+    DestroyImageList(strip);
+  }
+  return(errmsg);
+}
+
+/*
+  Reads (or pings) the first frame of the file `source`, with the size
+  and the tile geometry of the image info set to `size` and `tile` for
+  that read only.
+ */
+static
+Image *exmagick_read_source (exm_resource_t *resource, Image *(*reader)(const ImageInfo *, ExceptionInfo *), const char *source, const char *size, const char *tile)
+{
+  Image *image;
+
+  strcpy(resource->i_info->filename, source);
+  MagickFree(resource->i_info->size);
+  MagickFree(resource->i_info->tile);
+  resource->i_info->size     = size == NULL ? NULL : exmagick_strdup(size);
+  resource->i_info->tile     = tile == NULL ? NULL : exmagick_strdup(tile);
+  resource->i_info->subimage = 0;
+  resource->i_info->subrange = 1;
+  image = reader(resource->i_info, &resource->e_info);
+  exmagick_unset_load_opts(resource);
+  return(image);
+}
+
+/*
+  Builds the levels of the pyramid from `index` down out of a decode of
+  `source` given the size of that level as a hint, which the JPEG coder
+  honors by scaling the image down while decoding it. What it decodes
+  is scaled again to the exact size of the level.
+ */
+static
+char *exmagick_feed_hinted (exm_resource_t *resource, exm_pyramid_t *pyramid, const char *source, unsigned int index)
+{
+  char *errmsg;
+  Image *image, *scaled;
+  char size[MaxTextExtent];
+  const exm_level_t *level = &pyramid->levels[index];
+
+  sprintf(size, "%lux%lu", level->width, level->height);
+  if (NULL == (image = exmagick_read_source(resource, ReadImage, source, size, NULL)))
+  { return(exmagick_exception_reason(&resource->e_info)); }
+
+  if (image->columns != level->width || image->rows != level->height)
+  {
+    scaled = ScaleImage(image, level->width, level->height, &resource->e_info);
+    DestroyImageList(image);
+    if (NULL == (image = scaled))
+    { return(exmagick_exception_reason(&resource->e_info)); }
+  }
+  errmsg = exmagick_feed_image(resource, pyramid, index, 0, image);
+  DestroyImageList(image);
+  return(errmsg);
+}
+
+/*
+  Writes a Deep Zoom pyramid into `pyramid->dir`: level N holds the full
+  size image, each level below it half the size of the one above, down
+  to a single pixel at level 0. The tiles of level L go to
+  `dir/L/C_R.format`, C and R being the column and the row of the tile.
+
+  The image is the one of the handle (its first frame) when `source` is
+  NULL and the file `source` otherwise, `size` giving the dimensions of
+  raw files. It goes into level N a strip at a time and each level
+  scales the rows it gets into the one below, so only about a row of
+  tiles per level is held on top of the image.
+
+  Files are read a strip at a time by the coders that read regions (the
+  raw ones, such as GRAY or RGB) and decoded in full by the others, the
+  ones of JPEG, PNG and TIFF included. The full decode of a JPEG file
+  only goes into level N and is released before the levels below are
+  built out of a decode at half its size.
+ */
+static
+char *exmagick_op_tiles (exm_resource_t *resource, exm_pyramid_t *pyramid, const char *source, const char *size)
+{
+  int jpeg;
+  char *errmsg;
+  Image *image;
+  unsigned int top;
+  unsigned long columns, rows, y, height;
+  char tile[MaxTextExtent];
+
+  if (source == NULL && resource->image == NULL)
+  { return("image not loaded"); }
+
+  if (source == NULL)
+  {
+    exmagick_init_pyramid(pyramid, resource->image->columns, resource->image->rows);
+    return(exmagick_feed_image(resource, pyramid, pyramid->count - 1, 0, resource->image));
+  }
+
+  if (NULL == (image = exmagick_read_source(resource, PingImage, source, size, NULL)))
+  { return(exmagick_exception_reason(&resource->e_info)); }
+  columns = image->columns;
+  rows    = image->rows;
+  jpeg    = 0 == strcmp(image->magick, "JPEG");
+  errmsg  = exmagick_check_image(&resource->limits, image);
+  DestroyImageList(image);
+  if (errmsg != NULL)
+  { return(errmsg); }
+
+  exmagick_init_pyramid(pyramid, columns, rows);
+  top = pyramid->count - 1;
+  for (y = 0; errmsg == NULL && y < rows; y += height)
+  {
+    height = rows - y < pyramid->tile_size ? rows - y : pyramid->tile_size;
+    sprintf(tile, "%lux%lu+0+%lu", columns, height, y);
+    if (NULL == (image = exmagick_read_source(resource, ReadImage, source, size, tile)))
+    { return(exmagick_exception_reason(&resource->e_info)); }
+
+    if (image->columns == columns && image->rows == height)
+    { errmsg = exmagick_feed_level(resource, pyramid, top, 0, image); }
+    else if (y == 0 && image->columns == columns && image->rows == rows)
+    {
+      /* the coder ignored the region */
+      height = rows;
+      errmsg = exmagick_feed_image(resource, pyramid, top, jpeg ? top : 0, image);
+      if (errmsg == NULL && jpeg && top > 0)
+      {
+        DestroyImageList(image);
+        image  = NULL;
+        errmsg = exmagick_feed_hinted(resource, pyramid, source, top - 1);
+      }
+    }
+    else
+    { errmsg = "the source changed while being read"; }
+
+    if (image != NULL)
+    { DestroyImageList(image); }
+  }
+  return(errmsg);
+}
+
+/*
+  Writes the Deep Zoom pyramid of the image, or of a file, into a
+  directory, refer to `exmagick_op_tiles`. Returns the number of levels
+  and the size of the image.
+ */
+static
+ERL_NIF_TERM exmagick_tiles (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  int arity;
+  unsigned long width, height;
+  const ERL_NIF_TERM *dims;
+  ErlNifBinary utf8;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+  exm_pyramid_t pyramid;
+  const exm_level_t *level;
+  char dir[MaxTextExtent];
+  char format[MaxTextExtent];
+  char source[MaxTextExtent];
+  char size[MaxTextExtent];
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  pyramid.count = 0;
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+  exmagick_utf8strcpy(dir, &utf8, MaxTextExtent);
+
+  if (0 == enif_get_ulong(env, argv[2], &pyramid.tile_size) || pyramid.tile_size == 0)
+  { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
+
+  if (0 == enif_get_ulong(env, argv[3], &pyramid.overlap) || pyramid.overlap >= pyramid.tile_size)
+  { EXM_FAIL(ehandler, "argv[3]: bad argument"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[4], &utf8))
+  { EXM_FAIL(ehandler, "argv[4]: bad argument"); }
+  exmagick_utf8strcpy(format, &utf8, MaxTextExtent);
+
+  if (0 == enif_is_atom(env, argv[5]) && 0 == exmagick_get_utf8str(env, argv[5], &utf8))
+  { EXM_FAIL(ehandler, "argv[5]: bad argument"); }
+  if (0 == enif_is_atom(env, argv[5]))
+  { exmagick_utf8strcpy(source, &utf8, MaxTextExtent); }
+
+  if (0 == enif_is_atom(env, argv[6]))
+  {
+    if (0 == enif_get_tuple(env, argv[6], &arity, &dims) || arity != 2
+        || 0 == enif_get_ulong(env, dims[0], &width) || 0 == enif_get_ulong(env, dims[1], &height)
+        || width == 0 || height == 0)
+    { EXM_FAIL(ehandler, "argv[6]: bad argument"); }
+    sprintf(size, "%lux%lu", width, height);
+  }
+
+  pyramid.dir    = dir;
+  pyramid.format = format;
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  {
+    errmsg = exmagick_op_tiles(resource, &pyramid,
+                               enif_is_atom(env, argv[5]) ? NULL : source,
+                               enif_is_atom(env, argv[6]) ? NULL : size);
+  }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  if (errmsg == NULL)
+  {
+    level  = &pyramid.levels[pyramid.count - 1];
+    result = enif_make_new_map(env);
+    enif_make_map_put(env, result, enif_make_atom(env, "levels"), enif_make_uint(env, pyramid.count), &result);
+    enif_make_map_put(env, result, enif_make_atom(env, "width"), enif_make_ulong(env, level->width), &result);
+    enif_make_map_put(env, result, enif_make_atom(env, "height"), enif_make_ulong(env, level->height), &result);
+  }
+  result = exmagick_make_result(env, errmsg, errmsg == NULL ? result : 0);
+  exmagick_free_pyramid(&pyramid);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_crop (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  RectangleInfo rect;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  /* build rectangle */
+  if (0 == enif_get_long(env, argv[1], &rect.x))
+  { EXM_FAIL(ehandler, "x0: bad argument"); }
+
+  if (0 == enif_get_long(env, argv[2], &rect.y))
+  { EXM_FAIL(ehandler, "y0: bad argument"); }
+
+  if (0 == enif_get_ulong(env, argv[3], &rect.width))
+  { EXM_FAIL(ehandler, "width: bad argument"); }
+
+  if (0 == enif_get_ulong(env, argv[4], &rect.height))
+  { EXM_FAIL(ehandler, "height: bad argument"); }
+
+  /* actually crops image */
+  EXM_WLOCK(resource);
+  result = exmagick_make_measured(env, exmagick_op_crop(resource, &rect), argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_resize (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_op_t op;
+  ERL_NIF_TERM args[5], result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  args[0] = exm_atom_resize;
+  memcpy(&args[1], &argv[1], 4 * sizeof(ERL_NIF_TERM));
+  if (NULL != (errmsg = exmagick_compile_op(env, 5, args, &op)))
+  { goto ehandler; }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_resize(resource, &op); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_thumb (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  long width, height;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_get_long(env, argv[1], &width))
+  { EXM_FAIL(ehandler, "width: bad argument"); }
+
+  if (0 == enif_get_long(env, argv[2], &height))
+  { EXM_FAIL(ehandler, "height: bad argument"); }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_thumb(resource, width, height); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_set_attr (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  EXM_WLOCK(resource);
+  result = exmagick_make_result(env, exmagick_op_set_attr(env, resource, argv[1], argv[2]), argv[0]);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_get_attr (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM value, result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  EXM_RLOCK(resource);
+  errmsg = exmagick_op_get_attr(env, resource, argv[1], &value);
+  result = exmagick_make_result(env, errmsg, value);
+  EXM_RUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_load_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifBinary blob;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_inspect_binary(env, argv[1], &blob))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_load_blob(env, resource, &blob, argc > 2 ? &argv[2] : NULL, 1); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_load_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifBinary utf8;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_load_file(env, resource, &utf8, argc > 2 ? &argv[2] : NULL); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_load_mmap (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifBinary utf8;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_load_mmap(env, resource, &utf8, argc > 2 ? &argv[2] : NULL); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_dump_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifBinary utf8;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_dump_file(resource, &utf8); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_image_dump_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+  ERL_NIF_TERM blob_term, result;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_dump_blob(env, resource, &blob_term); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, blob_term, resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_convert (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_op_t op;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (NULL != (errmsg = exmagick_compile_convert(env, argv[1], argv[2], &op)))
+  { goto ehandler; }
+
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_apply_op(resource, &op); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_measured(env, errmsg, argv[0], resource);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Runs a single pipeline operation. `op` is the tuple (or the bare
+  atom) describing the operation and `result` receives the term the
+  pipeline should return if this is its last step.
+ */
+static
+char *exmagick_pipeline_step (ErlNifEnv *env, exm_resource_t *resource, int arity, const ERL_NIF_TERM op[], ERL_NIF_TERM *result)
+{
+  char *errmsg;
+  ErlNifBinary bin;
+  exm_op_t compiled;
+
+  if ((arity == 2 || arity == 3) && enif_is_identical(op[0], exm_atom_load_blob))
+  {
+    if (0 == enif_inspect_binary(env, op[1], &bin))
+    { return("load_blob: bad argument"); }
+    return(exmagick_op_load_blob(env, resource, &bin, arity == 3 ? &op[2] : NULL, 1));
+  }
+
+  if ((arity == 2 || arity == 3) && enif_is_identical(op[0], exm_atom_load_file))
+  {
+    if (0 == exmagick_get_utf8str(env, op[1], &bin))
+    { return("load_file: bad argument"); }
+    return(exmagick_op_load_file(env, resource, &bin, arity == 3 ? &op[2] : NULL));
+  }
+
+  if ((arity == 2 || arity == 3) && enif_is_identical(op[0], exm_atom_load_mmap))
+  {
+    if (0 == exmagick_get_utf8str(env, op[1], &bin))
+    { return("load_mmap: bad argument"); }
+    return(exmagick_op_load_mmap(env, resource, &bin, arity == 3 ? &op[2] : NULL));
+  }
+
+  if (arity == 2 && enif_is_identical(op[0], exm_atom_dump_file))
+  {
+    if (0 == exmagick_get_utf8str(env, op[1], &bin))
+    { return("dump_file: bad argument"); }
+    return(exmagick_op_dump_file(resource, &bin));
+  }
+
+  if (arity == 1 && enif_is_identical(op[0], exm_atom_dump_blob))
+  { return(exmagick_op_dump_blob(env, resource, result)); }
+
+  if (arity == 3 && enif_is_identical(op[0], exm_atom_attr))
+  { return(exmagick_op_set_attr(env, resource, op[1], op[2])); }
+
+  if (NULL != (errmsg = exmagick_compile_op(env, arity, op, &compiled)))
+  { return(errmsg); }
+  return(exmagick_apply_op(resource, &compiled));
+}
+
+/*
+  Runs a list of operations on the handle, which must be locked for
+  writing. Each step releases the image it replaces so only one decoded
+  image is alive at any time. The result is `handle`, or the blob when
+  the last step is `dump_blob`.
+ */
+static
+char *exmagick_run_pipeline (ErlNifEnv *env, exm_resource_t *resource, ERL_NIF_TERM handle, ERL_NIF_TERM ops, ERL_NIF_TERM *result)
+{
+  int arity;
+  char *errmsg;
+  const ERL_NIF_TERM *op;
+  ERL_NIF_TERM head, tail;
+
+  tail = ops;
+  while (enif_get_list_cell(env, tail, &head, &tail))
+  {
+    *result = handle;
+    if (enif_is_atom(env, head))
+    {
+      op    = &head;
+      arity = 1;
+    }
+    else if (0 == enif_get_tuple(env, head, &arity, &op) || arity < 1)
+    { return("pipeline: bad operation"); }
+
+    if (NULL != (errmsg = exmagick_watch_poll()))
+    { return(errmsg); }
+    if (NULL != (errmsg = exmagick_pipeline_step(env, resource, arity, op, result)))
+    { return(errmsg); }
+  }
+
+  if (0 == enif_is_list(env, tail))
+  { return("pipeline: bad argument"); }
+  return(NULL);
+}
+
+/*
+  Runs a list of operations on the handle in a single call, refer to
+  `exmagick_run_pipeline`.
+ */
+static
+ERL_NIF_TERM exmagick_pipeline (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM result;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  result = argv[0];
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_run_pipeline(env, resource, argv[0], argv[1], &result); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_result(env, errmsg, result);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+void *exmagick_pool_worker (void *arg)
+{
+  char *errmsg;
+  exm_job_t *job;
+  exm_watch_t watch;
+  ERL_NIF_TERM result;
+  exm_resource_t *resource;
+
+  for (;;)
+  {
+    enif_mutex_lock(exm_pool.mutex);
+    while (exm_pool.count == 0 && 0 == exm_pool.stopping)
+    { enif_cond_wait(exm_pool.cond, exm_pool.mutex); }
+
+    if (exm_pool.count == 0)
+    {
+      enif_mutex_unlock(exm_pool.mutex);
+      return(NULL);
+    }
+
+    job            = exm_pool.queue[exm_pool.head];
+    exm_pool.head  = (exm_pool.head + 1) % exm_pool.capacity;
+    exm_pool.count = exm_pool.count - 1;
+    enif_mutex_unlock(exm_pool.mutex);
+
+    result   = job->handle;
+    resource = exmagick_pin_handle(job->owner);
+    if (resource == NULL)
+    { result = exmagick_make_error(job->env, "invalid handle"); }
+    else
+    {
+      EXM_WLOCK(resource);
+      errmsg = exmagick_watch_start(&watch, NULL, &job->cancelled, resource);
+      if (errmsg == NULL && job->stream != NULL)
+      { errmsg = exmagick_run_stream(resource, job->stream); }
+      else if (errmsg == NULL)
+      { errmsg = exmagick_run_pipeline(job->env, resource, job->handle, job->ops, &result); }
+      errmsg = exmagick_watch_stop(&watch, errmsg);
+      result = exmagick_make_result(job->env, errmsg, result);
+      EXM_WUNLOCK(resource);
+      exmagick_unpin_handle(resource);
+    }
+
+    /* under the pool mutex, so that no result is sent once
+     * `exmagick_cancel_async` returns */
+    enif_mutex_lock(exm_pool.mutex);
+    if (0 == job->cancelled)
+    { enif_send(NULL, &job->pid, job->env, enif_make_tuple2(job->env, enif_make_resource(job->env, job), result)); }
+    enif_mutex_unlock(exm_pool.mutex);
+    enif_release_resource(job);
+  }
+}
+
+/*
+  Starts the pool threads, must be called with the pool mutex held.
+  The pool runs with fewer threads when some of them fail to start.
+ */
+static
+char *exmagick_pool_start (void)
+{
+  unsigned int k = 0;
+
+  exm_pool.queue   = enif_alloc(exm_pool.capacity * sizeof(exm_job_t *));
+  exm_pool.threads = enif_alloc(exm_pool.num_threads * sizeof(ErlNifTid));
+  if (exm_pool.queue != NULL && exm_pool.threads != NULL)
+  {
+    for (; k < exm_pool.num_threads; k += 1)
+    {
+      if (0 != enif_thread_create("exmagick_pool", &exm_pool.threads[k], exmagick_pool_worker, NULL, NULL))
+      { break; }
+    }
+  }
+
+  if (k == 0)
+  {
+    if (exm_pool.queue != NULL)
+    { enif_free(exm_pool.queue); }
+    if (exm_pool.threads != NULL)
+    { enif_free(exm_pool.threads); }
+    exm_pool.queue   = NULL;
+    exm_pool.threads = NULL;
+    return("could not start the async pool");
+  }
+
+  exm_pool.num_threads = k;
+  return(NULL);
+}
+
+static
+char *exmagick_pool_submit (exm_job_t *job)
+{
+  char *errmsg = NULL;
+
+  enif_mutex_lock(exm_pool.mutex);
+  if (exm_pool.threads == NULL)
+  { errmsg = exmagick_pool_start(); }
+
+  if (errmsg == NULL && exm_pool.count == exm_pool.capacity)
+  { errmsg = "busy"; }
+
+  if (errmsg == NULL)
+  {
+    exm_pool.queue[(exm_pool.head + exm_pool.count) % exm_pool.capacity] = job;
+    exm_pool.count = exm_pool.count + 1;
+    enif_cond_signal(exm_pool.cond);
+  }
+  enif_mutex_unlock(exm_pool.mutex);
+  return(errmsg);
+}
+
+/*
+  Waits for the pool threads to finish the queued jobs and releases
+  the pool.
+ */
+static
+void exmagick_pool_stop (void)
+{
+  unsigned int k;
+
+  if (exm_pool.mutex == NULL)
+  { return; }
+
+  enif_mutex_lock(exm_pool.mutex);
+  exm_pool.stopping = 1;
+  enif_cond_broadcast(exm_pool.cond);
+  enif_mutex_unlock(exm_pool.mutex);
+
+  for (k = 0; exm_pool.threads != NULL && k < exm_pool.num_threads; k += 1)
+  { enif_thread_join(exm_pool.threads[k], NULL); }
+
+  if (exm_pool.threads != NULL)
+  { enif_free(exm_pool.threads); }
+  if (exm_pool.queue != NULL)
+  { enif_free(exm_pool.queue); }
+  if (exm_pool.cond != NULL)
+  { enif_cond_destroy(exm_pool.cond); }
+  enif_mutex_destroy(exm_pool.mutex);
+  memset(&exm_pool, 0, sizeof(exm_pool_t));
+}
+
+/*
+  Creates a job on the handle `handle` for the pool, monitoring the
+  calling process. The job is released on failure.
+ */
+static
+char *exmagick_alloc_job (ErlNifEnv *env, ErlNifResourceType *type, ERL_NIF_TERM handle, exm_job_t **job)
+{
+  exm_handle_t *owner;
+  exm_resource_t *resource;
+
+  *job = NULL;
+  if (0 == enif_get_resource(env, handle, type, (void **) &owner))
+  { return("invalid handle"); }
+  if (NULL == (resource = exmagick_pin_handle(owner)))
+  { return("invalid handle"); }
+  exmagick_unpin_handle(resource);
+
+  *job = enif_alloc_resource(exm_job_type, sizeof(exm_job_t));
+  if (*job == NULL)
+  { return("enif_alloc_resource"); }
+  memset(*job, 0, sizeof(exm_job_t));
+
+  (*job)->env = enif_alloc_env();
+  if ((*job)->env == NULL || NULL == enif_self(env, &(*job)->pid)
+      || 0 != enif_monitor_process(env, *job, &(*job)->pid, &(*job)->monitor))
+  {
+    enif_release_resource(*job);
+    *job = NULL;
+    return("enif_monitor_process");
+  }
+
+  (*job)->handle = enif_make_copy((*job)->env, handle);
+  (*job)->owner  = owner;
+  enif_keep_resource(owner);
+  return(NULL);
+}
+
+/*
+  Queues a `run_pipeline/2` call to the pool and returns a reference
+  right away. The result is sent to the caller as `{Ref, Result}` once
+  a pool thread is done with it. Fails with `busy` when the queue is
+  full. The caller is monitored: once it goes down its job is skipped,
+  or aborted if already running.
+ */
+static
+ERL_NIF_TERM exmagick_pipeline_async (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM ref;
+  exm_job_t *job = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == enif_is_list(env, argv[1]))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  if (NULL != (errmsg = exmagick_alloc_job(env, type, argv[0], &job)))
+  { goto ehandler; }
+
+  ref      = enif_make_resource(env, job);
+  job->ops = enif_make_copy(job->env, argv[1]);
+  if (NULL != (errmsg = exmagick_pool_submit(job)))
+  { goto ehandler; }
+
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), ref));
+
+ehandler:
+  if (job != NULL)
+  { enif_release_resource(job); }
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Gives up on the result of a `run_pipeline_async/2` call: the job is
+  skipped when dequeued, or aborted if already running, and its result
+  is never sent once this returns.
+ */
+static
+ERL_NIF_TERM exmagick_cancel_async (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_job_t *job;
+
+  if (0 == enif_get_resource(env, argv[0], exm_job_type, (void **) &job))
+  { return(enif_make_badarg(env)); }
+
+  enif_mutex_lock(exm_pool.mutex);
+  job->cancelled = 1;
+  enif_mutex_unlock(exm_pool.mutex);
+  return(enif_make_atom(env, "ok"));
+}
+
+/*
+  Builds the map returned by `ping/2` and releases the pinged image
+  list, which holds no pixels.
+ */
+static
+ERL_NIF_TERM exmagick_make_ping_info (ErlNifEnv *env, Image *image)
+{
+  ERL_NIF_TERM info = enif_make_new_map(env);
+
+  enif_make_map_put(env, info, enif_make_atom(env, "width"), enif_make_ulong(env, image->columns), &info);
+  enif_make_map_put(env, info, enif_make_atom(env, "height"), enif_make_ulong(env, image->rows), &info);
+  enif_make_map_put(env, info, enif_make_atom(env, "magick"), exmagick_make_utf8str(env, image->magick), &info);
+  enif_make_map_put(env, info, enif_make_atom(env, "pages"), enif_make_ulong(env, GetImageListLength(image)), &info);
+  enif_make_map_put(env, info, enif_make_atom(env, "density"),
+                    enif_make_tuple2(env, enif_make_double(env, image->x_resolution), enif_make_double(env, image->y_resolution)),
+                    &info);
+
+  DestroyImageList(image);
+  return(info);
+}
+
+static
+char *exmagick_op_ping (ErlNifEnv *env, exm_resource_t *resource, Image *image, ERL_NIF_TERM *info)
+{
+  if (image == NULL)
+  { return(exmagick_exception_reason(&resource->e_info)); }
+
+  *info = exmagick_make_ping_info(env, image);
+  return(NULL);
+}
+
+static
+ERL_NIF_TERM exmagick_ping_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifBinary utf8;
+  ERL_NIF_TERM info, result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  EXM_WLOCK(resource);
+  exmagick_utf8strcpy(resource->i_info->filename, &utf8, MaxTextExtent);
+  errmsg = exmagick_op_ping(env, resource, PingImage(resource->i_info, &resource->e_info), &info);
+  result = exmagick_make_result(env, errmsg, info);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+static
+ERL_NIF_TERM exmagick_ping_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifBinary blob;
+  ERL_NIF_TERM info, result;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
+  { EXM_FAIL(ehandler, "invalid handle"); }
+
+  if (0 == enif_inspect_binary(env, argv[1], &blob))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+
+  EXM_WLOCK(resource);
+  errmsg = exmagick_op_ping(env, resource, PingBlob(resource->i_info, blob.data, blob.size, &resource->e_info), &info);
+  result = exmagick_make_result(env, errmsg, info);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  return(result);
+
+ehandler:
+  exmagick_unpin_handle(resource);
+  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+}
+
+/*
+  Reads a `{Operations, Type}` rendition spec. The rendition is encoded
+  using the image type `Type` after all `Operations` are applied.
+ */
+static
+char *exmagick_compile_rendition (ErlNifEnv *env, ERL_NIF_TERM spec, exm_rendition_t *rendition)
+{
+  int arity;
+  char *errmsg;
+  unsigned int num_ops;
+  ErlNifBinary utf8;
+  const ERL_NIF_TERM *elems, *args;
+  ERL_NIF_TERM head, tail;
+
+  if (0 == enif_get_tuple(env, spec, &arity, &elems) || arity != 2)
+  { return("rendition: bad argument"); }
+
+  if (0 == enif_get_list_length(env, elems[0], &num_ops))
+  { return("rendition: bad argument"); }
+
+  /* the extra operation sets the image type */
+  rendition->ops = enif_alloc((num_ops + 1) * sizeof(exm_op_t));
+  if (rendition->ops == NULL)
+  { return("enif_alloc"); }
+
+  tail = elems[0];
+  while (enif_get_list_cell(env, tail, &head, &tail))
+  {
+    if (0 == enif_get_tuple(env, head, &arity, &args) || arity < 1)
+    { return("rendition: bad operation"); }
+    if (NULL != (errmsg = exmagick_compile_op(env, arity, args, &rendition->ops[rendition->num_ops])))
+    { return(errmsg); }
+    rendition->num_ops += 1;
+  }
+
+  if (0 == exmagick_get_utf8str(env, elems[1], &utf8))
+  { return("rendition: bad argument"); }
+  rendition->ops[rendition->num_ops].kind = EXM_OP_MAGICK;
+  exmagick_utf8strcpy(rendition->ops[rendition->num_ops].text, &utf8, MaxTextExtent);
+  rendition->num_ops += 1;
+
+  return(NULL);
+}
+
+/*
+  Produces a rendition out of the first frame of `source`. Runs on a
+  worker thread, so it must not touch any erlang term.
+ */
+static
+void exmagick_render (Image *source, const exm_limits_t *limits, exm_rendition_t *rendition)
+{
+  unsigned int k;
+  char *errmsg = NULL;
+  ErlNifTime start;
+  exm_resource_t context;
+
+  GetExceptionInfo(&context.e_info);
+  context.i_info = rendition->i_info;
+  context.lock   = NULL;
+  context.limits = *limits;
+  context.image  = CloneImage(source, 0, 0, 1, &context.e_info);
+  if (context.image == NULL)
+  { errmsg = exmagick_exception_reason(&context.e_info); }
+
+  for (k = 0; errmsg == NULL && k < rendition->num_ops; k += 1)
+  { errmsg = exmagick_apply_op(&context, &rendition->ops[k]); }
+
+  if (errmsg == NULL)
+  {
+    start = enif_monotonic_time(ERL_NIF_USEC);
+    rendition->blob = ImageToBlob(context.i_info, context.image, &rendition->size, &context.e_info);
+    if (rendition->blob == NULL)
+    { errmsg = exmagick_exception_reason(&context.e_info); }
+    exmagick_stat(EXM_STAT_DUMP, start, errmsg, NULL, 0, rendition->blob == NULL ? 0 : rendition->size);
+  }
+
+  if (rendition->blob == NULL)
+  { strncpy(rendition->errmsg, errmsg == NULL ? "unknown error" : errmsg, MaxTextExtent - 1); }
+
+  if (context.image != NULL)
+  { DestroyImage(context.image); }
+  DestroyExceptionInfo(&context.e_info);
+}
+
+/*
+  Reserves up to `wanted` rendition workers without waiting: callers
+  get fewer of them, possibly none, while others hold the rest and work
+  on their own thread meanwhile.
+ */
+static
+unsigned int exmagick_workers_acquire (unsigned int wanted)
+{
+  unsigned int count;
+
+  enif_mutex_lock(exm_workers.mutex);
+  count = wanted < exm_workers.available ? wanted : exm_workers.available;
+  exm_workers.available -= count;
+  enif_mutex_unlock(exm_workers.mutex);
+  return(count);
+}
+
+static
+void exmagick_workers_release (unsigned int count)
+{
+  enif_mutex_lock(exm_workers.mutex);
+  exm_workers.available += count;
+  enif_mutex_unlock(exm_workers.mutex);
+}
+
+/*
+  Produces the renditions nobody took yet, each of them watched against
+  the deadline of the handle (and the process of `env`, on the calling
+  thread), so the ones left fail once it passes.
+ */
+static
+void exmagick_renditions_run (exm_renditions_job_t *job, ErlNifEnv *env)
+{
+  unsigned int next;
+  char *errmsg;
+  exm_watch_t watch;
+  exm_rendition_t *rendition;
+
+  for (;;)
+  {
+    enif_mutex_lock(job->mutex);
+    next = job->next;
+    job->next += 1;
+    enif_mutex_unlock(job->mutex);
+
+    if (next >= job->count)
+    { break; }
+    rendition = &job->renditions[next];
+    if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, job->resource)))
+    { exmagick_render(job->source, &job->limits, rendition); }
+    if (NULL != (errmsg = exmagick_watch_stop(&watch, errmsg)))
+    {
+      if (rendition->blob != NULL)
+      { MagickFree(rendition->blob); }
+      rendition->blob = NULL;
+      strncpy(rendition->errmsg, errmsg, MaxTextExtent - 1);
+    }
+  }
+}
+
+static
+void *exmagick_renditions_worker (void *arg)
+{
+  exmagick_renditions_run((exm_renditions_job_t *) arg, NULL);
+  return(NULL);
+}
+
+static
+void exmagick_renditions_free (exm_renditions_job_t *job)
+{
+  unsigned int k;
+
+  for (k = 0; job->renditions != NULL && k < job->count; k += 1)
+  {
+    if (job->renditions[k].ops != NULL)
+    { enif_free(job->renditions[k].ops); }
+    if (job->renditions[k].i_info != NULL)
+    { DestroyImageInfo(job->renditions[k].i_info); }
+    if (job->renditions[k].blob != NULL)
+    { MagickFree(job->renditions[k].blob); }
+  }
+
+  if (job->renditions != NULL)
+  { enif_free(job->renditions); }
+  if (job->mutex != NULL)
+  { enif_mutex_destroy(job->mutex); }
+}
+
+/*
+  Produces many renditions of the image in parallel. The image is
+  decoded only once and each rendition gets its own copy of it (which
+  shares the pixels until changed). Renditions are distributed among
+  up to `argv[2]` threads, including the calling one, the others being
+  taken from `exm_workers` so that concurrent calls do not start more
+  threads than the async pool has. The result
+  is a list with `{ok, Blob}` or `{error, Reason}` for each rendition,
+  in the same order of the specs.
+ */
+static
+ERL_NIF_TERM exmagick_renditions (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  unsigned int k, count, concurrency, num_threads, reserved;
+  ErlNifTid *threads = NULL;
+  ERL_NIF_TERM head, tail, item, result;
+  exm_renditions_job_t job;
+  exm_rendition_t *rendition;
+  exm_resource_t *resource = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+
+  memset(&job, 0, sizeof(job));
+
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
   { EXM_FAIL(ehandler, "invalid handle"); }
 
-  if (resource->image == NULL)
-  { EXM_FAIL(ehandler, "image not loaded"); }
+  if (0 == enif_get_list_length(env, argv[1], &count))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
 
-  /* build rectangle */
-  if (0 == enif_get_long(env, argv[1], &rect.x))
-  { EXM_FAIL(ehandler, "x0: bad argument"); }
+  if (0 == enif_get_uint(env, argv[2], &concurrency) || concurrency == 0)
+  { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
 
-  if (0 == enif_get_long(env, argv[2], &rect.y))
-  { EXM_FAIL(ehandler, "y0: bad argument"); }
+  job.renditions = enif_alloc((count + 1) * sizeof(exm_rendition_t));
+  if (job.renditions == NULL)
+  { EXM_FAIL(ehandler, "enif_alloc"); }
+  memset(job.renditions, 0, (count + 1) * sizeof(exm_rendition_t));
+  job.count = count;
 
-  if (0 == enif_get_ulong(env, argv[3], &rect.width))
-  { EXM_FAIL(ehandler, "width: bad argument"); }
+  tail = argv[1];
+  for (k = 0; enif_get_list_cell(env, tail, &head, &tail); k += 1)
+  {
+    if (NULL != (errmsg = exmagick_compile_rendition(env, head, &job.renditions[k])))
+    { goto ehandler; }
+  }
 
-  if (0 == enif_get_ulong(env, argv[4], &rect.height))
-  { EXM_FAIL(ehandler, "height: bad argument"); }
+  num_threads = (concurrency < count ? concurrency : count);
+  threads = enif_alloc((num_threads + 1) * sizeof(ErlNifTid));
+  job.mutex = enif_mutex_create("exmagick.renditions");
+  if (threads == NULL || job.mutex == NULL)
+  { EXM_FAIL(ehandler, "could not allocate workers"); }
 
-  /* actually crops image */
-  cropped_image = CropImage(resource->image, &rect, &resource->e_info);
-  if (cropped_image == NULL)
+  EXM_RLOCK(resource);
+  job.source   = resource->image;
+  job.resource = resource;
+  exmagick_copy_limits(&job.limits, resource);
+  for (k = 0; job.source != NULL && k < count; k += 1)
   {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
+    job.renditions[k].i_info = CloneImageInfo(resource->i_info);
+    if (job.renditions[k].i_info == NULL)
+    { job.source = NULL; }
+  }
+  if (job.source == NULL)
+  {
+    EXM_RUNLOCK(resource);
+    EXM_FAIL(ehandler, resource->image == NULL ? "image not loaded" : "CloneImageInfo");
   }
-  DestroyImage(resource->image);
-  resource->image = cropped_image;
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  /* the calling thread is one of the workers */
+  reserved = exmagick_workers_acquire(num_threads > 1 ? num_threads - 1 : 0);
+  for (k = 0; k < reserved; k += 1)
+  {
+    if (0 != enif_thread_create("exmagick.renditions", &threads[k], exmagick_renditions_worker, &job, NULL))
+    { break; }
+  }
+  num_threads = k;
+  exmagick_renditions_run(&job, env);
+  for (k = 0; k < num_threads; k += 1)
+  { enif_thread_join(threads[k], NULL); }
+  exmagick_workers_release(reserved);
+  EXM_RUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+
+  result = enif_make_list(env, 0);
+  for (k = count; k > 0; k -= 1)
+  {
+    rendition = &job.renditions[k - 1];
+    if (rendition->blob != NULL)
+    {
+      errmsg = exmagick_make_blob(env, rendition->blob, rendition->size, &item);
+      rendition->blob = NULL;
+      item = exmagick_make_result(env, errmsg, item);
+    }
+    else
+    { item = exmagick_make_result(env, rendition->errmsg, 0); }
+    result = enif_make_list_cell(env, item, result);
+  }
+
+  enif_free(threads);
+  exmagick_renditions_free(&job);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
 
 ehandler:
+  exmagick_unpin_handle(resource);
+  if (threads != NULL)
+  { enif_free(threads); }
+  exmagick_renditions_free(&job);
   return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
 }
 
+/*
+  Applies a list of operations (the tuples of `image_pipeline/2`
+  restricted to transformations) to every frame of the image, using up
+  to `concurrency` threads. Refer to `exmagick_op_animate`.
+ */
 static
-ERL_NIF_TERM exmagick_image_thumb (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ERL_NIF_TERM exmagick_animate (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  long width, height;
-  Image* thumb;
-  exm_resource_t *resource;
+  int arity;
+  unsigned int num_ops = 0, concurrency, optimize;
+  const ERL_NIF_TERM *args;
+  ERL_NIF_TERM head, tail, result;
+  exm_op_t *ops = NULL;
+  exm_resource_t *resource = NULL;
+  exm_watch_t watch;
 
   EXM_INIT;
   ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
   { EXM_FAIL(ehandler, "invalid handle"); }
 
-  if (resource->image == NULL)
-  { EXM_FAIL(ehandler, "image not loaded"); }
+  if (0 == enif_get_list_length(env, argv[1], &num_ops))
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
 
-  if (0 == enif_get_long(env, argv[1], &width))
-  { EXM_FAIL(ehandler, "width: bad argument"); }
+  if (0 == exmagick_get_boolean_u(env, argv[2], &optimize))
+  { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
 
-  if (0 == enif_get_long(env, argv[2], &height))
-  { EXM_FAIL(ehandler, "height: bad argument"); }
+  if (0 == enif_get_uint(env, argv[3], &concurrency) || concurrency == 0)
+  { EXM_FAIL(ehandler, "argv[3]: bad argument"); }
 
-  thumb = ThumbnailImage(resource->image, width, height, &resource->e_info);
-  if (thumb == NULL)
+  ops = enif_alloc((num_ops + 1) * sizeof(exm_op_t));
+  if (ops == NULL)
+  { EXM_FAIL(ehandler, "enif_alloc"); }
+
+  num_ops = 0;
+  tail    = argv[1];
+  while (enif_get_list_cell(env, tail, &head, &tail))
   {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
+    if (0 == enif_get_tuple(env, head, &arity, &args) || arity < 1)
+    { EXM_FAIL(ehandler, "animate: bad operation"); }
+    if (NULL != (errmsg = exmagick_compile_op(env, arity, args, &ops[num_ops])))
+    { goto ehandler; }
+    num_ops += 1;
   }
-  DestroyImage(resource->image);
-  resource->image = thumb;
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  EXM_WLOCK(resource);
+  if (NULL == (errmsg = exmagick_watch_start(&watch, env, NULL, resource)))
+  { errmsg = exmagick_op_animate(resource, ops, num_ops, (int) optimize, concurrency); }
+  errmsg = exmagick_watch_stop(&watch, errmsg);
+  result = exmagick_make_result(env, errmsg, argv[0]);
+  EXM_WUNLOCK(resource);
+  exmagick_unpin_handle(resource);
+  enif_free(ops);
+  return(result);
 
 ehandler:
+  exmagick_unpin_handle(resource);
+  if (ops != NULL)
+  { enif_free(ops); }
   return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
 }
 
+/*
+  Describes every frame of the image: its size, its offset on the
+  canvas, how long it shows and what happens to it before the next
+  frame is drawn.
+ */
 static
-ERL_NIF_TERM exmagick_set_attr (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ERL_NIF_TERM exmagick_frames (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ErlNifBinary utf8;
-  char atom[EXM_MAX_ATOM_SIZE];
-  exm_resource_t *resource;
+  unsigned int k, count;
+  ERL_NIF_TERM item, result;
+  ERL_NIF_TERM *items = NULL;
+  Image *frame;
+  exm_resource_t *resource = NULL;
 
   EXM_INIT;
   ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
+  if (0 == exmagick_get_handle(env, argv[0], type, &resource))
   { EXM_FAIL(ehandler, "invalid handle"); }
 
-  if (0 == enif_get_atom(env, argv[1], atom, EXM_MAX_ATOM_SIZE, ERL_NIF_LATIN1))
-  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
-
-  if (strcmp("adjoin", atom) == 0)
+  EXM_RLOCK(resource);
+  if (resource->image == NULL)
   {
-    if (0 == exmagick_get_boolean_u(env, argv[2], &resource->i_info->adjoin))
-    { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
+    EXM_RUNLOCK(resource);
+    EXM_FAIL(ehandler, "image not loaded");
   }
-  if (strcmp("magick", atom) == 0)
+
+  count = GetImageListLength(resource->image);
+  items = enif_alloc(count * sizeof(ERL_NIF_TERM));
+  if (items == NULL)
   {
-    if (0 == exmagick_get_utf8str(env, argv[2], &utf8))
-    { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
-    exmagick_utf8strcpy(resource->image->magick, &utf8, MaxTextExtent);
+    EXM_RUNLOCK(resource);
+    EXM_FAIL(ehandler, "enif_alloc");
   }
-  if (strcmp("density", atom) == 0)
+
+  for (k = 0, frame = resource->image; frame != NULL && k < count; k += 1, frame = frame->next)
   {
-    if (0 == exmagick_get_utf8str(env, argv[2], &utf8))
-    { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
-    MagickFree(resource->i_info->density);
-    resource->i_info->density=exmagick_utf8strdup(&utf8);
-    if (resource->i_info->density == NULL)
-    { EXM_FAIL(ehandler, "could not set density"); }
+    item = enif_make_new_map(env);
+    enif_make_map_put(env, item, enif_make_atom(env, "width"), enif_make_ulong(env, frame->columns), &item);
+    enif_make_map_put(env, item, enif_make_atom(env, "height"), enif_make_ulong(env, frame->rows), &item);
+    enif_make_map_put(env, item, enif_make_atom(env, "x"), enif_make_long(env, frame->page.x), &item);
+    enif_make_map_put(env, item, enif_make_atom(env, "y"), enif_make_long(env, frame->page.y), &item);
+    enif_make_map_put(env, item, enif_make_atom(env, "delay"), enif_make_ulong(env, frame->delay), &item);
+    enif_make_map_put(env, item, enif_make_atom(env, "iterations"), enif_make_ulong(env, frame->iterations), &item);
+    enif_make_map_put(env, item, enif_make_atom(env, "dispose"),
+                      enif_make_atom(env, exm_disposes[frame->dispose <= PreviousDispose ? frame->dispose : UndefinedDispose]), &item);
+    items[k] = item;
   }
+  EXM_RUNLOCK(resource);
+  exmagick_unpin_handle(resource);
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  result = enif_make_list_from_array(env, items, k);
+  enif_free(items);
+  return(exmagick_make_result(env, NULL, result));
 
 ehandler:
+  exmagick_unpin_handle(resource);
   return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
 }
 
-ERL_NIF_TERM exmagick_get_attr (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+/*
+  Applies the operations of the job to its frames until there is none
+  left. Runs on worker threads (the calling thread being one of them),
+  so it must not touch any erlang term. Each worker has its own image
+  info, as some operations change it.
+ */
+static
+void *exmagick_frames_worker (void *arg)
 {
-  char atom[EXM_MAX_ATOM_SIZE];
-  exm_resource_t *resource;
+  unsigned int k, next;
+  char *errmsg = NULL;
+  exm_resource_t context;
+  exm_frames_job_t *job = (exm_frames_job_t *) arg;
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  GetExceptionInfo(&context.e_info);
+  context.lock   = NULL;
+  context.limits = job->limits;
+  context.i_info = CloneImageInfo(job->i_info);
+  if (context.i_info == NULL)
+  { errmsg = "CloneImageInfo"; }
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+  while (errmsg == NULL)
+  {
+    enif_mutex_lock(job->mutex);
+    next = job->errmsg[0] == '\0' ? job->next : job->count;
+    job->next += 1;
+    enif_mutex_unlock(job->mutex);
 
-  if (0 == enif_get_atom(env, argv[1], atom, EXM_MAX_ATOM_SIZE, ERL_NIF_LATIN1))
-  { EXM_FAIL(ehandler, "invalid attribute"); }
+    if (next >= job->count)
+    { break; }
+
+    context.image = job->frames[next];
+    for (k = 0; errmsg == NULL && k < job->num_ops; k += 1)
+    { errmsg = exmagick_apply_op(&context, &job->ops[k]); }
+    job->frames[next] = context.image;
+  }
 
-  if (strcmp("adjoin", atom) == 0)
+  if (errmsg != NULL)
   {
-    if (resource->i_info->adjoin == 0)
-    { return(enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_atom(env, "false"))); }
-    else if (resource->i_info->adjoin == 1)
-    { return(enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_atom(env, "true"))); }
+    enif_mutex_lock(job->mutex);
+    if (job->errmsg[0] == '\0')
+    {
+      job->severity = context.e_info.severity == UndefinedException ? ImageError : context.e_info.severity;
+      strncpy(job->errmsg, errmsg, MaxTextExtent - 1);
+    }
+    enif_mutex_unlock(job->mutex);
   }
-  if (strcmp("rows", atom) == 0)
+
+  if (context.i_info != NULL)
+  { DestroyImageInfo(context.i_info); }
+  DestroyExceptionInfo(&context.e_info);
+  return(NULL);
+}
+
+/*
+  Links the frames back into a list. Coalesced frames cover the whole
+  canvas, which takes the size of the transformed frames.
+ */
+static
+Image *exmagick_frames_link (Image **frames, unsigned int count)
+{
+  unsigned int k;
+
+  for (k = 0; k < count; k += 1)
   {
-    if (resource->image == NULL)
-    { EXM_FAIL(ehandler, "image not loaded"); }
+    frames[k]->page.width  = frames[k]->columns;
+    frames[k]->page.height = frames[k]->rows;
+    frames[k]->page.x      = 0;
+    frames[k]->page.y      = 0;
+    frames[k]->previous    = k > 0 ? frames[k - 1] : NULL;
+    frames[k]->next        = k + 1 < count ? frames[k + 1] : NULL;
+  }
+  return(count > 0 ? frames[0] : NULL);
+}
+
+/*
+  Transforms every frame of an animation: the frames are coalesced
+  into full images, unlinked so that each operation sees a single
+  frame, transformed by up to `concurrency` threads and linked back.
+  When `optimize` is set the result is deconstructed into the regions
+  that change from one frame to the next, each frame being left in
+  place for the next one to be drawn over.
+ */
+static
+char *exmagick_op_animate (exm_resource_t *resource, const exm_op_t *ops, unsigned int num_ops, int optimize, unsigned int concurrency)
+{
+  unsigned int k, num_threads;
+  char *errmsg = NULL;
+  ErlNifTid *threads = NULL;
+  Image *coalesced, *image, *optimized;
+  exm_frames_job_t job;
 
-    { return(enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_long(env, resource->image->rows))); }
+  if (resource->image == NULL)
+  { return("image not loaded"); }
+
+  memset(&job, 0, sizeof(job));
+  coalesced = CoalesceImages(resource->image, &resource->e_info);
+  if (coalesced == NULL)
+  { return(exmagick_exception_reason(&resource->e_info)); }
+
+  job.count   = GetImageListLength(coalesced);
+  job.frames  = enif_alloc(job.count * sizeof(Image *));
+  job.ops     = ops;
+  job.num_ops = num_ops;
+  job.i_info  = resource->i_info;
+  exmagick_copy_limits(&job.limits, resource);
+  job.mutex   = enif_mutex_create("exmagick.frames");
+  num_threads = concurrency < job.count ? concurrency : job.count;
+  threads     = enif_alloc((num_threads + 1) * sizeof(ErlNifTid));
+  if (job.frames == NULL || job.mutex == NULL || threads == NULL)
+  {
+    if (job.frames != NULL)
+    { enif_free(job.frames); }
+    DestroyImageList(coalesced);
+    EXM_FAIL(done, "could not allocate workers");
   }
-  if (strcmp("columns", atom) == 0)
+
+  for (k = 0, image = coalesced; k < job.count; k += 1)
   {
-    if (resource->image == NULL)
-    { EXM_FAIL(ehandler, "image not loaded"); }
+    job.frames[k]   = image;
+    image           = image->next;
+    job.frames[k]->previous = NULL;
+    job.frames[k]->next     = NULL;
+  }
+
+  /* the calling thread is one of the workers */
+  for (k = 0; k + 1 < num_threads; k += 1)
+  {
+    if (0 != enif_thread_create("exmagick.frames", &threads[k], exmagick_frames_worker, &job, NULL))
+    { break; }
+  }
+  num_threads = k;
+  exmagick_frames_worker(&job);
+  for (k = 0; k < num_threads; k += 1)
+  { enif_thread_join(threads[k], NULL); }
 
-    { return(enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_long(env, resource->image->columns))); }
+  image = exmagick_frames_link(job.frames, job.count);
+  enif_free(job.frames);
+  if (job.errmsg[0] != '\0')
+  {
+    /* the message of the worker dies with its context */
+    DestroyImageList(image);
+    ThrowException(&resource->e_info, job.severity, job.errmsg, NULL);
+    EXM_FAIL(done, exmagick_exception_reason(&resource->e_info));
   }
-  if (strcmp("density", atom) == 0)
-  { return(enif_make_tuple2(env, enif_make_atom(env, "ok"), exmagick_make_utf8str(env, resource->i_info->density))); }
-  else if (strcmp("magick", atom) == 0)
-  { return(enif_make_tuple2(env, enif_make_atom(env, "ok"), exmagick_make_utf8str(env, resource->image->magick))); }
 
-ehandler:
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+  if (optimize && image->next != NULL)
+  {
+    optimized = DeconstructImages(image, &resource->e_info);
+    DestroyImageList(image);
+    if (optimized == NULL)
+    { EXM_FAIL(done, exmagick_exception_reason(&resource->e_info)); }
+
+    for (image = optimized; image != NULL; image = image->next)
+    { image->dispose = NoneDispose; }
+    image = optimized;
+  }
+
+  errmsg = exmagick_op_swap_image(resource, image);
+
+done:
+  if (threads != NULL)
+  { enif_free(threads); }
+  if (job.mutex != NULL)
+  { enif_mutex_destroy(job.mutex); }
+  return(errmsg);
 }
 
+/*
+  Decodes `term`, applies the operations of `spec` and encodes the
+  result, on behalf of `exmagick_batch_convert`. The context is reused
+  by every blob of the batch, so its image is always released and its
+  exception reset.
+ */
 static
-ERL_NIF_TERM exmagick_image_load_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+char *exmagick_convert_blob (ErlNifEnv *env, exm_resource_t *context, const exm_rendition_t *spec, ERL_NIF_TERM term, ERL_NIF_TERM *blob_term)
 {
+  unsigned int k;
+  size_t size = 0;
+  void *data = NULL;
+  char *errmsg = NULL;
   ErlNifBinary blob;
-  exm_resource_t *resource;
+  ErlNifTime start;
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  DestroyExceptionInfo(&context->e_info);
+  GetExceptionInfo(&context->e_info);
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+  if (0 == enif_inspect_binary(env, term, &blob))
+  { return("bad argument"); }
 
-  if (0 == enif_inspect_binary(env, argv[1], &blob))
-  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+  start = enif_monotonic_time(ERL_NIF_USEC);
+  if (exmagick_has_limits(&context->limits))
+  { errmsg = exmagick_check_ping(context, PingBlob(context->i_info, blob.data, blob.size, &context->e_info)); }
+  if (errmsg == NULL && NULL == (context->image = BlobToImage(context->i_info, blob.data, blob.size, &context->e_info)))
+  { errmsg = exmagick_load_limit_reason(context, &blob, exmagick_exception_reason(&context->e_info)); }
+  exmagick_stat(EXM_STAT_LOAD, start, errmsg, context->image, blob.size, 0);
 
-  if (resource->image != NULL)
+  for (k = 0; errmsg == NULL && k < spec->num_ops; k += 1)
+  { errmsg = exmagick_apply_op(context, &spec->ops[k]); }
+
+  if (errmsg == NULL)
   {
-    DestroyImage(resource->image);
-    resource->image = NULL;
+    start = enif_monotonic_time(ERL_NIF_USEC);
+    data  = ImageToBlob(context->i_info, context->image, &size, &context->e_info);
+    if (data == NULL)
+    { errmsg = exmagick_exception_reason(&context->e_info); }
+    exmagick_stat(EXM_STAT_DUMP, start, errmsg, NULL, 0, size);
   }
 
-  resource->image = BlobToImage(resource->i_info, blob.data, blob.size, &resource->e_info);
-  if (resource->image == NULL)
+  if (context->image != NULL)
+  { DestroyImageList(context->image); }
+  context->image = NULL;
+
+  if (errmsg == NULL)
+  { errmsg = exmagick_make_blob(env, data, size, blob_term); }
+  return(errmsg);
+}
+
+/*
+  Converts every blob of `argv[0]` according to the `{Operations, Type}`
+  spec of `argv[1]` (refer to `exmagick_compile_rendition`), without a
+  handle per blob: the whole batch shares a single image info,
+  exception and the limits of `argv[2]` (refer to `exmagick_limit`),
+  which every blob is pinged against before it is decoded. The result
+  is a list with `{ok, Blob}` or `{error, Reason}` for each blob, in
+  the same order.
+ */
+static
+ERL_NIF_TERM exmagick_batch_convert (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  unsigned int k, count;
+  ERL_NIF_TERM head, tail, result, item = 0;
+  ERL_NIF_TERM *items = NULL;
+  exm_rendition_t spec;
+  exm_resource_t context;
+
+  EXM_INIT;
+
+  memset(&spec, 0, sizeof(spec));
+  memset(&context, 0, sizeof(context));
+  GetExceptionInfo(&context.e_info);
+
+  if (0 == enif_get_list_length(env, argv[0], &count))
+  { EXM_FAIL(ehandler, "argv[0]: bad argument"); }
+
+  if (NULL != (errmsg = exmagick_compile_rendition(env, argv[1], &spec)))
+  { goto ehandler; }
+
+  if (NULL != (errmsg = exmagick_read_limits(env, argv[2], &context.limits)))
+  { goto ehandler; }
+
+  items = enif_alloc((count + 1) * sizeof(ERL_NIF_TERM));
+  context.i_info = CloneImageInfo(0);
+  if (items == NULL || context.i_info == NULL)
+  { EXM_FAIL(ehandler, "could not allocate the batch"); }
+
+  tail = argv[0];
+  for (k = 0; enif_get_list_cell(env, tail, &head, &tail); k += 1)
   {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
+    errmsg   = exmagick_convert_blob(env, &context, &spec, head, &item);
+    items[k] = exmagick_make_result(env, errmsg, item);
   }
+  result = enif_make_list_from_array(env, items, count);
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  enif_free(items);
+  enif_free(spec.ops);
+  DestroyImageInfo(context.i_info);
+  DestroyExceptionInfo(&context.e_info);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
 
 ehandler:
+  if (items != NULL)
+  { enif_free(items); }
+  if (spec.ops != NULL)
+  { enif_free(spec.ops); }
+  if (context.i_info != NULL)
+  { DestroyImageInfo(context.i_info); }
+  DestroyExceptionInfo(&context.e_info);
   return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
 }
 
+/*
+  Sends a chunk once the consumer granted a credit for it, giving up
+  when the stream gets cancelled or the deadline of the handle passes.
+  There is no timed wait on a condition variable, so a stream with a
+  deadline checks it every `EXM_STREAM_POLL` milliseconds instead.
+ */
 static
-ERL_NIF_TERM exmagick_image_load_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+void exmagick_stream_send (exm_stream_t *stream, ErlNifEnv *msg_env, ERL_NIF_TERM msg)
 {
-  ErlNifBinary utf8;
-  exm_resource_t *resource;
+  ErlNifTime left, deadline;
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  enif_mutex_lock(stream->mutex);
+  while (stream->credits == 0 && 0 == stream->cancelled && 0 == stream->expired)
+  {
+    if (0 == exmagick_get_deadline(stream->resource, &deadline))
+    {
+      enif_cond_wait(stream->cond, stream->mutex);
+      continue;
+    }
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+    left = deadline - enif_monotonic_time(ERL_NIF_MSEC);
+    if (left <= 0)
+    { stream->expired = 1; }
+    else
+    {
+      enif_mutex_unlock(stream->mutex);
+      (void) poll(NULL, 0, left < EXM_STREAM_POLL ? (int) left : EXM_STREAM_POLL);
+      enif_mutex_lock(stream->mutex);
+    }
+  }
+  if (stream->cancelled || stream->expired)
+  { stream->failed = 1; }
+  else
+  { stream->credits -= 1; }
+  enif_mutex_unlock(stream->mutex);
 
-  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
-  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+  msg = enif_make_tuple2(msg_env, enif_make_copy(msg_env, stream->ref), msg);
+  if (0 == stream->failed && 0 == enif_send(NULL, &stream->pid, msg_env, msg))
+  { stream->failed = 1; }
+  enif_clear_env(msg_env);
+}
 
-  exmagick_utf8strcpy(resource->i_info->filename, &utf8, MaxTextExtent);
-  if (resource->image != NULL)
+/*
+  Forwards the encoded image to the process in chunks of (at most)
+  `chunk_size` bytes. The pipe is always drained until the encoder
+  closes it, even after a failure, so that the encoder never blocks.
+ */
+static
+void *exmagick_stream_reader (void *arg)
+{
+  ssize_t nread;
+  size_t filled = 0;
+  int have_chunk = 0;
+  ErlNifBinary chunk;
+  ErlNifEnv *msg_env;
+  char sink[4096];
+  exm_stream_t *stream = (exm_stream_t *) arg;
+
+  msg_env = enif_alloc_env();
+  if (msg_env == NULL || 0 == enif_alloc_binary(stream->chunk_size, &chunk))
+  { stream->failed = 1; }
+  else
+  { have_chunk = 1; }
+
+  for (;;)
   {
-    DestroyImage(resource->image);
-    resource->image = NULL;
+    if (stream->failed)
+    { nread = read(stream->fd, sink, sizeof(sink)); }
+    else
+    { nread = read(stream->fd, chunk.data + filled, stream->chunk_size - filled); }
+
+    if (nread < 0 && errno == EINTR)
+    { continue; }
+    if (nread <= 0)
+    { break; }
+    stream->bytes += nread;
+    if (stream->failed)
+    { continue; }
+
+    filled += nread;
+    if (filled == stream->chunk_size)
+    {
+      exmagick_stream_send(stream, msg_env, enif_make_tuple2(msg_env, enif_make_atom(msg_env, "data"), enif_make_binary(msg_env, &chunk)));
+      have_chunk = 0;
+      filled = 0;
+      if (!stream->failed)
+      {
+        if (enif_alloc_binary(stream->chunk_size, &chunk))
+        { have_chunk = 1; }
+        else
+        { stream->failed = 1; }
+      }
+    }
   }
 
-  resource->image = ReadImage(resource->i_info, &resource->e_info);
-  if (resource->image == NULL)
+  if (nread < 0)
+  { stream->failed = 1; }
+
+  if (!stream->failed && filled > 0)
   {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
+    if (enif_realloc_binary(&chunk, filled))
+    {
+      exmagick_stream_send(stream, msg_env, enif_make_tuple2(msg_env, enif_make_atom(msg_env, "data"), enif_make_binary(msg_env, &chunk)));
+      have_chunk = 0;
+    }
+    else
+    { stream->failed = 1; }
   }
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
-
-ehandler:
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+  if (have_chunk)
+  { enif_release_binary(&chunk); }
+  if (msg_env != NULL)
+  { enif_free_env(msg_env); }
+  return(NULL);
 }
 
+/*
+  Tells whether the encoder of `magick` seeks back into what it already
+  wrote: the coders that say so, and PDF, whose cross references hold
+  the offsets of its objects.
+ */
 static
-ERL_NIF_TERM exmagick_image_dump_file (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+int exmagick_needs_seek (const char *magick, ExceptionInfo *e_info)
 {
-  char filename[MaxTextExtent];
-  ErlNifBinary utf8;
-  exm_resource_t *resource;
+  const MagickInfo *magick_info = GetMagickInfo(magick, e_info);
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  if (magick_info != NULL && magick_info->seekable_stream)
+  { return(1); }
+  return(0 == strcmp(magick, "PDF") || 0 == strcmp(magick, "EPDF"));
+}
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+/*
+  Writes the encoded image into `fp`. The image type is forced through
+  the filename prefix, otherwise the type implied by the filename the
+  image was read from would take precedence over the `magick` attr.
+  Formats that seek back are encoded into memory first when `fp` can
+  not seek (ex.: a pipe), refer to `exmagick_needs_seek`. The caller
+  counts the call, only it knows how many bytes got through `fp`.
+ */
+static
+char *exmagick_op_dump_fp (exm_resource_t *resource, FILE *fp)
+{
+  void *data;
+  size_t size = 0;
+  char filename[MaxTextExtent];
+  unsigned int status;
+  char *errmsg = NULL;
 
-  if (0 == exmagick_get_utf8str(env, argv[1], &utf8))
-  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+  if (resource->image == NULL)
+  { return("image not loaded"); }
 
-  exmagick_utf8strcpy (filename, &utf8, MaxTextExtent);
-  if (0 == WriteImages(resource->i_info, resource->image, filename, &resource->e_info))
+  if (0 != fseek(fp, 0, SEEK_CUR) && exmagick_needs_seek(resource->image->magick, &resource->e_info))
   {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
+    if (NULL == (data = ImageToBlob(resource->i_info, resource->image, &size, &resource->e_info)))
+    { errmsg = exmagick_exception_reason(&resource->e_info); }
+    else if (size != fwrite(data, 1, size, fp))
+    { errmsg = "could not write the encoded image"; }
+
+    if (data != NULL)
+    { MagickFree(data); }
+    return(errmsg);
   }
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  memcpy(filename, resource->image->filename, MaxTextExtent);
+  sprintf(resource->image->filename, "%.64s:", resource->image->magick);
+  status = WriteImagesFile(resource->i_info, resource->image, fp, &resource->e_info);
+  memcpy(resource->image->filename, filename, MaxTextExtent);
 
-ehandler:
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+  if (0 == status)
+  { errmsg = exmagick_exception_reason(&resource->e_info); }
+  return(errmsg);
 }
 
+/*
+  Creates the stream `image_dump_stream/4` sends its chunks through to
+  the calling process, which may receive `argv[0]` chunks before
+  acknowledging any.
+ */
 static
-ERL_NIF_TERM exmagick_image_dump_blob (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ERL_NIF_TERM exmagick_stream_open (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  void *blob_image = NULL;
-  size_t size;
-  exm_resource_t *resource;
-  ERL_NIF_TERM blob_term;
-  unsigned char *blob_raw;
+  ERL_NIF_TERM result;
+  unsigned long window;
+  exm_stream_t *stream;
 
   EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
+  if (0 == enif_get_ulong(env, argv[0], &window) || window == 0)
+  { EXM_FAIL(ehandler, "window: bad argument"); }
 
-  blob_image = ImageToBlob(resource->i_info, resource->image, &size, &resource->e_info);
-  if (NULL == blob_image)
+  stream = enif_alloc_resource(exm_stream_type, sizeof(exm_stream_t));
+  if (stream == NULL)
+  { EXM_FAIL(ehandler, "enif_alloc_resource"); }
+  memset(stream, 0, sizeof(exm_stream_t));
+
+  stream->credits = window;
+  stream->mutex   = enif_mutex_create("exmagick.stream");
+  stream->cond    = enif_cond_create("exmagick.stream");
+  if (stream->mutex == NULL || stream->cond == NULL || NULL == enif_self(env, &stream->pid)
+      || 0 != enif_monitor_process(env, stream, &stream->pid, &stream->monitor))
   {
-    CatchException(&resource->e_info);
-    EXM_FAIL(ehandler, resource->e_info.reason);
+    enif_release_resource(stream);
+    EXM_FAIL(ehandler, "enif_monitor_process");
   }
 
-  blob_raw = enif_make_new_binary(env, size, &blob_term);
-  if (NULL == blob_raw)
-  { EXM_FAIL(ehandler, "enif_make_new_binary error"); }
-
-  memcpy(blob_raw, blob_image, size);
-  MagickFree(blob_image);
+  result = enif_make_resource(env, stream);
+  enif_release_resource(stream);
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), result));
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), blob_term));
 ehandler:
-  if (NULL != blob_image)
-  { MagickFree(blob_image); }
-  return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
+  return(exmagick_make_error(env, errmsg));
 }
 
+/*
+  Grants `argv[1]` more chunks to the stream.
+ */
 static
-ERL_NIF_TERM exmagick_convert (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ERL_NIF_TERM exmagick_stream_ack (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ErlNifBinary utf8;
-  char atom[EXM_MAX_ATOM_SIZE];
-  exm_resource_t *resource;
+  unsigned long credits;
+  exm_stream_t *stream;
 
-  EXM_INIT;
-  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
+  if (0 == enif_get_resource(env, argv[0], exm_stream_type, (void **) &stream)
+      || 0 == enif_get_ulong(env, argv[1], &credits))
+  { return(enif_make_badarg(env)); }
 
-  if (0 == enif_get_resource(env, argv[0], type, (void **) &resource))
-  { EXM_FAIL(ehandler, "invalid handle"); }
-  if (0 == enif_get_atom(env, argv[1], atom, EXM_MAX_ATOM_SIZE, ERL_NIF_LATIN1))
-  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
+  enif_mutex_lock(stream->mutex);
+  stream->credits += credits;
+  enif_cond_broadcast(stream->cond);
+  enif_mutex_unlock(stream->mutex);
+  return(enif_make_atom(env, "ok"));
+}
 
-  if (strcmp("black_threshold_image", atom) == 0)
-  {
-    char str_value[MaxTextExtent];
+/*
+  Stops sending chunks, the encoder still runs to its end.
+ */
+static
+ERL_NIF_TERM exmagick_stream_cancel (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  exm_stream_t *stream;
+
+  if (0 == enif_get_resource(env, argv[0], exm_stream_type, (void **) &stream))
+  { return(enif_make_badarg(env)); }
 
-    if (0 == exmagick_get_utf8str(env, argv[2], &utf8))
-    { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
+  enif_mutex_lock(stream->mutex);
+  stream->cancelled = 1;
+  enif_cond_broadcast(stream->cond);
+  enif_mutex_unlock(stream->mutex);
+  return(enif_make_atom(env, "ok"));
+}
+
+/*
+  Encodes the image into the stream, refer to `exm_stream_t`. Runs on
+  a pool thread with the write lock of the handle held, all messages
+  have been sent once it returns.
+ */
+static
+char *exmagick_run_stream (exm_resource_t *resource, exm_stream_t *stream)
+{
+  int fds[2];
+  FILE *fp;
+  char *errmsg;
+  ErlNifTid reader;
+  ErlNifTime start;
 
-    exmagick_utf8strcpy(str_value, &utf8, MaxTextExtent);
+  if (0 != pipe(fds))
+  { return("pipe"); }
 
-    if (0 == BlackThresholdImage(resource->image, &str_value))
-    { EXM_FAIL(ehandler, "failed to apply BlackThresholdImage"); }
+  if (NULL == (fp = fdopen(fds[1], "wb")))
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return("fdopen");
   }
 
-  if (strcmp("threshold_image", atom) == 0)
+  stream->fd       = fds[0];
+  stream->resource = resource;
+  if (0 != enif_thread_create("exmagick.stream", &reader, exmagick_stream_reader, stream, NULL))
   {
-    double dbl_value;
+    fclose(fp);
+    close(fds[0]);
+    return("enif_thread_create");
+  }
 
-    if (0 == exmagick_get_double(env, argv[2], &dbl_value))
-    { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
+  start  = enif_monotonic_time(ERL_NIF_USEC);
+  errmsg = exmagick_op_dump_fp(resource, fp);
+  fclose(fp);
+  enif_thread_join(reader, NULL);
+  enif_clear_env(stream->env);
+  close(fds[0]);
+  exmagick_stat(EXM_STAT_DUMP, start, errmsg, NULL, 0, stream->bytes);
 
-    if (0 == ThresholdImage(resource->image, dbl_value))
-    { EXM_FAIL(ehandler, "failed to apply ThresholdImage"); }
-  }
+  if (errmsg == NULL && stream->expired)
+  { errmsg = EXM_ABORT_PREFIX "timeout"; }
+  else if (errmsg == NULL && stream->failed && 0 == stream->cancelled)
+  { errmsg = "could not send the encoded image"; }
+  return(errmsg);
+}
 
-  if (strcmp("white_threshold_image", atom) == 0)
-  {
-    char str_value[MaxTextExtent];
- 
-    if (0 == exmagick_get_utf8str(env, argv[2], &utf8))
-    { EXM_FAIL(ehandler, "argv[2]: bad argument"); }
+/*
+  Queues the encoding of the image into the stream `argv[1]` (refer to
+  `exmagick_stream_open`) to the pool, so that waiting for the consumer
+  never holds a scheduler, and returns a reference right away. Chunks
+  are sent as `{Ref, {data, Chunk}}` messages where `Ref` is `argv[2]`,
+  then the result is sent to the caller as `{Job, Result}`, refer to
+  `exmagick_pipeline_async`.
+ */
+static
+ERL_NIF_TERM exmagick_image_dump_stream (ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ERL_NIF_TERM ref;
+  unsigned long chunk_size;
+  exm_stream_t *stream;
+  exm_job_t *job = NULL;
+
+  EXM_INIT;
+  ErlNifResourceType *type = (ErlNifResourceType *) enif_priv_data(env);
 
-    exmagick_utf8strcpy(str_value, &utf8, MaxTextExtent);
+  if (0 == enif_get_resource(env, argv[1], exm_stream_type, (void **) &stream) || stream->env != NULL)
+  { EXM_FAIL(ehandler, "argv[1]: bad argument"); }
 
-    if (0 == WhiteThresholdImage(resource->image, &str_value))
-    { EXM_FAIL(ehandler, "failed to apply WhiteThresholdImage"); }
-  }
+  if (0 == enif_get_ulong(env, argv[3], &chunk_size) || chunk_size == 0)
+  { EXM_FAIL(ehandler, "argv[3]: bad argument"); }
 
-  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), argv[0]));
+  if (NULL != (errmsg = exmagick_alloc_job(env, type, argv[0], &job)))
+  { goto ehandler; }
+
+  /* the reader thread may only use terms of its own environment; the
+   * environment is never freed so that a stream is used only once */
+  stream->chunk_size = chunk_size;
+  stream->env        = enif_alloc_env();
+  if (stream->env == NULL)
+  { EXM_FAIL(ehandler, "enif_alloc_env"); }
+  stream->ref    = enif_make_copy(stream->env, argv[2]);
+  stream->failed = 0;
+  stream->bytes  = 0;
+
+  ref         = enif_make_resource(env, job);
+  job->stream = stream;
+  enif_keep_resource(stream);
+  if (NULL != (errmsg = exmagick_pool_submit(job)))
+  { goto ehandler; }
+
+  return(enif_make_tuple2(env, enif_make_atom(env, "ok"), ref));
 
 ehandler:
+  if (job != NULL)
+  { enif_release_resource(job); }
   return(enif_make_tuple2(env, enif_make_atom(env, "error"), exmagick_make_utf8str(env, errmsg)));
 }
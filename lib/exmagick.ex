@@ -67,23 +67,172 @@ defmodule ExMagick do
   """
   @opaque handle :: binary
 
-  @type exm_error :: {:error, String.t()}
+  @typedoc """
+  An error. GraphicsMagick resource limits (refer to
+  `set_resource_limits/1`) and the limits of the handle (refer to
+  `limit/2`) are reported as `{:resource_limit, kind}`, where `kind`
+  is one of the limits. Operations aborted past their deadline (refer
+  to `deadline/2`) or because their caller went down are reported as
+  `:timeout` and `:cancelled`.
+  """
+  @type exm_error :: {:error, String.t() | {:resource_limit, atom} | :timeout | :cancelled}
+
+  # the result of the natives `measure/4` reports on, with the size of
+  # the image afterwards
+  @typep measured(value) :: {:ok, value, non_neg_integer, non_neg_integer} | exm_error
+
+  @typedoc """
+  The image metadata returned by `ping/2`
+  """
+  @type ping_info :: %{
+          width: non_neg_integer,
+          height: non_neg_integer,
+          magick: String.t(),
+          pages: pos_integer,
+          density: {float, float}
+        }
+
+  @typedoc """
+  The value of an attribute, refer to `attr/3`
+  """
+  @type attr_value :: String.t() | boolean | non_neg_integer | atom | Enumerable.t()
+
+  @typedoc """
+  What `image_load/2` loads, refer to it
+  """
+  @type load_source :: Path.t() | {:blob, binary} | {:mmap, Path.t()}
+
+  @typedoc """
+  An option of `image_load/3`
+  """
+  @type load_option ::
+          {:max_size, {pos_integer, pos_integer}}
+          | {:pages, Range.t()}
+          | {:region, {non_neg_integer, non_neg_integer, pos_integer, pos_integer}}
+
+  @typedoc """
+  An option of `resize/4`
+  """
+  @type resize_option :: {:filter, :lanczos3 | :bilinear | :box} | {:engine, :magick | :fast}
+
+  @typedoc """
+  An option of `pixels/2` and `from_pixels/4`
+  """
+  @type pixel_option ::
+          {:map, :rgb | :rgba | :gray}
+          | {:depth, 8 | 16}
+          | {:region, {non_neg_integer, non_neg_integer, pos_integer, pos_integer}}
+
+  @typedoc """
+  What `fingerprint/2` computes, refer to it
+  """
+  @type fingerprint_kind :: :ahash | :dhash | :phash | :histogram | :stats
+
+  @typedoc """
+  An option of `tiles/3`
+  """
+  @type tiles_option ::
+          {:tile_size, pos_integer}
+          | {:overlap, non_neg_integer}
+          | {:format, String.t()}
+          | {:source, Path.t()}
+          | {:size, {pos_integer, pos_integer}}
+
+  @typedoc """
+  An option of `animate/3`
+  """
+  @type animate_option :: {:optimize, boolean} | {:max_concurrency, pos_integer}
+
+  @typedoc """
+  An option of `batch_convert/4`
+  """
+  @type batch_option :: {:chunk_size, pos_integer} | {:limits, keyword(pos_integer)}
+
+  @typedoc """
+  A frame of an animation, refer to `frames/1`
+  """
+  @type frame_info :: %{
+          width: non_neg_integer,
+          height: non_neg_integer,
+          x: integer,
+          y: integer,
+          delay: non_neg_integer,
+          iterations: non_neg_integer,
+          dispose: :undefined | :none | :background | :previous
+        }
+
+  @typedoc """
+  An option of `composite/5`
+  """
+  @type composite_option ::
+          {:operator,
+           :over | :in | :out | :atop | :xor | :plus | :minus | :add | :subtract | :difference
+           | :multiply | :copy}
+
+  @typedoc """
+  An option of `montage/2`
+  """
+  @type montage_option ::
+          {:columns, pos_integer} | {:spacing, non_neg_integer} | {:background, String.t()}
+
+  @typedoc """
+  The counters of an operation returned by `stats/0`
+  """
+  @type op_stats :: %{
+          calls: non_neg_integer,
+          errors: non_neg_integer,
+          usecs: non_neg_integer,
+          max_usecs: non_neg_integer,
+          pixels: non_neg_integer,
+          bytes_in: non_neg_integer,
+          bytes_out: non_neg_integer
+        }
 
   @on_load {:load, 0}
 
+  # the resources of `set_resource_limits/1`
+  @resource_types [:memory, :map, :disk, :files, :pixels, :width, :height, :threads]
+
   @doc false
   @spec load :: :ok | {:error, {atom, charlist}}
   def load do
-    [:code.priv_dir(:exmagick), "lib/libexmagick"]
-    |> Path.join()
-    |> String.to_charlist()
-    |> :erlang.load_nif(0)
+    # a library failing to load does not tell why, so the configured
+    # limits are checked beforehand
+    case check_resource_limits(Application.get_env(:exmagick, :resource_limits, [])) do
+      :ok ->
+        [:code.priv_dir(:exmagick), "lib/libexmagick"]
+        |> Path.join()
+        |> String.to_charlist()
+        |> :erlang.load_nif(async_pool())
+
+      {:error, reason} ->
+        {:error, {:bad_config, String.to_charlist(reason)}}
+    end
+  end
+
+  defp check_resource_limits(limits) when is_list(limits) do
+    Enum.find_value(limits, :ok, fn
+      {name, value} when name in @resource_types and is_integer(value) and value >= 0 -> nil
+      limit -> {:error, "resource_limits: bad limit #{inspect(limit)}"}
+    end)
+  end
+
+  defp check_resource_limits(limits),
+    do: {:error, "resource_limits: not a keyword list #{inspect(limits)}"}
+
+  defp async_pool do
+    threads = Application.get_env(:exmagick, :async_threads, System.schedulers_online())
+
+    {threads, Application.get_env(:exmagick, :async_queue, 64 * threads),
+     Application.get_env(:exmagick, :resource_limits, []),
+     Application.get_env(:exmagick, :cache_size, 0),
+     Application.get_env(:exmagick, :handle_pool, 64)}
   end
 
   @doc """
   Refer to `attr/3`
   """
-  @spec attr!(handle, :atom, String.t() | boolean) :: handle
+  @spec attr!(handle, :atom, attr_value) :: handle
   def attr!(handle, attribute, value) do
     {:ok, handle} = attr(handle, attribute, value)
     handle
@@ -97,28 +246,49 @@ defmodule ExMagick do
   for each frame;
   * `:magick` - the image type [ex.: PNG]
   * `:density` - horizontal and vertical resolution in pixels of this image; [default: 72]
+
+  The following `attribute`s tune the encoder, trading output size for
+  encoding time, and apply to `image_dump/1` and `image_dump/2`:
+  * `:quality` - `0..100`, the JPEG quality or, for PNG, the zlib level
+  (tens) and the filter (units) [ex.: `10` encodes fast, `95` small];
+  * `:interlace` - `:none`, `:line`, `:plane` or `:partition`. `:line`
+  produces progressive JPEGs and interlaced PNGs;
+  * `:sampling_factor` - the JPEG chroma subsampling [ex.: `"2x2,1x1,1x1"`];
+  * `:define` - coder specific definitions, either a `"key=value,..."`
+  string or a keyword/map [ex.: `%{"jpeg:dct-method" => "fast"}`]. They
+  are added to the definitions set earlier and can not be queried.
+
+  Profiles (EXIF, ICC, ...) are removed with `convert(handle, :strip, true)`.
   """
-  @spec attr(handle, :atom, String.t() | boolean) :: {:ok, handle} | exm_error
+  @spec attr(handle, :atom, attr_value) :: {:ok, handle} | exm_error
   def attr(handle, attribute, value) when is_atom(attribute) do
-    case attribute do
-      :adjoin when is_boolean(value) ->
-        set_attr(handle, attribute, value)
+    case compile_attr(attribute, value) do
+      {:ok, value} -> set_attr(handle, attribute, value)
+      :error -> {:error, "unknown attribute #{attribute}"}
+    end
+  end
 
-      :density when is_binary(value) ->
-        set_attr(handle, attribute, value)
+  defp compile_attr(:adjoin, value) when is_boolean(value), do: {:ok, value}
+  defp compile_attr(:density, value) when is_binary(value), do: {:ok, value}
+  defp compile_attr(:magick, value) when is_binary(value), do: {:ok, value}
+  defp compile_attr(:quality, value) when value in 0..100, do: {:ok, value}
 
-      :magick when is_binary(value) ->
-        set_attr(handle, attribute, value)
+  defp compile_attr(:interlace, value) when value in [:none, :line, :plane, :partition],
+    do: {:ok, value}
 
-      _ ->
-        {:error, "unknown attribute #{attribute}"}
-    end
+  defp compile_attr(:sampling_factor, value) when is_binary(value), do: {:ok, value}
+  defp compile_attr(:define, value) when is_binary(value), do: {:ok, value}
+
+  defp compile_attr(:define, value) when is_list(value) or is_map(value) do
+    {:ok, Enum.map_join(value, ",", fn {key, val} -> "#{key}=#{val}" end)}
   end
 
+  defp compile_attr(_attribute, _value), do: :error
+
   @doc """
   Refer to `attr/2`
   """
-  @spec attr!(handle, atom) :: String.t() | boolean | non_neg_integer
+  @spec attr!(handle, atom) :: attr_value
   def attr!(handle, attribute) do
     {:ok, handle} = attr(handle, attribute)
     handle
@@ -132,7 +302,7 @@ defmodule ExMagick do
   * `:rows` The horizontal size in pixels of the image
   * `:columns` The vertical size in pixels of the image
   """
-  @spec attr(handle, atom) :: {:ok, String.t() | boolean | non_neg_integer} | exm_error
+  @spec attr(handle, atom) :: {:ok, attr_value} | exm_error
   def attr(handle, attribute), do: get_attr(handle, attribute)
 
   @doc """
@@ -150,6 +320,23 @@ defmodule ExMagick do
     pages
   end
 
+  @doc """
+  Refer to `page/2`
+  """
+  @spec page!(handle, non_neg_integer) :: handle
+  def page!(handle, index) do
+    {:ok, page} = page(handle, index)
+    page
+  end
+
+  @doc """
+  Creates a new handle holding only the page `index` (zero-based) of
+  the image. The other pages are neither copied nor kept alive by the
+  new handle.
+  """
+  @spec page(handle, non_neg_integer) :: {:ok, handle} | exm_error
+  def page(_handle, _index), do: fail()
+
   @doc """
   Refer to `size/1`.
   """
@@ -183,7 +370,8 @@ defmodule ExMagick do
   Resizes the image.
   """
   @spec size(handle, non_neg_integer, non_neg_integer) :: {:ok, handle} | exm_error
-  def size(_handle, _width, _height), do: fail()
+  def size(handle, width, height),
+    do: measure(:size, handle, nil, fn -> image_size(handle, width, height) end)
 
   @doc """
   Refer to `crop/5`.
@@ -202,7 +390,8 @@ defmodule ExMagick do
   """
   @spec crop(handle, non_neg_integer, non_neg_integer, non_neg_integer, non_neg_integer) ::
           {:ok, handle} | exm_error
-  def crop(_handle, _x, _y, _width, _height), do: fail()
+  def crop(handle, x, y, width, height),
+    do: measure(:crop, handle, nil, fn -> image_crop(handle, x, y, width, height) end)
 
   @spec thumb!(handle, non_neg_integer, non_neg_integer) :: handle
   def thumb!(handle, width, height) do
@@ -217,7 +406,42 @@ defmodule ExMagick do
   concern for speed than resulting image quality._
   """
   @spec thumb(handle, non_neg_integer, non_neg_integer) :: {:ok, handle} | exm_error
-  def thumb(_handle, _width, _height), do: fail()
+  def thumb(handle, width, height),
+    do: measure(:thumb, handle, nil, fn -> image_thumb(handle, width, height) end)
+
+  @doc """
+  Refer to `resize/4`
+  """
+  @spec resize!(handle, pos_integer, pos_integer, [resize_option]) :: handle
+  def resize!(handle, width, height, options \\ []) do
+    {:ok, handle} = resize(handle, width, height, options)
+    handle
+  end
+
+  @doc """
+  Resizes the image to exactly `width` x `height` using a resampling
+  filter.
+
+  The following `options` are available:
+
+  * `:filter` - `:lanczos3` (default), `:bilinear` or `:box`;
+  * `:engine` - `:magick` (default) resizes using GraphicsMagick.
+  `:fast` uses a separable resampler working on packed 8-bit pixels
+  (vectorized where SSE2 is available), which is several times faster
+  for the common case of 8-bit RGB images (ex.: JPEG thumbnails).
+  Images it does not handle (more than 8 bits per channel, more than
+  one page, colorspaces other than RGB or gray) are resized by
+  GraphicsMagick instead.
+  """
+  @spec resize(handle, pos_integer, pos_integer, [resize_option]) :: {:ok, handle} | exm_error
+  def resize(handle, width, height, options \\ []) do
+    with {:ok, {:resize, width, height, filter, engine}} <-
+           compile_operation({:resize, width, height, options}) do
+      measure(:resize, handle, nil, fn -> image_resize(handle, width, height, filter, engine) end)
+    else
+      _ -> {:error, "invalid resize options #{inspect(options)}"}
+    end
+  end
 
   @doc false
   def image! do
@@ -247,14 +471,274 @@ defmodule ExMagick do
   @doc """
   Creates a new image handle with default values.
 
-  Image attributes may be tuned by using the `attr/3` function.
+  Image attributes may be tuned by using the `attr/3` function. Handles
+  given back by `release/1` are reused before new ones get allocated.
   """
   def init, do: fail()
 
+  @doc """
+  Refer to `reset/1`
+  """
+  @spec reset!(handle) :: handle
+  def reset!(handle) do
+    {:ok, handle} = reset(handle)
+    handle
+  end
+
+  @doc """
+  Brings the handle back to the state `init/0` returns it in: the image
+  is released, the attributes set by `attr/3`, the limits and the
+  deadline are cleared. The native structures of the handle are kept,
+  which makes a reset handle cheaper than a new one.
+  """
+  @spec reset(handle) :: {:ok, handle} | exm_error
+  def reset(_handle), do: fail()
+
+  @doc """
+  Resets the handle (refer to `reset/1`) and gives it back to a pool of
+  native handles, which `init/0` and `derive/1` take from before
+  allocating new ones. Meant for processes that go through many images
+  per second, where allocating handles shows up.
+
+  Any later call with a released handle fails with `"invalid handle"`,
+  while the calls already running with it finish first: the handle
+  only goes to the pool once they are done. Handles that are not
+  released go to the pool as well once garbage collected. The pool
+  keeps up to 64 handles, which may be changed when the library is
+  loaded:
+
+      config :exmagick, handle_pool: 256
+  """
+  @spec release(handle) :: :ok | exm_error
+  def release(_handle), do: fail()
+
+  @doc """
+  Returns the counters of the pool of handles (refer to `release/1`):
+  its `:size`, the handles `:pooled` at the moment and how many
+  handles `init/0` and `derive/1` `:allocated` and `:reused` so far.
+  """
+  @spec handle_stats :: {:ok, %{atom => non_neg_integer}}
+  def handle_stats, do: fail()
+
+  @doc """
+  Refer to `derive/1`
+  """
+  @spec derive!(handle) :: handle
+  def derive!(handle) do
+    {:ok, derived} = derive(handle)
+    derived
+  end
+
+  @doc """
+  Creates a new handle with the same attributes and image of `handle`.
+
+  The pixels are shared by both handles until either of them changes
+  the image, which makes this much cheaper than loading the image
+  again. Handles may be used by multiple processes at the same time,
+  but operations on the same handle run one at a time, so the
+  recommended way to process an image in parallel is to derive a new
+  handle for each process:
+
+      source = ExMagick.init!() |> ExMagick.image_load!(path)
+
+      [64, 128, 256]
+      |> Enum.map(fn size ->
+        Task.async(fn ->
+          source
+          |> ExMagick.derive!()
+          |> ExMagick.thumb!(size, size)
+          |> ExMagick.image_dump!()
+        end)
+      end)
+      |> Enum.map(&Task.await/1)
+  """
+  @spec derive(handle) :: {:ok, handle} | exm_error
+  def derive(_handle), do: fail()
+
+  @doc """
+  Refer to `composite/5`
+  """
+  @spec composite!(handle, handle, integer, integer, [composite_option]) :: handle
+  def composite!(handle, overlay, x, y, options \\ []) do
+    {:ok, handle} = composite(handle, overlay, x, y, options)
+    handle
+  end
+
+  @doc """
+  Draws the image of the `overlay` handle over the image of `handle`,
+  with its top left corner at `x`, `y`. Only the first frame of either
+  image is used.
+
+  The following `options` are available:
+
+  * `:operator` - how the pixels of both images are combined: `:over`
+  (default), `:in`, `:out`, `:atop`, `:xor`, `:plus`, `:minus`, `:add`,
+  `:subtract`, `:difference`, `:multiply` or `:copy`.
+
+  ## Examples
+
+      ExMagick.composite!(photo, watermark, 10, 10)
+  """
+  @spec composite(handle, handle, integer, integer, [composite_option]) ::
+          {:ok, handle} | exm_error
+  def composite(handle, overlay, x, y, options \\ []) do
+    image_composite(handle, overlay, x, y, Keyword.get(options, :operator, :over))
+  end
+
+  @doc """
+  Refer to `montage/2`
+  """
+  @spec montage!([handle], [montage_option]) :: handle
+  def montage!(handles, options \\ []) do
+    {:ok, handle} = montage(handles, options)
+    handle
+  end
+
+  @doc """
+  Creates a new handle whose image is a grid of the images of `handles`
+  (such as a sprite sheet or a contact sheet), built in memory from
+  images already loaded.
+
+  Every cell of the grid is as big as the biggest image and each image
+  is drawn at the top left corner of its cell, in the order of `handles`
+  and row by row. The image at index `k` is thus at
+  `{rem(k, columns) * (width + spacing), div(k, columns) * (height + spacing)}`.
+
+  The grid is checked against the limits of the first handle (refer to
+  `limit/2`), which the new handle inherits, before it gets allocated.
+
+  The following `options` are available:
+
+  * `:columns` - the cells of each row [default: enough for a square];
+  * `:spacing` - the pixels between cells [default: 0];
+  * `:background` - the color of the empty space [default: `"transparent"`].
+
+  ## Examples
+
+      icons
+      |> Enum.map(&ExMagick.image_load!(ExMagick.init!(), &1))
+      |> ExMagick.montage!(columns: 16)
+      |> ExMagick.attr!(:magick, "PNG")
+      |> ExMagick.image_dump!()
+  """
+  @spec montage([handle], [montage_option]) :: {:ok, handle} | exm_error
+  def montage(handles, options \\ []) when is_list(handles) do
+    columns =
+      Keyword.get_lazy(options, :columns, fn ->
+        handles |> length() |> :math.sqrt() |> Float.ceil() |> trunc() |> max(1)
+      end)
+
+    image_montage(
+      handles,
+      columns,
+      Keyword.get(options, :spacing, 0),
+      Keyword.get(options, :background, "transparent")
+    )
+  end
+
+  @doc """
+  Refer to `pixels/2`
+  """
+  @spec pixels!(handle, [pixel_option]) :: binary
+  def pixels!(handle, options \\ []) do
+    {:ok, pixels} = pixels(handle, options)
+    pixels
+  end
+
+  @doc """
+  Exports the pixels of the image as a packed binary, row by row, with
+  no padding between pixels or rows.
+
+  The following `options` are available:
+
+  * `:map` - the channels of each pixel, `:rgb` (default), `:rgba` or
+  `:gray`;
+  * `:depth` - the bits of each channel, `8` (default) or `16`. 16-bit
+  channels are stored in native byte order;
+  * `:region` - a `{x, y, width, height}` tuple, defaults to the whole
+  image.
+
+  The result can be handed to Nx as is:
+
+      pixels = ExMagick.pixels!(image, map: :rgb, depth: 8)
+      %{width: w, height: h} = ExMagick.size!(image)
+      pixels |> Nx.from_binary({:u, 8}) |> Nx.reshape({h, w, 3})
+  """
+  @spec pixels(handle, [pixel_option]) :: {:ok, binary} | exm_error
+  def pixels(handle, options \\ []) do
+    region = Keyword.get(options, :region, :all)
+    map = Keyword.get(options, :map, :rgb)
+    image_pixels(handle, region, map, Keyword.get(options, :depth, 8))
+  end
+
+  @doc """
+  Refer to `from_pixels/4`
+  """
+  @spec from_pixels!(handle, binary, {pos_integer, pos_integer}, [pixel_option]) :: handle
+  def from_pixels!(handle, pixels, size, options \\ []) do
+    {:ok, handle} = from_pixels(handle, pixels, size, options)
+    handle
+  end
+
+  @doc """
+  Replaces the image of the handle with one made of packed pixels of
+  the given `{width, height}`, in the layout produced by `pixels/2` and
+  described by the `:map` and `:depth` options.
+
+  The new image has no type, so `attr/3` must set `:magick` before it
+  gets dumped.
+  """
+  @spec from_pixels(handle, binary, {pos_integer, pos_integer}, [pixel_option]) ::
+          {:ok, handle} | exm_error
+  def from_pixels(handle, pixels, {width, height}, options \\ []) do
+    map = Keyword.get(options, :map, :rgb)
+    image_from_pixels(handle, pixels, width, height, map, Keyword.get(options, :depth, 8))
+  end
+
+  @doc """
+  Refer to `fingerprint/2`
+  """
+  @spec fingerprint!(handle, [fingerprint_kind]) :: map
+  def fingerprint!(handle, kinds \\ [:phash]) do
+    {:ok, fingerprint} = fingerprint(handle, kinds)
+    fingerprint
+  end
+
+  @doc """
+  Computes fingerprints of the image (of its first frame), meant to
+  find duplicates and near duplicates, reading its pixels only once and
+  without encoding it. Returns a map with one entry per `kind`:
+
+  * `:ahash`, `:dhash` and `:phash` - 64-bit perceptual hashes: the
+  average hash, the difference (gradient) hash and the DCT based hash.
+  The luma of the image is averaged down to 32x32 and the hashes
+  computed out of it, so similar images have hashes a few bits apart
+  (their Hamming distance), `:phash` being the most robust;
+  * `:histogram` - the 256 counts of each of the red, green and blue
+  channels as 32-bit big-endian integers, in this order;
+  * `:stats` - `%{mean: {r, g, b}, stddev: {r, g, b}}`, channels being
+  in `0..255`.
+
+  ## Examples
+
+      %{phash: hash} = ExMagick.fingerprint!(image)
+      distance = Enum.sum(for <<bit::1 <- <<:erlang.bxor(hash, other)::64>> >>, do: bit)
+
+      {:ok, %{histogram: <<red::binary-1024, green::binary-1024, blue::binary-1024>>}} =
+        ExMagick.fingerprint(image, [:histogram])
+  """
+  @spec fingerprint(handle, [fingerprint_kind]) :: {:ok, map} | exm_error
+  def fingerprint(handle, kinds \\ [:phash]) when is_list(kinds) do
+    case Enum.reject(kinds, &(&1 in [:ahash, :dhash, :phash, :histogram, :stats])) do
+      [] -> image_fingerprint(handle, kinds)
+      unknown -> {:error, "unknown fingerprints #{inspect(unknown)}"}
+    end
+  end
+
   @doc """
   Refer to `image_load!/2`
   """
-  @spec image_load!(handle, Path.t() | {:blob, binary}) :: handle
+  @spec image_load!(handle, load_source) :: handle
   def image_load!(handle, path_or_blob) do
     {:ok, handle} = image_load(handle, path_or_blob)
     handle
@@ -263,10 +747,134 @@ defmodule ExMagick do
   @doc """
   Loads an image into the handler. You may provide a file path or a
   tuple `{:blob, ...}` which the second argument is the blob to load.
+
+  A tuple `{:mmap, path}` loads a file through a read-only memory
+  mapping of it, which the decoder reads straight from. Neither a copy
+  of the file nor a binary is ever made, which keeps the memory usage
+  down when loading very large files (ex.: TIFF scans). Pair it with
+  `image_dump/2`, which encodes straight into a file as well. Such
+  loads bypass the cache of `set_cache_size/1`.
+
+  The file must not be truncated while it is being decoded: reading the
+  mapping past the new end of the file raises `SIGBUS`, which takes the
+  whole VM down. Load files that other processes may rewrite by path
+  instead, or write them to a new file that gets renamed over the old
+  one.
+  """
+  @spec image_load(handle, load_source) :: {:ok, handle} | exm_error
+  def image_load(handle, source),
+    do: measure(:load, handle, source, fn -> load_source(handle, source) end)
+
+  defp load_source(handle, {:blob, blob}), do: image_load_blob(handle, blob)
+  defp load_source(handle, {:mmap, path}), do: image_load_mmap(handle, path)
+  defp load_source(handle, path), do: image_load_file(handle, path)
+
+  @doc """
+  Refer to `image_load/3`
+  """
+  @spec image_load!(handle, load_source, [load_option]) :: handle
+  def image_load!(handle, path_or_blob, options) do
+    {:ok, handle} = image_load(handle, path_or_blob, options)
+    handle
+  end
+
+  @doc """
+  Loads an image into the handler, refer to `image_load/2`.
+
+  The following `options` are available:
+
+  * `:max_size` - a `{width, height}` tuple hinting the decoder that the
+  image is going to be reduced to that size. Coders that support it
+  (ex.: JPEG) decode a downscaled image, which is never smaller than
+  the hint, saving most of the decoding time and memory of large
+  images. Other coders ignore it. The image should still be resized
+  afterwards using `thumb/3` or `size/3`.
+
+  * `:pages` - a range of zero-based pages to read from multi-page
+  documents (ex.: PDF, TIFF, GIF). The remaining pages are skipped by
+  the decoder instead of being loaded and thrown away, so
+  `pages: 36..36` reads only the 37th page.
+
+  * `:region` - a `{x, y, width, height}` tuple, the only part of the
+  image to load. Coders that support it (the raw ones, such as `gray:`
+  or `rgb:` files) read just that region, which keeps the memory usage
+  down to its size for very large images. The others, JPEG, PNG and
+  TIFF included, decode the whole image, which is cropped right after,
+  so the result is the same.
+  """
+  @spec image_load(handle, load_source, [load_option]) :: {:ok, handle} | exm_error
+  def image_load(handle, path_or_blob, options) do
+    with {:ok, options} <- compile_load_options(options, []) do
+      measure(:load, handle, path_or_blob, fn ->
+        case path_or_blob do
+          {:blob, blob} -> image_load_blob(handle, blob, options)
+          {:mmap, path} -> image_load_mmap(handle, path, options)
+          path -> image_load_file(handle, path, options)
+        end
+      end)
+    end
+  end
+
+  defp compile_load_options([], acc), do: {:ok, Enum.reverse(acc)}
+
+  defp compile_load_options([{:max_size, {width, height}} | options], acc)
+       when is_integer(width) and width > 0 and is_integer(height) and height > 0,
+       do: compile_load_options(options, [{:max_size, width, height} | acc])
+
+  defp compile_load_options([{:pages, %Range{first: first, last: last}} | options], acc)
+       when is_integer(first) and first >= 0 and is_integer(last) and last >= first,
+       do: compile_load_options(options, [{:pages, first, last - first + 1} | acc])
+
+  defp compile_load_options([{:region, {x, y, width, height}} | options], acc)
+       when is_integer(x) and x >= 0 and is_integer(y) and y >= 0 and is_integer(width) and
+              width > 0 and is_integer(height) and height > 0,
+       do: compile_load_options(options, [{:region, x, y, width, height} | acc])
+
+  defp compile_load_options([option | _], _acc),
+    do: {:error, "invalid load option #{inspect(option)}"}
+
+  @doc """
+  Refer to `ping/2`
+  """
+  @spec ping!(Path.t() | {:blob, binary}) :: ping_info
+  def ping!(path_or_blob) do
+    {:ok, info} = ping(path_or_blob)
+    info
+  end
+
+  @doc """
+  Refer to `ping/2`
+  """
+  @spec ping(Path.t() | {:blob, binary}) :: {:ok, ping_info} | exm_error
+  def ping(path_or_blob) do
+    with {:ok, handle} <- init(), do: ping(handle, path_or_blob)
+  end
+
+  @doc """
+  Refer to `ping/2`
+  """
+  @spec ping!(handle, Path.t() | {:blob, binary}) :: ping_info
+  def ping!(handle, path_or_blob) do
+    {:ok, info} = ping(handle, path_or_blob)
+    info
+  end
+
+  @doc """
+  Reads the image headers without decoding its pixels, which is much
+  cheaper than `image_load/2` when only the image metadata is
+  needed. The image loaded on the handle, if any, is left untouched
+  but its attributes (ex.: `:density`) are honored.
+
+  The returned map contains:
+
+  * `:width`, `:height` - the size in pixels of the image (of its first page);
+  * `:magick` - the image type [ex.: PNG];
+  * `:pages` - the number of pages/frames of the image;
+  * `:density` - the horizontal and vertical resolution of the image.
   """
-  @spec image_load(handle, Path.t() | {:blob, binary}) :: {:ok, handle} | exm_error
-  def image_load(handle, {:blob, blob}), do: image_load_blob(handle, blob)
-  def image_load(handle, path), do: image_load_file(handle, path)
+  @spec ping(handle, Path.t() | {:blob, binary}) :: {:ok, ping_info} | exm_error
+  def ping(handle, {:blob, blob}), do: ping_blob(handle, blob)
+  def ping(handle, path), do: ping_file(handle, path)
 
   @doc """
   Refer to `image_dump/2`
@@ -282,16 +890,19 @@ defmodule ExMagick do
 
   If the attr `:adjoin` is `false`, multiple files will be created and the
   filename is expected to have a printf-formatting sytle (ex.: `foo%0d.png`).
+
+  The image is encoded straight into the file, no binary is created.
   """
   @spec image_dump(handle, Path.t()) :: {:ok, handle} | exm_error
-  def image_dump(handle, path), do: image_dump_file(handle, path)
+  def image_dump(handle, path),
+    do: measure(:dump, handle, path, fn -> image_dump_file(handle, path) end)
 
   @doc """
   Returns the image as a binary. You can change the type of this image
   using the `:magick` attribute.
   """
   @spec image_dump(handle) :: {:ok, binary} | exm_error
-  def image_dump(handle), do: image_dump_blob(handle)
+  def image_dump(handle), do: measure(:dump, handle, nil, fn -> image_dump_blob(handle) end)
 
   @doc """
   Refer to `image_dump/1`
@@ -302,55 +913,1007 @@ defmodule ExMagick do
     blob
   end
 
-  @spec image_load_file(handle, Path.t()) :: {:ok, handle} | exm_error
-  defp image_load_file(_handle, _path), do: fail()
+  @doc """
+  Returns a stream that encodes the image as it is consumed, emitting
+  chunks of the encoded image as soon as the encoder produces them
+  instead of holding the whole encoded image in memory. You can change
+  the type of this image using the `:magick` attribute.
 
-  @spec image_load_blob(handle, binary) :: {:ok, handle} | exm_error
-  defp image_load_blob(_handle, _blob), do: fail()
+  The encoder runs on a thread of the pool of `pipeline_async/2` and
+  stays at most `:window` chunks ahead of the consumer: past that, it
+  waits until the consumer takes the next chunk, or until the deadline
+  of the handle (refer to `deadline/2`) passes. Halting the stream
+  early stops sending chunks, waits for the encoder to finish and
+  discards the chunks already sent. An error while encoding raises
+  when consuming the stream.
 
-  @spec image_dump_file(handle, Path.t()) :: {:ok, handle} | exm_error
-  defp image_dump_file(_handle, _path), do: fail()
+  Formats whose encoders seek back into what they already wrote (ex.:
+  TIFF, PDF) are encoded into memory first and streamed afterwards.
 
-  @spec image_dump_blob(handle) :: {:ok, binary} | exm_error
-  defp image_dump_blob(_handle), do: fail()
+  The following `options` are available:
 
-  @spec set_attr(handle, atom, String.t() | boolean) :: {:ok, handle} | exm_error
-  defp set_attr(_handle, _attribute, _value), do: fail()
+  * `:chunk_size` - the size in bytes of each chunk, the last one may be
+  smaller [default: 65536];
+  * `:window` - how many chunks may wait in the mailbox of the consumer
+  [default: 4].
 
-  @spec get_attr(handle, atom) :: {:ok, String.t() | boolean | non_neg_integer} | exm_error
-  defp get_attr(_handle, _attribute), do: fail()
+  ## Examples
 
-  @doc """
-  Applies operations on the image.
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.pdf"))
+      |> ExMagick.attr!(:magick, "TIFF")
+      |> ExMagick.dump_stream()
+      |> Stream.into(File.stream!("/tmp/elixir.tiff"))
+      |> Stream.run()
+  """
+  @spec dump_stream(handle, [{:chunk_size | :window, pos_integer}]) :: Enumerable.t()
+  def dump_stream(handle, options \\ []) do
+    chunk_size = Keyword.get(options, :chunk_size, 65536)
+    window = Keyword.get(options, :window, 4)
 
-  Currently, supported options are:
+    Stream.resource(
+      fn ->
+        {owner, ref} = {self(), make_ref()}
+        {:ok, stream} = stream_open(window)
 
-  - `threshold_image`
-  - `black_threshold_image`
-  - `white_threshold_image`
+        {_pid, mref} =
+          spawn_monitor(fn ->
+            case dump_into(handle, stream, ref, chunk_size) do
+              {:ok, _} -> send(owner, {ref, :eof})
+              error -> send(owner, {ref, error})
+            end
+          end)
 
-  ## Examples
+        {ref, mref, stream}
+      end,
+      fn {ref, mref, stream} = state ->
+        case next_chunk(ref, mref) do
+          {:data, chunk} ->
+            :ok = stream_ack(stream, 1)
+            {[chunk], state}
 
-      ExMagick.init!()
-      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
-      |> ExMagick.convert(:threshold_image, 12.7)
+          result ->
+            {:halt, result}
+        end
+      end,
+      fn
+        :eof ->
+          :ok
 
-      ExMagick.init!()
-      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
-      |> ExMagick.convert(:black_threshold_image, "100%,100%,100%")
+        {:error, reason} when is_binary(reason) ->
+          raise RuntimeError, reason
 
-      ExMagick.init!()
-      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
-      |> ExMagick.convert(:white_threshold_image, "25%")
-  """
-  @spec convert(handle, atom, String.t()) :: {:ok, handle} | exm_error
-  def convert(_handle, _option, _value), do: fail()
+        {:error, reason} ->
+          raise RuntimeError, inspect(reason)
 
-  def convert!(handle, option, value) do
-    {:ok, handle} = convert(handle, option, value)
-    handle
+        {ref, mref, stream} ->
+          :ok = stream_cancel(stream)
+
+          Stream.repeatedly(fn -> next_chunk(ref, mref) end)
+          |> Enum.find(&(not match?({:data, _}, &1)))
+      end
+    )
+  end
+
+  defp dump_into(handle, stream, ref, chunk_size) do
+    with {:ok, job} <- image_dump_stream(handle, stream, ref, chunk_size) do
+      receive do
+        {^job, result} -> result
+      end
+    end
+  end
+
+  defp next_chunk(ref, mref) do
+    receive do
+      {^ref, {:data, chunk}} ->
+        {:data, chunk}
+
+      {^ref, result} ->
+        Process.demonitor(mref, [:flush])
+        result
+
+      {:DOWN, ^mref, :process, _pid, reason} ->
+        {:error, "stream encoder exited: #{inspect(reason)}"}
+    end
   end
 
+  @spec image_load_file(handle, Path.t()) :: measured(handle)
+  defp image_load_file(_handle, _path), do: fail()
+
+  @spec image_load_blob(handle, binary) :: measured(handle)
+  defp image_load_blob(_handle, _blob), do: fail()
+
+  @spec image_load_file(handle, Path.t(), [tuple]) :: measured(handle)
+  defp image_load_file(_handle, _path, _options), do: fail()
+
+  @spec image_load_blob(handle, binary, [tuple]) :: measured(handle)
+  defp image_load_blob(_handle, _blob, _options), do: fail()
+
+  @spec image_load_mmap(handle, Path.t()) :: measured(handle)
+  defp image_load_mmap(_handle, _path), do: fail()
+
+  @spec image_load_mmap(handle, Path.t(), [tuple]) :: measured(handle)
+  defp image_load_mmap(_handle, _path, _options), do: fail()
+
+  @spec ping_file(handle, Path.t()) :: {:ok, ping_info} | exm_error
+  defp ping_file(_handle, _path), do: fail()
+
+  @spec ping_blob(handle, binary) :: {:ok, ping_info} | exm_error
+  defp ping_blob(_handle, _blob), do: fail()
+
+  @spec image_dump_file(handle, Path.t()) :: measured(handle)
+  defp image_dump_file(_handle, _path), do: fail()
+
+  @spec image_dump_blob(handle) :: measured(binary)
+  defp image_dump_blob(_handle), do: fail()
+
+  @spec image_size(handle, non_neg_integer, non_neg_integer) :: measured(handle)
+  defp image_size(_handle, _width, _height), do: fail()
+
+  @spec image_thumb(handle, non_neg_integer, non_neg_integer) :: measured(handle)
+  defp image_thumb(_handle, _width, _height), do: fail()
+
+  @spec image_crop(handle, non_neg_integer, non_neg_integer, non_neg_integer, non_neg_integer) ::
+          measured(handle)
+  defp image_crop(_handle, _x, _y, _width, _height), do: fail()
+
+  @spec image_convert(handle, atom, String.t() | number | atom | boolean) ::
+          measured(handle)
+  defp image_convert(_handle, _option, _value), do: fail()
+
+  @spec image_dump_stream(handle, reference, reference, pos_integer) ::
+          {:ok, reference} | exm_error
+  defp image_dump_stream(_handle, _stream, _ref, _chunk_size), do: fail()
+
+  @spec stream_open(pos_integer) :: {:ok, reference} | exm_error
+  defp stream_open(_window), do: fail()
+
+  @spec stream_ack(reference, pos_integer) :: :ok
+  defp stream_ack(_stream, _credits), do: fail()
+
+  @spec stream_cancel(reference) :: :ok
+  defp stream_cancel(_stream), do: fail()
+
+  @spec set_attr(handle, atom, attr_value) :: {:ok, handle} | exm_error
+  defp set_attr(_handle, _attribute, _value), do: fail()
+
+  @spec get_attr(handle, atom) :: {:ok, attr_value} | exm_error
+  defp get_attr(_handle, _attribute), do: fail()
+
+  @spec set_deadline(handle, integer | :infinity) :: {:ok, handle} | exm_error
+  defp set_deadline(_handle, _deadline), do: fail()
+
+  @doc """
+  Applies operations on the image, to every frame of an animation.
+
+  Currently, supported options are:
+
+  - `threshold_image` - a threshold (number);
+  - `black_threshold_image` - a threshold (string, ex.: `"50%"`);
+  - `white_threshold_image` - a threshold (string, ex.: `"50%"`);
+  - `rotate` - degrees (number), clockwise;
+  - `flip` - `:vertical` (top to bottom) or `:horizontal` (left to right);
+  - `sharpen` - the sigma of the gaussian (number);
+  - `blur` - the sigma of the gaussian (number);
+  - `strip` - `true` removes the profiles and comments of the image;
+  - `auto_orient` - `true` rotates the image according to its EXIF
+  orientation;
+  - `colorspace` - one of `:rgb`, `:srgb`, `:gray`, `:cmyk`, `:hsl`,
+  `:lab` or `:ycbcr`;
+  - `gamma` - a gamma (number) or one gamma per channel (`"R,G,B"`);
+  - `delay` - the time every frame of an animation shows, in
+  centiseconds (refer to `frames/1`).
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
+      |> ExMagick.convert(:threshold_image, 12.7)
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
+      |> ExMagick.convert(:black_threshold_image, "100%,100%,100%")
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
+      |> ExMagick.convert(:white_threshold_image, "25%")
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(upload)
+      |> ExMagick.convert!(:auto_orient, true)
+      |> ExMagick.convert!(:strip, true)
+      |> ExMagick.attr(:quality, 85)
+  """
+  @spec convert(handle, atom, String.t() | number | atom | boolean) :: {:ok, handle} | exm_error
+  def convert(handle, option, value),
+    do: measure(:convert, handle, nil, fn -> image_convert(handle, option, value) end)
+
+  def convert!(handle, option, value) do
+    {:ok, handle} = convert(handle, option, value)
+    handle
+  end
+
+  @typedoc """
+  An operation of a pipeline. Refer to `pipeline/2`.
+  """
+  @type operation ::
+          {:load, load_source}
+          | {:load, load_source, [load_option]}
+          | {:size, non_neg_integer, non_neg_integer}
+          | {:thumb, non_neg_integer, non_neg_integer}
+          | {:resize, pos_integer, pos_integer}
+          | {:resize, pos_integer, pos_integer, [resize_option]}
+          | {:crop, non_neg_integer, non_neg_integer, non_neg_integer, non_neg_integer}
+          | {:convert, atom, String.t() | number | atom | boolean}
+          | {:magick, String.t()}
+          | {:attr, atom, attr_value}
+          | {:dump, Path.t()}
+          | :dump
+
+  @doc """
+  Refer to `pipeline/2`
+  """
+  @spec pipeline!(handle, [operation]) :: handle | binary
+  def pipeline!(handle, operations) do
+    {:ok, result} = pipeline(handle, operations)
+    result
+  end
+
+  @doc """
+  Runs a list of operations on the image with a single native call.
+
+  This is equivalent to calling the respective functions one after the
+  other, but the whole chain runs at once in native code (on a single
+  dirty scheduler job when available) and intermediate images are
+  released as soon as the next step produces its result.
+
+  The following operations are available:
+
+  * `{:load, path_or_blob}` - refer to `image_load/2`;
+  * `{:load, path_or_blob, options}` - refer to `image_load/3`;
+  * `{:size, width, height}` - refer to `size/3`;
+  * `{:thumb, width, height}` - refer to `thumb/3`;
+  * `{:resize, width, height, options}` - refer to `resize/4`;
+  * `{:crop, x, y, width, height}` - refer to `crop/5`;
+  * `{:convert, option, value}` - refer to `convert/3`;
+  * `{:magick, type}` - changes the image type [ex.: PNG];
+  * `{:attr, attribute, value}` - refer to `attr/3`, ex.: to set the
+  encoder options of the following dumps;
+  * `{:dump, path}` - refer to `image_dump/2`;
+  * `:dump` - refer to `image_dump/1`. It must be the last operation and
+  makes the pipeline return the blob instead of the handle.
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.pipeline([
+        {:load, Path.join(__DIR__, "../test/images/elixir.png")},
+        {:thumb, 64, 64},
+        {:magick, "JPEG"},
+        :dump
+      ])
+  """
+  @spec pipeline(handle, [operation]) :: {:ok, handle | binary} | exm_error
+  def pipeline(handle, operations) when is_list(operations) do
+    with {:ok, compiled} <- compile_pipeline(operations, []) do
+      run_pipeline(handle, compiled)
+    end
+  end
+
+  @doc """
+  Runs `pipeline/2` on a native thread pool and returns a reference
+  right away. Once the pipeline is done the result `pipeline/2` would
+  return is sent to the caller as `{ref, result}`, refer to `await/2`.
+
+  The pool does not use the schedulers of the VM (dirty or not), so it
+  bounds the image processing of the node by itself; `dump_stream/2`
+  encodes on it as well. Its size is read once the library gets
+  loaded:
+
+      config :exmagick,
+        async_threads: 4, # defaults to the number of online schedulers
+        async_queue: 256  # defaults to 64 jobs per thread
+
+  Calls fail with `{:error, "busy"}` when the queue is full, so callers
+  should back off instead of queueing even more work. The caller is
+  monitored: once it goes down its pipeline is skipped when dequeued,
+  or aborted if already running, and no result is sent.
+  """
+  @spec pipeline_async(handle, [operation]) :: {:ok, reference} | exm_error
+  def pipeline_async(handle, operations) when is_list(operations) do
+    with {:ok, compiled} <- compile_pipeline(operations, []) do
+      run_pipeline_async(handle, compiled)
+    end
+  end
+
+  @doc """
+  Waits for the result of `pipeline_async/2` for up to `timeout`
+  milliseconds, returning `{:error, :timeout}` past it. The pipeline is
+  then cancelled (aborted if already running) and its result, should it
+  come later, is never sent.
+  """
+  @spec await(reference, timeout) :: {:ok, handle | binary} | exm_error
+  def await(ref, timeout \\ 5000) do
+    receive do
+      {^ref, result} -> result
+    after
+      timeout ->
+        :ok = cancel_async(ref)
+
+        # the result may have been sent right before the cancellation
+        receive do
+          {^ref, result} -> result
+        after
+          0 -> {:error, :timeout}
+        end
+    end
+  end
+
+  @doc """
+  Sets the GraphicsMagick resource limits of the node. The following
+  limits are available:
+
+  * `:memory` - bytes of pixel cache kept in memory;
+  * `:map` - bytes of pixel cache kept in memory-mapped files;
+  * `:disk` - bytes of pixel cache kept on disk, `0` forbids it;
+  * `:files` - number of pixel cache files open at once;
+  * `:pixels` - pixels of a single image;
+  * `:width` and `:height` - dimensions of a single image;
+  * `:threads` - OpenMP threads used by a single operation.
+
+  Operations exceeding them fail with `{:error, {:resource_limit, kind}}`.
+  These limits are applied when the library is loaded as well:
+
+      config :exmagick,
+        resource_limits: [memory: 256 * 1024 * 1024, disk: 0, pixels: 64_000_000]
+  """
+  @spec set_resource_limits(keyword(non_neg_integer)) :: :ok | exm_error
+  def set_resource_limits(_limits), do: fail()
+
+  @doc """
+  Returns the GraphicsMagick resource limits of the node, refer to
+  `set_resource_limits/1`.
+  """
+  @spec resource_limits :: {:ok, %{atom => non_neg_integer}}
+  def resource_limits, do: fail()
+
+  @doc """
+  Sets the bytes of the cache of decoded images, `0` (the default)
+  disabling it.
+
+  Once enabled, images loaded from blobs (by `image_load/3`,
+  `pipeline/2` and friends) are kept decoded, so loading the same blob
+  with the same options again costs about as much as `derive/1` instead
+  of decoding it. The least recently used images are evicted once the
+  cache is full. The size is read when the library is loaded as well:
+
+      config :exmagick, cache_size: 512 * 1024 * 1024
+  """
+  @spec set_cache_size(non_neg_integer) :: :ok | exm_error
+  def set_cache_size(_bytes), do: fail()
+
+  @doc """
+  Returns the counters of the cache of decoded images (refer to
+  `set_cache_size/1`): its `:size`, the `:bytes` and `:entries` it
+  holds and the `:hits`, `:misses` and `:evictions` so far.
+  """
+  @spec cache_stats :: {:ok, %{atom => non_neg_integer}}
+  def cache_stats, do: fail()
+
+  @doc """
+  Refer to `limit/2`
+  """
+  @spec limit!(handle, keyword(pos_integer)) :: handle
+  def limit!(handle, limits) do
+    {:ok, handle} = limit(handle, limits)
+    handle
+  end
+
+  @doc """
+  Limits the images the handle may hold, on top of the limits of the
+  node (refer to `set_resource_limits/1`):
+
+  * `:width` and `:height` - dimensions of the image;
+  * `:pixels` - pixels of the image, counting all of its pages.
+
+  Images are checked before they are decoded, and resizing past the
+  limits fails too, with `{:error, {:resource_limit, kind}}`. Limits
+  can only be lowered and are inherited by `derive/1` and `page/2`.
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.limit!(width: 4096, height: 4096, pixels: 16_000_000)
+      |> ExMagick.image_load(upload)
+  """
+  @spec limit(handle, keyword(pos_integer)) :: {:ok, handle} | exm_error
+  def limit(_handle, _limits), do: fail()
+
+  @doc """
+  Refer to `deadline/2`
+  """
+  @spec deadline!(handle, timeout) :: handle
+  def deadline!(handle, timeout) do
+    {:ok, handle} = deadline(handle, timeout)
+    handle
+  end
+
+  @doc """
+  Gives the operations on the handle `timeout` milliseconds from now to
+  complete, `:infinity` removing the deadline. The deadline is inherited
+  by `derive/1` and `page/2`.
+
+  Loading, dumping, `thumb/3`, `resize/4`, `convert/3`, pipelines
+  (`pipeline_async/2` too) and each of `renditions/3` still running past the deadline are aborted
+  through the GraphicsMagick progress monitor and fail with
+  `{:error, :timeout}`, as do the ones started after it. A deadline set
+  while an operation runs applies to it as well, without waiting for it.
+  Likewise they are aborted with `{:error, :cancelled}` once their
+  caller goes down, so that abandoned work does not hold on to a
+  scheduler. The image of
+  an aborted operation may be left partially decoded on the handle.
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.deadline!(2_000)
+      |> ExMagick.pipeline([{:load, upload}, {:thumb, 256, 256}, :dump])
+  """
+  @spec deadline(handle, timeout) :: {:ok, handle} | exm_error
+  def deadline(handle, :infinity), do: set_deadline(handle, :infinity)
+
+  def deadline(handle, timeout) when is_integer(timeout) and timeout >= 0,
+    do: set_deadline(handle, System.monotonic_time(:millisecond) + timeout)
+
+  def deadline(_handle, timeout), do: {:error, "invalid timeout #{inspect(timeout)}"}
+
+  @doc """
+  Refer to `stats/0`
+  """
+  @spec stats! :: map
+  def stats! do
+    {:ok, stats} = stats()
+    stats
+  end
+
+  @doc """
+  Returns the totals of the operations run by every handle since the
+  library was loaded, along with the bytes of pixel cache GraphicsMagick
+  currently keeps in `:memory`, in memory-mapped files (`:map`) and on
+  `:disk`.
+
+  Operations are reported under `:load`, `:dump`, `:size`, `:thumb`,
+  `:resize`, `:crop` and `:convert` as `t:op_stats/0` maps. `:pixels` counts the
+  pixels each call produced (all pages of a loaded image) and
+  `:max_usecs` is the slowest call so far.
+  """
+  @spec stats :: {:ok, %{atom => op_stats | integer}}
+  def stats, do: fail()
+
+  @doc """
+  Emits the result of `stats/0` as `:telemetry` events, meant to be
+  called periodically (ex.: as a `:telemetry_poller` measurement):
+
+  * `[:exmagick, op]` - with the `t:op_stats/0` of each operation;
+  * `[:exmagick, :pixel_cache]` - with the `:memory`, `:map` and `:disk`
+  usage.
+  * `[:exmagick, :decode_cache]` - with the result of `cache_stats/0`;
+  * `[:exmagick, :handle_pool]` - with the result of `handle_stats/0`.
+
+  Does nothing when `:telemetry` is not available.
+
+  Besides, every call of `image_load/2`, `image_load/3`, `image_dump/1`,
+  `image_dump/2`, `size/3`, `thumb/3`, `resize/4`, `crop/5` and
+  `convert/3` emits `[:exmagick, op, :stop]` as long as a handler is
+  attached to it. Its measurements are the `:duration` of the call (in
+  native time units), the `:bytes_in` it read and the `:bytes_out` it
+  wrote (blobs or files), and the `:width` and `:height` of the image
+  afterwards (zero when the call fails). Its metadata holds the
+  `:handle` and the `:result`, either `:ok` or the reason of the error.
+  """
+  @spec emit_stats :: :ok
+  def emit_stats do
+    if telemetry?() do
+      {cache, ops} = Map.split(stats!(), [:memory, :map, :disk])
+
+      for {op, measurements} <- ops do
+        apply(:telemetry, :execute, [[:exmagick, op], measurements, %{}])
+      end
+
+      apply(:telemetry, :execute, [[:exmagick, :pixel_cache], cache, %{}])
+
+      {:ok, decode_cache} = cache_stats()
+      apply(:telemetry, :execute, [[:exmagick, :decode_cache], decode_cache, %{}])
+
+      {:ok, handle_pool} = handle_stats()
+      apply(:telemetry, :execute, [[:exmagick, :handle_pool], handle_pool, %{}])
+    end
+
+    :ok
+  end
+
+  @doc """
+  Refer to `renditions/3`
+  """
+  @spec renditions!(handle, [{[operation], String.t()}], [{:max_concurrency, pos_integer}]) ::
+          [{:ok, binary} | exm_error]
+  def renditions!(handle, specs, options \\ []) do
+    {:ok, renditions} = renditions(handle, specs, options)
+    renditions
+  end
+
+  @doc """
+  Produces many renditions of the image at once, without changing it.
+
+  Each spec is a tuple `{operations, type}`, where `operations` is a list
+  of `:size`, `:thumb`, `:resize`, `:crop`, `:convert` and `:magick` operations
+  (refer to `pipeline/2`) to apply to a copy of the (first frame of the)
+  image, which is then encoded as `type` [ex.: JPEG].
+
+  The image is decoded only once and the renditions are produced in
+  parallel by native threads. The result contains either `{:ok, blob}`
+  or `{:error, reason}` for each spec, in the same order, the ones
+  still running or left once the `deadline/2` of the handle passes
+  failing with `{:error, :timeout}`.
+
+  The following `options` are available:
+
+  * `:max_concurrency` - the maximum number of threads working on the
+  renditions [default: `System.schedulers_online/0`]. The threads
+  besides the calling one count against `:async_threads` (refer to
+  `pipeline_async/2`) across all the calls, so a call gets fewer of
+  them while others run.
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
+      |> ExMagick.renditions([
+        {[{:thumb, 64, 64}], "JPEG"},
+        {[{:thumb, 128, 128}], "PNG"}
+      ])
+  """
+  @spec renditions(handle, [{[operation], String.t()}], [{:max_concurrency, pos_integer}]) ::
+          {:ok, [{:ok, binary} | exm_error]} | exm_error
+  def renditions(handle, specs, options \\ []) when is_list(specs) do
+    max_concurrency = Keyword.get(options, :max_concurrency, System.schedulers_online())
+
+    with {:ok, specs} <- compile_renditions(specs, []) do
+      run_renditions(handle, specs, max_concurrency)
+    end
+  end
+
+  @doc """
+  Refer to `tiles/3`
+  """
+  @spec tiles!(handle, Path.t(), [tiles_option]) :: map
+  def tiles!(handle, dir, options \\ []) do
+    {:ok, info} = tiles(handle, dir, options)
+    info
+  end
+
+  @doc """
+  Writes a Deep Zoom tile pyramid of the image into `dir`, in a single
+  native call: level `N` holds the image at full size and each level
+  below it half the size of the one above, down to a single pixel at
+  level 0. The tile at column `c` and row `r` of level `l` is written
+  to `dir/l/c_r.format`, and the `.dzi` descriptor of the pyramid next
+  to `dir` (`x_files` being described by `x.dzi`). Returns the number
+  of levels along with the size of the image.
+
+  The image goes through the pyramid a strip at a time, each level
+  scaling the rows it gets into the one below, so only about a row of
+  tiles per level is held on top of the image. Given a `:source` file,
+  the image is read from it instead of the handle, whose limits and
+  deadline still apply, and never held as a whole by the coders that
+  read regions (the raw ones, such as `gray:` or `rgb:` files). JPEG
+  files are decoded in full for level `N` only, the levels below being
+  built out of a decode at half the size (refer to `:max_size` in
+  `image_load/3`). Other coders, PNG and TIFF included, decode the
+  whole image.
+
+  The following `options` are available:
+
+  * `:tile_size` - the size of the tiles [default: 254];
+  * `:overlap` - the number of pixels each tile shares with its
+  neighbours, on each side [default: 1];
+  * `:format` - the image type of the tiles, also used as the
+  extension of their files [default: "jpg"];
+  * `:source` - the path of the image, read instead of the one loaded
+  in the handle;
+  * `:size` - a `{width, height}` tuple, the size of a raw `:source`.
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(__DIR__, "../test/images/elixir.png"))
+      |> ExMagick.tiles("/tmp/elixir_files", tile_size: 64, format: "png")
+
+      ExMagick.init!()
+      |> ExMagick.tiles("/tmp/map_files", source: "/data/map.jpg")
+  """
+  @spec tiles(handle, Path.t(), [tiles_option]) :: {:ok, map} | exm_error
+  def tiles(handle, dir, options \\ []) do
+    tile_size = Keyword.get(options, :tile_size, 254)
+    overlap = Keyword.get(options, :overlap, 1)
+    format = Keyword.get(options, :format, "jpg")
+    source = Keyword.get(options, :source, :image)
+    size = Keyword.get(options, :size, :none)
+
+    with :ok <- mkdir(dir),
+         {:ok, info} <- image_tiles(handle, dir, tile_size, overlap, format, source, size) do
+      write_dzi(dir, info, tile_size, overlap, format)
+    end
+  end
+
+  defp mkdir(dir) do
+    case File.mkdir_p(dir) do
+      :ok -> :ok
+      {:error, reason} -> {:error, "could not create #{dir}: #{reason}"}
+    end
+  end
+
+  defp write_dzi(dir, %{width: width, height: height} = info, tile_size, overlap, format) do
+    path = String.replace_suffix(dir, "_files", "") <> ".dzi"
+
+    dzi = """
+    <?xml version="1.0" encoding="UTF-8"?>
+    <Image xmlns="http://schemas.microsoft.com/deepzoom/2008"
+           TileSize="#{tile_size}" Overlap="#{overlap}" Format="#{format}">
+      <Size Width="#{width}" Height="#{height}"/>
+    </Image>
+    """
+
+    case File.write(path, dzi) do
+      :ok -> {:ok, info}
+      {:error, reason} -> {:error, "could not write #{path}: #{reason}"}
+    end
+  end
+
+  @doc """
+  Refer to `animate/3`
+  """
+  @spec animate!(handle, [operation], [animate_option]) :: handle
+  def animate!(handle, operations, options \\ []) do
+    {:ok, handle} = animate(handle, operations, options)
+    handle
+  end
+
+  @doc """
+  Applies `operations` to every frame of an animation [ex.: GIF], which
+  `pipeline/2` and the other functions apply to the first frame only
+  (or to each frame as stored, offsets and all).
+
+  The frames are first coalesced into full images, so that each shows
+  what the animation shows at that time, then transformed in parallel
+  by native threads. The operations are the ones allowed by
+  `renditions/3`, except `:magick`. The delay and the loop count of the
+  frames are kept.
+
+  The following `options` are available:
+
+  * `:optimize` - stores each frame as the region that changed since the
+  previous one, which keeps the animation small. Turn it off for
+  animations with transparent regions that change from one frame to the
+  next, which are otherwise drawn over [default: `true`];
+  * `:max_concurrency` - the maximum number of threads working on the
+  frames [default: `System.schedulers_online/0`].
+
+  ## Examples
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(upload)
+      |> ExMagick.animate!([{:thumb, 64, 64}, {:convert, :delay, 5}])
+      |> ExMagick.image_dump("/tmp/thumb.gif")
+  """
+  @spec animate(handle, [operation], [animate_option]) :: {:ok, handle} | exm_error
+  def animate(handle, operations, options \\ []) when is_list(operations) do
+    optimize = Keyword.get(options, :optimize, true)
+    max_concurrency = Keyword.get(options, :max_concurrency, System.schedulers_online())
+
+    with {:ok, compiled} <- compile_pipeline(operations, []),
+         true <- Enum.all?(compiled, &frame_operation?/1) do
+      image_animate(handle, compiled, optimize, max_concurrency)
+    else
+      false -> {:error, "invalid operations #{inspect(operations)}"}
+      error -> error
+    end
+  end
+
+  @doc """
+  Refer to `frames/1`
+  """
+  @spec frames!(handle) :: [frame_info]
+  def frames!(handle) do
+    {:ok, frames} = frames(handle)
+    frames
+  end
+
+  @doc """
+  Describes every frame of the image, in order: its size, its offset on
+  the canvas of the animation, its `:delay` (in centiseconds), the
+  number of times the animation loops (`:iterations`, 0 meaning
+  forever) and its `:dispose` method, what happens to the frame before
+  the next one is drawn.
+
+  ## Examples
+
+      [%{delay: 10, dispose: :none} | _] = ExMagick.frames!(image)
+  """
+  @spec frames(handle) :: {:ok, [frame_info]} | exm_error
+  def frames(handle), do: image_frames(handle)
+
+  @doc """
+  Refer to `batch_convert/4`
+  """
+  @spec batch_convert!([binary], [operation], String.t(), [batch_option]) ::
+          [{:ok, binary} | exm_error]
+  def batch_convert!(blobs, operations, type, options \\ []) do
+    {:ok, results} = batch_convert(blobs, operations, type, options)
+    results
+  end
+
+  @doc """
+  Decodes each of the `blobs`, applies the same `operations` to them
+  and encodes them as `type` [ex.: PNG], without a handle per blob.
+
+  Meant for many small images (icons, sprites), whose cost is mostly
+  the overhead of `init/0`, `image_load/2` and `image_dump/1`. The
+  operations are the ones allowed by `renditions/3`. The result
+  contains either `{:ok, blob}` or `{:error, reason}` for each blob, in
+  the same order.
+
+  The following `options` are available:
+
+  * `:chunk_size` - the number of blobs converted by each native call,
+  which keeps every call short [default: 64];
+  * `:limits` - the limits of every blob, as given to `limit/2`. Each
+  blob is checked against them before it is decoded [default: none,
+  only the limits of the node apply].
+
+  ## Examples
+
+      ExMagick.batch_convert(icons, [{:thumb, 32, 32}], "PNG")
+  """
+  @spec batch_convert([binary], [operation], String.t(), [batch_option]) ::
+          {:ok, [{:ok, binary} | exm_error]} | exm_error
+  def batch_convert(blobs, operations, type, options \\ []) when is_list(blobs) do
+    chunk_size = Keyword.get(options, :chunk_size, 64)
+    limits = Keyword.get(options, :limits, [])
+
+    with :ok <- check_chunk_size(chunk_size),
+         {:ok, [spec]} <- compile_renditions([{operations, type}], []) do
+      blobs
+      |> Enum.chunk_every(chunk_size)
+      |> Enum.reduce_while([], fn chunk, acc ->
+        case run_batch_convert(chunk, spec, limits) do
+          {:ok, results} -> {:cont, [results | acc]}
+          error -> {:halt, error}
+        end
+      end)
+      |> case do
+        results when is_list(results) -> {:ok, results |> Enum.reverse() |> Enum.concat()}
+        error -> error
+      end
+    end
+  end
+
+  defp check_chunk_size(size) when is_integer(size) and size > 0, do: :ok
+  defp check_chunk_size(size), do: {:error, "invalid chunk size #{inspect(size)}"}
+
+  defp compile_renditions([], acc), do: {:ok, Enum.reverse(acc)}
+
+  defp compile_renditions([{operations, type} = spec | specs], acc)
+       when is_list(operations) and is_binary(type) do
+    with {:ok, compiled} <- compile_pipeline(operations, []),
+         true <- Enum.all?(compiled, &rendition_operation?/1) do
+      compile_renditions(specs, [{compiled, type} | acc])
+    else
+      _ -> {:error, "invalid rendition #{inspect(spec)}"}
+    end
+  end
+
+  defp compile_renditions([spec | _], _acc), do: {:error, "invalid rendition #{inspect(spec)}"}
+
+  defp rendition_operation?(operation) when is_tuple(operation),
+    do: elem(operation, 0) in [:size, :thumb, :resize, :crop, :convert, :magick]
+
+  defp rendition_operation?(_operation), do: false
+
+  defp frame_operation?(operation),
+    do: rendition_operation?(operation) and elem(operation, 0) != :magick
+
+  @spec run_renditions(handle, [{[tuple], String.t()}], pos_integer) ::
+          {:ok, [{:ok, binary} | exm_error]} | exm_error
+  defp run_renditions(_handle, _specs, _max_concurrency), do: fail()
+
+  @spec run_batch_convert([binary], {[tuple], String.t()}, keyword(pos_integer)) ::
+          {:ok, [{:ok, binary} | exm_error]} | exm_error
+  defp run_batch_convert(_blobs, _spec, _limits), do: fail()
+
+  defp compile_pipeline([], acc), do: {:ok, Enum.reverse(acc)}
+
+  defp compile_pipeline([:dump | [_ | _]], _acc),
+    do: {:error, "dump must be the last operation"}
+
+  defp compile_pipeline([operation | operations], acc) do
+    case compile_operation(operation) do
+      {:ok, compiled} -> compile_pipeline(operations, [compiled | acc])
+      :error -> {:error, "invalid operation #{inspect(operation)}"}
+    end
+  end
+
+  defp compile_operation({:load, {:blob, blob}}) when is_binary(blob),
+    do: {:ok, {:load_blob, blob}}
+
+  defp compile_operation({:load, {:mmap, path}}) when is_binary(path),
+    do: {:ok, {:load_mmap, path}}
+
+  defp compile_operation({:load, path}) when is_binary(path), do: {:ok, {:load_file, path}}
+
+  defp compile_operation({:load, path_or_blob, options}) do
+    with {:ok, options} <- compile_load_options(options, []),
+         {:ok, {load, source}} <- compile_operation({:load, path_or_blob}) do
+      {:ok, {load, source, options}}
+    else
+      _ -> :error
+    end
+  end
+
+  defp compile_operation({op, width, height} = operation)
+       when op in [:size, :thumb] and is_integer(width) and is_integer(height),
+       do: {:ok, operation}
+
+  defp compile_operation({:resize, width, height}),
+    do: compile_operation({:resize, width, height, []})
+
+  defp compile_operation({:resize, width, height, options})
+       when is_integer(width) and width > 0 and is_integer(height) and height > 0 and
+              is_list(options) do
+    filter = Keyword.get(options, :filter, :lanczos3)
+    engine = Keyword.get(options, :engine, :magick)
+
+    if filter in [:lanczos3, :bilinear, :box] and engine in [:magick, :fast],
+      do: {:ok, {:resize, width, height, filter, engine}},
+      else: :error
+  end
+
+  defp compile_operation({:crop, x, y, width, height} = operation)
+       when is_integer(x) and is_integer(y) and is_integer(width) and is_integer(height),
+       do: {:ok, operation}
+
+  defp compile_operation({:convert, option, _value} = operation) when is_atom(option),
+    do: {:ok, operation}
+
+  defp compile_operation({:magick, type} = operation) when is_binary(type), do: {:ok, operation}
+
+  defp compile_operation({:attr, attribute, value}) when is_atom(attribute) do
+    with {:ok, value} <- compile_attr(attribute, value), do: {:ok, {:attr, attribute, value}}
+  end
+
+  defp compile_operation({:dump, path}) when is_binary(path), do: {:ok, {:dump_file, path}}
+  defp compile_operation(:dump), do: {:ok, :dump_blob}
+  defp compile_operation(_operation), do: :error
+
+  @spec run_pipeline(handle, [tuple | atom]) :: {:ok, handle | binary} | exm_error
+  defp run_pipeline(_handle, _operations), do: fail()
+
+  @spec run_pipeline_async(handle, [tuple | atom]) :: {:ok, reference} | exm_error
+  defp run_pipeline_async(_handle, _operations), do: fail()
+
+  @spec cancel_async(reference) :: :ok
+  defp cancel_async(_ref), do: fail()
+
+  @spec image_resize(handle, pos_integer, pos_integer, atom, atom) :: measured(handle)
+  defp image_resize(_handle, _width, _height, _filter, _engine), do: fail()
+
+  @spec image_pixels(handle, tuple | :all, atom, pos_integer) :: {:ok, binary} | exm_error
+  defp image_pixels(_handle, _region, _map, _depth), do: fail()
+
+  @spec image_fingerprint(handle, [fingerprint_kind]) :: {:ok, map} | exm_error
+  defp image_fingerprint(_handle, _kinds), do: fail()
+
+  @spec image_tiles(
+          handle,
+          Path.t(),
+          pos_integer,
+          non_neg_integer,
+          String.t(),
+          Path.t() | :image,
+          {pos_integer, pos_integer} | :none
+        ) :: {:ok, map} | exm_error
+  defp image_tiles(_handle, _dir, _tile_size, _overlap, _format, _source, _size), do: fail()
+
+  @spec image_animate(handle, [tuple], boolean, pos_integer) :: {:ok, handle} | exm_error
+  defp image_animate(_handle, _operations, _optimize, _max_concurrency), do: fail()
+
+  @spec image_frames(handle) :: {:ok, [frame_info]} | exm_error
+  defp image_frames(_handle), do: fail()
+
+  @spec image_from_pixels(handle, binary, pos_integer, pos_integer, atom, pos_integer) ::
+          {:ok, handle} | exm_error
+  defp image_from_pixels(_handle, _pixels, _width, _height, _map, _depth), do: fail()
+
+  @spec image_composite(handle, handle, integer, integer, atom) :: {:ok, handle} | exm_error
+  defp image_composite(_handle, _overlay, _x, _y, _operator), do: fail()
+
+  @spec image_montage([handle], pos_integer, non_neg_integer, String.t()) ::
+          {:ok, handle} | exm_error
+  defp image_montage(_handles, _columns, _spacing, _background), do: fail()
+
+  # the measured natives return the size of the image along with their
+  # result, refer to `emit_stats/0`
+  defp measure(op, handle, file, fun) do
+    event = [:exmagick, op, :stop]
+
+    if telemetry?() and apply(:telemetry, :list_handlers, [event]) != [] do
+      start = System.monotonic_time()
+
+      {result, width, height} =
+        case fun.() do
+          {:ok, value, width, height} -> {{:ok, value}, width, height}
+          error -> {error, 0, 0}
+        end
+
+      duration = System.monotonic_time() - start
+
+      {bytes_in, bytes_out} =
+        case result do
+          {:ok, blob} when is_binary(blob) -> {0, byte_size(blob)}
+          _ when op == :load -> {file_bytes(file), 0}
+          _ -> {0, file_bytes(file)}
+        end
+
+      measurements = %{
+        duration: duration,
+        bytes_in: bytes_in,
+        bytes_out: bytes_out,
+        width: width,
+        height: height
+      }
+
+      status =
+        case result do
+          {:error, reason} -> reason
+          _ -> :ok
+        end
+
+      apply(:telemetry, :execute, [event, measurements, %{handle: handle, result: status}])
+      result
+    else
+      case fun.() do
+        {:ok, value, _width, _height} -> {:ok, value}
+        error -> error
+      end
+    end
+  end
+
+  # whether `:telemetry` is available, checked once and kept as a
+  # persistent term rather than asking the code server on every call
+  defp telemetry? do
+    case :persistent_term.get({__MODULE__, :telemetry}, nil) do
+      nil ->
+        available = Code.ensure_loaded?(:telemetry)
+        :persistent_term.put({__MODULE__, :telemetry}, available)
+        available
+
+      available ->
+        available
+    end
+  end
+
+  defp file_bytes({:blob, blob}), do: byte_size(blob)
+  defp file_bytes({:mmap, path}), do: file_bytes(path)
+
+  defp file_bytes(path) when is_binary(path) do
+    case File.stat(path) do
+      {:ok, %{size: size}} -> size
+      _ -> 0
+    end
+  end
+
+  defp file_bytes(_), do: 0
+
   # XXX: this is to fool dialyzer
   defp fail, do: ExMagick.Hidden.fail("native function error")
 end
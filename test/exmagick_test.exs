@@ -71,6 +71,21 @@ defmodule ExMagickTest do
              |> ExMagick.attr!(:magick)
   end
 
+  test "dumped blob outlives the image it came from", context do
+    src = Path.join(context[:images], "elixir.png")
+    image = ExMagick.init!() |> ExMagick.image_load!(src)
+    blob = ExMagick.image_dump!(image)
+
+    ExMagick.image_load!(image, Path.join(context[:images], "elixir.pdf"))
+    :erlang.garbage_collect()
+
+    assert <<0x89, "PNG", _::binary>> = blob
+    assert "PNG" ==
+             ExMagick.init!()
+             |> ExMagick.image_load!({:blob, blob})
+             |> ExMagick.attr!(:magick)
+  end
+
   test "get image size", %{images: images} do
     src = Path.join(images, "elixir.png")
 
@@ -172,6 +187,62 @@ defmodule ExMagickTest do
     assert {:ok, true} == value
   end
 
+  describe "encoder attributes" do
+    test "are set and queried" do
+      handle =
+        ExMagick.init!()
+        |> ExMagick.attr!(:quality, 42)
+        |> ExMagick.attr!(:interlace, :line)
+        |> ExMagick.attr!(:sampling_factor, "2x2,1x1,1x1")
+        |> ExMagick.attr!(:define, %{"jpeg:dct-method" => "fast"})
+
+      assert {:ok, 42} == ExMagick.attr(handle, :quality)
+      assert {:ok, :line} == ExMagick.attr(handle, :interlace)
+      assert {:ok, "2x2,1x1,1x1"} == ExMagick.attr(handle, :sampling_factor)
+    end
+
+    test "rejects bad values" do
+      handle = ExMagick.init!()
+
+      assert {:error, _} = ExMagick.attr(handle, :quality, 101)
+      assert {:error, _} = ExMagick.attr(handle, :interlace, :diagonal)
+      assert {:error, _} = ExMagick.attr(handle, :define, 1)
+    end
+
+    test "change the encoded image", context do
+      image =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.attr!(:magick, "JPEG")
+
+      dump = fn attr, value ->
+        image |> ExMagick.derive!() |> ExMagick.attr!(attr, value) |> ExMagick.image_dump!()
+      end
+
+      assert byte_size(dump.(:quality, 10)) < byte_size(dump.(:quality, 95))
+
+      assert %{magick: "JPEG", width: 227} =
+               ExMagick.ping!({:blob, dump.(:interlace, :line)})
+    end
+
+    test "may be set by pipelines", context do
+      blob =
+        ExMagick.init!()
+        |> ExMagick.pipeline!([
+          {:load, Path.join(context[:images], "elixir.png")},
+          {:magick, "JPEG"},
+          {:attr, :quality, 30},
+          {:convert, :strip, true},
+          :dump
+        ])
+
+      assert %{magick: "JPEG"} = ExMagick.ping!({:blob, blob})
+
+      assert {:error, _} =
+               ExMagick.pipeline(ExMagick.init!(), [{:attr, :quality, :high}, :dump])
+    end
+  end
+
   test "magick attribute", context do
     for {type, path} <- [
           {"PDF", Path.join(context[:images], "elixir.pdf")},
@@ -256,5 +327,1255 @@ defmodule ExMagickTest do
       |> ExMagick.image_load!(src)
       |> ExMagick.convert(:white_threshold_image, "25%")
     end
+
+    test "rotate and flip", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert %{width: 95, height: 227} ==
+               image |> ExMagick.derive!() |> ExMagick.convert!(:rotate, 90) |> ExMagick.size!()
+
+      assert %{width: 227, height: 95} ==
+               image
+               |> ExMagick.derive!()
+               |> ExMagick.convert!(:flip, :horizontal)
+               |> ExMagick.size!()
+
+      assert {:error, _} = ExMagick.convert(image, :flip, :diagonal)
+    end
+
+    test "blur and sharpen", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      pixels = ExMagick.pixels!(image)
+
+      for {option, value} <- [blur: 1.5, sharpen: 1] do
+        converted = image |> ExMagick.derive!() |> ExMagick.convert!(option, value)
+
+        assert %{width: 227, height: 95} == ExMagick.size!(converted)
+        assert mean_abs_diff(pixels, ExMagick.pixels!(converted)) > 0
+      end
+    end
+
+    test "colorspace and gamma", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      pixels = ExMagick.pixels!(image)
+
+      gray = image |> ExMagick.derive!() |> ExMagick.convert!(:colorspace, :gray)
+      assert Enum.all?(for <<r, g, b <- ExMagick.pixels!(gray)>>, do: r == g and g == b)
+
+      brighter = image |> ExMagick.derive!() |> ExMagick.convert!(:gamma, 1.2)
+      assert mean_abs_diff(pixels, ExMagick.pixels!(brighter)) > 0
+
+      # a gamma of 1.0 leaves its channel alone
+      blue = image |> ExMagick.derive!() |> ExMagick.convert!(:gamma, "1.0,1.0,1.5")
+      channel = fn blob, n ->
+        for <<rgb::binary-3 <- blob>>, into: <<>>, do: binary_part(rgb, n, 1)
+      end
+
+      assert channel.(pixels, 0) == channel.(ExMagick.pixels!(blue), 0)
+      assert channel.(pixels, 2) != channel.(ExMagick.pixels!(blue), 2)
+
+      assert {:error, _} = ExMagick.convert(image, :colorspace, :unknown)
+      assert {:error, _} = ExMagick.convert(image, :gamma, 0)
+    end
+
+    test "strip removes comments", context do
+      png = File.read!(Path.join(context[:images], "elixir.png"))
+      <<signature::binary-8, ihdr::binary-25, rest::binary>> = png
+      text = "tEXt" <> "Comment" <> <<0>> <> "exmagick-comment"
+      chunk = <<byte_size(text) - 4::32, text::binary, :erlang.crc32(text)::32>>
+      image = ExMagick.image_load!(ExMagick.init!(), {:blob, signature <> ihdr <> chunk <> rest})
+
+      dump = fn strip ->
+        image
+        |> ExMagick.derive!()
+        |> ExMagick.convert!(:strip, strip)
+        |> ExMagick.attr!(:magick, "PNG")
+        |> ExMagick.image_dump!()
+      end
+
+      assert dump.(false) =~ "exmagick-comment"
+      refute dump.(true) =~ "exmagick-comment"
+    end
+
+    test "auto_orient follows the EXIF orientation", context do
+      jpg =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.attr!(:magick, "JPEG")
+        |> ExMagick.image_dump!()
+
+      # a big-endian TIFF header and a single entry: orientation 6 (rotated 90 degrees)
+      tiff = <<"MM", 42::16, 8::32, 1::16, 0x0112::16, 3::16, 1::32, 6::16, 0::16, 0::32>>
+      app1 = <<0xFF, 0xE1, byte_size(tiff) + 8::16, "Exif", 0, 0, tiff::binary>>
+      <<0xFF, 0xD8, rest::binary>> = jpg
+      image = ExMagick.image_load!(ExMagick.init!(), {:blob, <<0xFF, 0xD8>> <> app1 <> rest})
+
+      assert %{width: 227, height: 95} == ExMagick.size!(image)
+
+      orient = fn flag ->
+        image |> ExMagick.derive!() |> ExMagick.convert!(:auto_orient, flag) |> ExMagick.size!()
+      end
+
+      assert %{width: 95, height: 227} == orient.(true)
+      assert %{width: 227, height: 95} == orient.(false)
+    end
+
+    test "applies to every frame" do
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, gif(3)})
+
+      for {option, value} <- [
+            rotate: 90,
+            flip: :vertical,
+            blur: 1.5,
+            sharpen: 1,
+            auto_orient: true,
+            gamma: 1.2,
+            threshold_image: 10
+          ] do
+        converted = image |> ExMagick.derive!() |> ExMagick.convert!(option, value)
+        assert 3 == ExMagick.num_pages!(converted), "#{option} dropped frames"
+      end
+    end
+
+    test "unknown operation", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      assert {:error, _} = ExMagick.convert(image, :unknown, 1)
+      # the quality is an attribute, refer to attr/3
+      assert {:error, _} = ExMagick.convert(image, :quality, 85)
+    end
   end
+
+  describe "derive/1" do
+    test "changes to the derived handle do not affect the source", context do
+      source =
+        ExMagick.init!()
+        |> ExMagick.attr!(:adjoin, false)
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      derived = ExMagick.derive!(source)
+      assert {:ok, false} == ExMagick.attr(derived, :adjoin)
+
+      assert %{width: 42, height: 42} == derived |> ExMagick.thumb!(42, 42) |> ExMagick.size!()
+      assert %{width: 227, height: 95} == ExMagick.size!(source)
+    end
+
+    test "handles may be shared among processes", context do
+      source = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      sizes =
+        1..16
+        |> Enum.map(fn n ->
+          Task.async(fn ->
+            source |> ExMagick.derive!() |> ExMagick.thumb!(n, n) |> ExMagick.size!()
+          end)
+        end)
+        |> Enum.map(&Task.await/1)
+
+      assert Enum.map(1..16, &%{width: &1, height: &1}) == sizes
+      assert %{width: 227, height: 95} == ExMagick.size!(source)
+    end
+
+    test "derives handles without images" do
+      assert {:ok, _} = ExMagick.init!() |> ExMagick.derive()
+    end
+  end
+
+  describe "image_load/3" do
+    test "max_size decodes a downscaled JPEG", context do
+      jpg =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.size!(1816, 760)
+        |> ExMagick.attr!(:magick, "JPEG")
+        |> ExMagick.image_dump!()
+
+      %{width: width, height: height} =
+        ExMagick.init!()
+        |> ExMagick.image_load!({:blob, jpg}, max_size: {200, 80})
+        |> ExMagick.size!()
+
+      assert width < 1816 and width >= 200
+      assert height < 760 and height >= 80
+    end
+
+    test "max_size is only a hint for the next load", context do
+      src = Path.join(context[:images], "elixir.png")
+      image = ExMagick.init!()
+
+      assert %{width: 227, height: 95} ==
+               image |> ExMagick.image_load!(src, max_size: {10, 10}) |> ExMagick.size!()
+
+      assert %{width: 227, height: 95} == image |> ExMagick.image_load!(src) |> ExMagick.size!()
+    end
+
+    test "rejects unknown options", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      assert {:error, _} = ExMagick.init!() |> ExMagick.image_load(src, max_size: 10)
+      assert {:error, _} = ExMagick.init!() |> ExMagick.image_load(src, pages: 2..1)
+    end
+
+    test "region loads part of the image", context do
+      src = Path.join(context[:images], "elixir.png")
+      image = ExMagick.init!()
+
+      assert %{width: 50, height: 30} ==
+               image |> ExMagick.image_load!(src, region: {10, 20, 50, 30}) |> ExMagick.size!()
+
+      assert %{width: 27, height: 15} ==
+               image |> ExMagick.image_load!(src, region: {200, 80, 64, 64}) |> ExMagick.size!()
+
+      assert %{width: 27, height: 15} ==
+               image |> ExMagick.image_load!(src, region: {200, 80, 300, 300}) |> ExMagick.size!()
+
+      assert %{width: 227, height: 95} == image |> ExMagick.image_load!(src) |> ExMagick.size!()
+      assert {:error, _} = ExMagick.image_load(image, src, region: {0, 0, 0, 10})
+    end
+
+    test "pages reads only the given pages" do
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, gif(3)}, pages: 1..1)
+
+      assert 1 == ExMagick.num_pages!(image)
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, gif(3)})
+      assert 3 == ExMagick.num_pages!(image)
+    end
+  end
+
+  describe "image_load/2 with mmap" do
+    test "loads a file through a memory mapping", context do
+      path = Path.join(context[:images], "elixir.png")
+      image = ExMagick.init!() |> ExMagick.image_load!({:mmap, path})
+
+      assert %{width: 227, height: 95} == ExMagick.size!(image)
+      assert "PNG" == ExMagick.attr!(image, :magick)
+
+      pipeline = [{:load, {:mmap, path}, max_size: {10, 10}}, {:thumb, 10, 10}]
+      assert %{width: 10} = ExMagick.init!() |> ExMagick.pipeline!(pipeline) |> ExMagick.size!()
+    end
+
+    test "reports missing files", context do
+      path = Path.join(context[:tmpdir], "missing.png")
+      assert {:error, _} = ExMagick.init!() |> ExMagick.image_load({:mmap, path})
+    end
+  end
+
+  describe "page/2" do
+    test "extracts a single page" do
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, gif(3)})
+      page = ExMagick.page!(image, 2)
+
+      assert 1 == ExMagick.num_pages!(page)
+      assert 3 == ExMagick.num_pages!(image)
+      assert %{width: 1, height: 1} == ExMagick.size!(page)
+    end
+
+    test "fails on missing pages" do
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, gif(3)})
+
+      assert {:error, "page not found"} == ExMagick.page(image, 3)
+      assert {:error, "image not loaded"} == ExMagick.init!() |> ExMagick.page(0)
+    end
+  end
+
+  describe "ping/2" do
+    test "reads the metadata of a file", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      assert {:ok, %{width: 227, height: 95, magick: "PNG", pages: 1}} = ExMagick.ping(src)
+    end
+
+    test "reads the metadata of a blob", context do
+      blob = File.read!(Path.join(context[:images], "elixir.pdf"))
+
+      assert %{magick: "PDF", pages: 10} = ExMagick.ping!({:blob, blob})
+    end
+
+    test "does not touch the loaded image", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert %{pages: 10} = ExMagick.ping!(image, Path.join(context[:images], "elixir.pdf"))
+      assert "PNG" == ExMagick.attr!(image, :magick)
+    end
+  end
+
+  describe "renditions/3" do
+    test "produces every rendition from one image", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      specs = [
+        {[{:thumb, 64, 64}], "JPEG"},
+        {[{:crop, 0, 0, 100, 10}], "PNG"},
+        {[{:size, 20, 10}, {:convert, :threshold_image, 0.5}], "GIF"}
+      ]
+
+      assert {:ok, [{:ok, jpg}, {:ok, png}, {:ok, gif}]} =
+               ExMagick.renditions(image, specs, max_concurrency: 2)
+
+      for {blob, type, size} <- [
+            {jpg, "JPEG", %{width: 64, height: 64}},
+            {png, "PNG", %{width: 100, height: 10}},
+            {gif, "GIF", %{width: 20, height: 10}}
+          ] do
+        rendition = ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+        assert type == ExMagick.attr!(rendition, :magick)
+        assert size == ExMagick.size!(rendition)
+      end
+
+      assert %{width: 227, height: 95} == ExMagick.size!(image)
+    end
+
+    test "reports errors per rendition", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert [{:error, _}, {:ok, _}] =
+               ExMagick.renditions!(image, [{[], "NOSUCHFORMAT"}, {[], "PNG"}])
+    end
+
+    test "rejects invalid specs", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert {:error, _} = ExMagick.renditions(image, [{[:dump], "PNG"}])
+      assert {:error, "image not loaded"} = ExMagick.init!() |> ExMagick.renditions([{[], "PNG"}])
+    end
+
+    test "fails the renditions past the deadline", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      specs = List.duplicate({[{:thumb, 64, 64}], "PNG"}, 4)
+
+      assert {:ok, renditions} =
+               image |> ExMagick.deadline!(0) |> ExMagick.renditions(specs, max_concurrency: 4)
+
+      assert List.duplicate({:error, :timeout}, 4) == renditions
+
+      image = ExMagick.deadline!(image, :infinity)
+      renditions = ExMagick.renditions!(image, specs, max_concurrency: 64)
+      assert Enum.all?(renditions, &match?({:ok, _}, &1))
+    end
+  end
+
+  describe "batch_convert/4" do
+    test "converts every blob", context do
+      png = File.read!(Path.join(context[:images], "elixir.png"))
+      blobs = List.duplicate(png, 5) ++ ["not an image", png]
+
+      assert {:ok, results} =
+               ExMagick.batch_convert(blobs, [{:thumb, 16, 16}], "JPEG", chunk_size: 2)
+
+      assert length(results) == 7
+      assert {:error, _} = Enum.at(results, 5)
+
+      for {{:ok, jpg}, k} <- Enum.with_index(results), k != 5 do
+        image = ExMagick.init!() |> ExMagick.image_load!({:blob, jpg})
+        assert "JPEG" == ExMagick.attr!(image, :magick)
+        assert %{width: 16} = ExMagick.size!(image)
+      end
+    end
+
+    test "rejects invalid operations and options" do
+      assert {:error, _} = ExMagick.batch_convert([], [{:load, "x"}], "PNG")
+      assert {:error, _} = ExMagick.batch_convert(["x"], [], "PNG", chunk_size: 0)
+      assert {:error, _} = ExMagick.batch_convert(["x"], [], "PNG", chunk_size: :all)
+      assert {:error, _} = ExMagick.batch_convert(["x"], [], "PNG", limits: [colors: 1])
+    end
+
+    test "checks every blob against the limits", context do
+      png = File.read!(Path.join(context[:images], "elixir.png"))
+      small = ExMagick.batch_convert!([png], [{:thumb, 16, 16}], "PNG") |> hd() |> elem(1)
+
+      assert {:ok, [{:error, {:resource_limit, :width}}, {:ok, _}]} =
+               ExMagick.batch_convert([png, small], [], "PNG", limits: [width: 100])
+
+      assert {:ok, [{:error, {:resource_limit, :height}}]} =
+               ExMagick.batch_convert([small], [{:size, 16, 200}], "PNG", limits: [height: 100])
+    end
+  end
+
+  describe "deadline/2" do
+    test "aborts operations past the deadline", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      expired = image |> ExMagick.derive!() |> ExMagick.deadline!(0)
+
+      assert {:error, :timeout} == ExMagick.thumb(expired, 64, 64)
+      assert {:error, :timeout} == ExMagick.pipeline(expired, [{:thumb, 64, 64}, :dump])
+      assert {:error, :timeout} == expired |> ExMagick.derive!() |> ExMagick.image_dump()
+
+      {:ok, ref} = ExMagick.pipeline_async(expired, [{:thumb, 64, 64}])
+      assert {:error, :timeout} == ExMagick.await(ref)
+
+      assert {:ok, _} = expired |> ExMagick.deadline!(:infinity) |> ExMagick.thumb(64, 64)
+      assert {:ok, _} = image |> ExMagick.deadline!(60_000) |> ExMagick.thumb(64, 64)
+    end
+
+    test "applies to the operations already running", context do
+      image = ExMagick.init!()
+      src = Path.join(context[:images], "elixir.png")
+      pipeline = [{:load, src}, {:size, 4000, 4000}, {:convert, :blur, 8}, :dump]
+      {:ok, ref} = ExMagick.pipeline_async(image, pipeline)
+
+      Process.sleep(50)
+      ExMagick.deadline!(image, 0)
+      assert {:error, :timeout} == ExMagick.await(ref, 30_000)
+    end
+
+    test "rejects bad timeouts" do
+      assert {:error, _} = ExMagick.deadline(ExMagick.init!(), -1)
+    end
+  end
+
+  describe "pipeline_async/2" do
+    test "sends the result to the caller", context do
+      {:ok, ref} =
+        ExMagick.init!()
+        |> ExMagick.pipeline_async([
+          {:load, Path.join(context[:images], "elixir.png")},
+          {:thumb, 64, 64},
+          {:magick, "JPEG"},
+          :dump
+        ])
+
+      assert_receive {^ref, {:ok, <<0xFF, 0xD8, _::binary>>}}, 5000
+    end
+
+    test "await/2 returns the result", context do
+      image = ExMagick.init!()
+      {:ok, ref} = ExMagick.pipeline_async(image, [{:load, Path.join(context[:images], "x")}])
+      assert {:error, _} = ExMagick.await(ref)
+
+      {:ok, ref} = ExMagick.pipeline_async(image, [{:thumb, 1, 1}])
+      assert {:error, "image not loaded"} == ExMagick.await(ref)
+    end
+
+    test "await/2 cancels the call on timeout", context do
+      src = Path.join(context[:images], "elixir.png")
+      pipeline = [{:load, src}, {:size, 4000, 4000}, {:convert, :blur, 8}, :dump]
+      {:ok, ref} = ExMagick.init!() |> ExMagick.pipeline_async(pipeline)
+
+      assert {:error, :timeout} == ExMagick.await(ref, 0)
+      refute_receive {^ref, _}, 500
+    end
+
+    test "runs many calls concurrently", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      refs =
+        for size <- 1..16 do
+          pipeline = [{:load, src}, {:size, size, size}]
+          {:ok, ref} = ExMagick.init!() |> ExMagick.pipeline_async(pipeline)
+          {ref, size}
+        end
+
+      for {ref, size} <- refs do
+        assert {:ok, image} = ExMagick.await(ref)
+        assert %{width: ^size, height: ^size} = ExMagick.size!(image)
+      end
+    end
+
+    test "drops the calls of dead callers", context do
+      src = Path.join(context[:images], "elixir.png")
+      dsts = for k <- 1..16, do: Path.join(context[:tmpdir], "#{k}.png")
+      handles = for _ <- dsts, do: ExMagick.init!()
+      parent = self()
+
+      caller =
+        spawn(fn ->
+          for {handle, dst} <- Enum.zip(handles, dsts) do
+            pipeline = [{:load, src}, {:size, 4000, 4000}, {:dump, dst}]
+            {:ok, _} = ExMagick.pipeline_async(handle, pipeline)
+          end
+
+          send(parent, :submitted)
+          Process.sleep(:infinity)
+        end)
+
+      assert_receive :submitted, 5000
+      Process.exit(caller, :kill)
+
+      # the jobs of a handle run one at a time: these wait for the others
+      for handle <- handles do
+        {:ok, ref} = ExMagick.pipeline_async(handle, [])
+        assert {:ok, ^handle} = ExMagick.await(ref, 60_000)
+      end
+
+      assert Enum.count(dsts, &File.exists?/1) < length(dsts)
+    end
+  end
+
+  describe "fingerprint/2" do
+    test "similar images have close hashes", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      thumb = image |> ExMagick.derive!() |> ExMagick.thumb!(113, 47)
+
+      kinds = [:ahash, :dhash, :phash]
+      assert %{ahash: _, dhash: _, phash: _} = original = ExMagick.fingerprint!(image, kinds)
+      resized = ExMagick.fingerprint!(thumb, kinds)
+
+      for kind <- kinds do
+        assert original[kind] in 0..0xFFFFFFFFFFFFFFFF
+        assert distance(original[kind], resized[kind]) <= 10
+      end
+
+      flipped = image |> ExMagick.derive!() |> ExMagick.convert!(:flip, :vertical)
+      assert distance(original.phash, ExMagick.fingerprint!(flipped).phash) > 10
+    end
+
+    test "histogram and stats" do
+      image = ExMagick.init!() |> ExMagick.from_pixels!(solid({10, 20, 30}, 40, 30), {40, 30})
+
+      assert %{histogram: histogram, stats: stats} =
+               ExMagick.fingerprint!(image, [:histogram, :stats])
+
+      counts = for <<count::32 <- histogram>>, do: count
+      assert 768 == length(counts)
+      assert 1200 == Enum.at(counts, 10)
+      assert 1200 == Enum.at(counts, 256 + 20)
+      assert 1200 == Enum.at(counts, 512 + 30)
+      assert 3600 == Enum.sum(counts)
+
+      assert %{mean: {10.0, 20.0, 30.0}, stddev: {0.0, 0.0, 0.0}} == stats
+    end
+
+    test "rejects unknown kinds and empty handles" do
+      assert {:error, _} = ExMagick.fingerprint(ExMagick.init!(), [:md5])
+      assert {:error, "image not loaded"} == ExMagick.fingerprint(ExMagick.init!())
+    end
+  end
+
+  describe "tiles/3" do
+    test "writes a deep zoom pyramid", context do
+      dir = Path.join(context[:tmpdir], "elixir_files")
+
+      info =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.tiles!(dir, tile_size: 64, overlap: 1, format: "png")
+
+      assert %{levels: 9, width: 227, height: 95} == info
+      assert 9 == length(File.ls!(dir))
+      assert 8 == length(File.ls!(Path.join(dir, "8")))
+      assert ["0_0.png"] == File.ls!(Path.join(dir, "0"))
+
+      tile = fn level, name ->
+        path = Path.join([dir, level, name])
+        ExMagick.init!() |> ExMagick.image_load!(path) |> ExMagick.size!()
+      end
+
+      assert %{width: 65, height: 65} == tile.("8", "0_0.png")
+      assert %{width: 66, height: 32} == tile.("8", "1_1.png")
+      assert %{width: 36, height: 32} == tile.("8", "3_1.png")
+      assert %{width: 1, height: 1} == tile.("0", "0_0.png")
+
+      dzi = File.read!(Path.join(context[:tmpdir], "elixir.dzi"))
+      assert dzi =~ ~s(TileSize="64" Overlap="1" Format="png")
+      assert dzi =~ ~s(<Size Width="227" Height="95"/>)
+    end
+
+    test "reads a raw source a strip at a time", context do
+      src = Path.join(context[:tmpdir], "strips.gray")
+      dir = Path.join(context[:tmpdir], "strips_files")
+      File.write!(src, :binary.copy(<<0, 64, 128, 255>>, div(512 * 2048, 4)))
+
+      parent = self()
+      baseline = pixel_cache_bytes()
+      sampler = spawn_link(fn -> sample_pixel_cache(parent, 0) end)
+
+      info =
+        ExMagick.init!()
+        |> ExMagick.tiles!(dir,
+          tile_size: 64,
+          format: "png",
+          source: "gray:" <> src,
+          size: {512, 2048}
+        )
+
+      send(sampler, :stop)
+      assert_receive {:pixel_cache, peak}
+
+      assert %{levels: 12, width: 512, height: 2048} == info
+      assert 8 * 32 == length(File.ls!(Path.join(dir, "11")))
+      # a whole decode holds 512x2048 pixels of 4 bytes at least
+      assert peak - baseline < 512 * 2048
+    end
+
+    test "builds the levels of a JPEG source out of a smaller decode", context do
+      src = Path.join(context[:tmpdir], "source.jpg")
+      dir = Path.join(context[:tmpdir], "source_files")
+
+      ExMagick.init!()
+      |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      |> ExMagick.size!(908, 380)
+      |> ExMagick.attr!(:magick, "JPEG")
+      |> ExMagick.image_dump!(src)
+
+      assert %{levels: 11, width: 908, height: 380} ==
+               ExMagick.init!() |> ExMagick.tiles!(dir, tile_size: 128, source: src)
+
+      tile = fn level, name ->
+        path = Path.join([dir, level, name])
+        ExMagick.init!() |> ExMagick.image_load!(path) |> ExMagick.size!()
+      end
+
+      assert %{width: 129, height: 129} == tile.("10", "0_0.jpg")
+      assert %{width: 71, height: 63} == tile.("9", "3_1.jpg")
+      assert %{width: 1, height: 1} == tile.("0", "0_0.jpg")
+    end
+
+    test "fails without an image", context do
+      dir = Path.join(context[:tmpdir], "empty_files")
+      assert {:error, "image not loaded"} == ExMagick.tiles(ExMagick.init!(), dir)
+    end
+  end
+
+  describe "animate/3" do
+    setup do
+      [frames: ExMagick.init!() |> ExMagick.image_load!({:blob, animation()})]
+    end
+
+    test "loads the optimized fixture", context do
+      assert [
+               %{width: 8, height: 8, x: 0, y: 0, delay: 10, dispose: :none},
+               %{width: 2, height: 2, x: 2, y: 2},
+               %{width: 2, height: 2, x: 4, y: 4}
+             ] = ExMagick.frames!(context[:frames])
+    end
+
+    test "transforms every frame", context do
+      handle =
+        ExMagick.animate!(context[:frames], [{:size, 16, 16}, {:convert, :delay, 7}],
+          optimize: false,
+          max_concurrency: 3
+        )
+
+      frames = ExMagick.frames!(handle)
+      assert 3 == length(frames)
+      assert Enum.all?(frames, &match?(%{width: 16, height: 16, x: 0, y: 0, delay: 7}, &1))
+    end
+
+    test "coalesces the frames without optimize", context do
+      handle = ExMagick.animate!(context[:frames], [{:convert, :delay, 5}], optimize: false)
+
+      assert Enum.all?(ExMagick.frames!(handle), &match?(%{width: 8, height: 8, x: 0, y: 0}, &1))
+
+      # the last frame shows the squares of both previous ones
+      last = ExMagick.page!(handle, 2)
+      assert solid({255, 255, 255}, 2, 2) == ExMagick.pixels!(last, region: {2, 2, 2, 2})
+      assert solid({255, 0, 0}, 2, 2) == ExMagick.pixels!(last, region: {4, 4, 2, 2})
+      assert solid({0, 0, 0}, 2, 2) == ExMagick.pixels!(last, region: {0, 0, 2, 2})
+    end
+
+    test "optimize keeps the changed regions only", context do
+      blob =
+        context[:frames]
+        |> ExMagick.animate!([{:convert, :delay, 5}])
+        |> ExMagick.attr!(:magick, "GIF")
+        |> ExMagick.image_dump!()
+
+      assert [
+               %{width: 8, height: 8, x: 0, y: 0, delay: 5, dispose: :none},
+               %{width: 2, height: 2, x: 2, y: 2, delay: 5, dispose: :none},
+               %{width: 2, height: 2, x: 4, y: 4, delay: 5, dispose: :none}
+             ] = ExMagick.init!() |> ExMagick.image_load!({:blob, blob}) |> ExMagick.frames!()
+    end
+
+    test "rejects operations that do not apply to frames", context do
+      assert {:error, _} = ExMagick.animate(context[:frames], [:dump])
+      assert {:error, _} = ExMagick.animate(context[:frames], [{:magick, "GIF"}])
+      assert {:error, "image not loaded"} == ExMagick.animate(ExMagick.init!(), [{:size, 8, 8}])
+    end
+  end
+
+  describe "resize/4" do
+    test "resizes with both engines", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      for engine <- [:magick, :fast], filter <- [:lanczos3, :bilinear, :box] do
+        image = ExMagick.init!() |> ExMagick.image_load!(src)
+        options = [engine: engine, filter: filter]
+
+        assert %{width: 100, height: 42} ==
+                 image |> ExMagick.resize!(100, 42, options) |> ExMagick.size!()
+
+        assert "PNG" == ExMagick.attr!(image, :magick)
+      end
+    end
+
+    test "the fast engine matches GraphicsMagick", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      for filter <- [:lanczos3, :bilinear], {width, height} <- [{100, 42}, {454, 190}] do
+        [magick, fast] =
+          for engine <- [:magick, :fast] do
+            ExMagick.init!()
+            |> ExMagick.image_load!(src)
+            |> ExMagick.resize!(width, height, filter: filter, engine: engine)
+            |> ExMagick.pixels!(map: :rgba)
+          end
+
+        assert mean_abs_diff(magick, fast) < 4, "#{filter} #{width}x#{height}"
+      end
+    end
+
+    test "the fast engine matches GraphicsMagick on gray and RGBA images", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      for map <- [:gray, :rgba], filter <- [:lanczos3, :bilinear] do
+        pixels = ExMagick.pixels!(image, map: map)
+
+        [magick, fast] =
+          for engine <- [:magick, :fast] do
+            ExMagick.init!()
+            |> ExMagick.from_pixels!(pixels, {227, 95}, map: map)
+            |> ExMagick.resize!(151, 63, filter: filter, engine: engine)
+            |> ExMagick.pixels!(map: map)
+          end
+
+        assert mean_abs_diff(magick, fast) < 4, "#{map} #{filter}"
+      end
+    end
+
+    test "the fast engine falls back to GraphicsMagick" do
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, gif(3)})
+
+      assert %{width: 4, height: 4} ==
+               image |> ExMagick.resize!(4, 4, engine: :fast) |> ExMagick.size!()
+    end
+
+    test "rejects bad options", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert {:error, _} = ExMagick.resize(image, 10, 10, filter: :mitchell)
+      assert {:error, _} = ExMagick.resize(image, 0, 10)
+    end
+
+    test "rejects sizes whose buffers would overflow", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      huge = 4_611_686_018_427_387_904
+
+      for engine <- [:magick, :fast] do
+        assert {:error, {:resource_limit, :width}} ==
+                 ExMagick.resize(image, huge, 10, engine: engine)
+
+        assert {:error, {:resource_limit, :height}} ==
+                 ExMagick.resize(image, 10, huge, engine: engine)
+      end
+
+      assert {:error, {:resource_limit, :width}} == ExMagick.size(image, huge, huge)
+      assert %{width: 227, height: 95} == ExMagick.size!(image)
+    end
+  end
+
+  describe "pixels/2" do
+    test "exports packed pixels", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert byte_size(ExMagick.pixels!(image)) == 227 * 95 * 3
+      assert byte_size(ExMagick.pixels!(image, map: :rgba, depth: 16)) == 227 * 95 * 4 * 2
+      assert byte_size(ExMagick.pixels!(image, map: :gray, region: {10, 10, 5, 2})) == 10
+    end
+
+    test "round trips through from_pixels/4", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      pixels = ExMagick.pixels!(image, map: :rgba)
+      copy = ExMagick.init!() |> ExMagick.from_pixels!(pixels, {227, 95}, map: :rgba)
+
+      assert %{width: 227, height: 95} == ExMagick.size!(copy)
+      assert pixels == ExMagick.pixels!(copy, map: :rgba)
+
+      blob = copy |> ExMagick.attr!(:magick, "PNG") |> ExMagick.image_dump!()
+      assert %{magick: "PNG", width: 227} = ExMagick.ping!({:blob, blob})
+    end
+
+    test "rejects bad arguments", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert {:error, _} = ExMagick.pixels(image, region: {200, 0, 100, 1})
+
+      huge = 18_446_744_073_709_551_615
+      assert {:error, _} = ExMagick.pixels(image, region: {10, 0, huge - 5, 1})
+      assert {:error, _} = ExMagick.pixels(image, region: {0, 10, 1, huge - 5})
+      assert {:error, _} = ExMagick.pixels(image, region: {9_223_372_036_854_775_807, 0, 2, 1})
+      assert {:error, _} = ExMagick.pixels(image, depth: 12)
+      assert {:error, _} = ExMagick.init!() |> ExMagick.from_pixels(<<0, 0, 0>>, {2, 1})
+      assert {:error, "image not loaded"} = ExMagick.init!() |> ExMagick.pixels()
+    end
+  end
+
+  describe "composite/5" do
+    test "draws an image over another" do
+      base = ExMagick.init!() |> ExMagick.from_pixels!(solid({255, 0, 0}, 4, 4), {4, 4})
+      overlay = ExMagick.init!() |> ExMagick.from_pixels!(solid({0, 0, 255}, 2, 2), {2, 2})
+
+      assert {:ok, ^base} = ExMagick.composite(base, overlay, 1, 1, operator: :copy)
+      assert <<0, 0, 255>> == ExMagick.pixels!(base, region: {2, 2, 1, 1})
+      assert <<255, 0, 0>> == ExMagick.pixels!(base, region: {0, 0, 1, 1})
+      assert %{width: 4, height: 4} == ExMagick.size!(base)
+    end
+
+    test "rejects unknown operators and images not loaded" do
+      base = ExMagick.init!() |> ExMagick.from_pixels!(solid({255, 0, 0}, 1, 1), {1, 1})
+
+      assert {:error, _} = ExMagick.composite(base, base, 0, 0, operator: :dissolve)
+      assert {:error, "overlay not loaded"} = ExMagick.composite(base, ExMagick.init!(), 0, 0)
+    end
+  end
+
+  describe "montage/2" do
+    test "lays images out in a grid" do
+      tiles =
+        for color <- [{255, 0, 0}, {0, 255, 0}, {0, 0, 255}] do
+          ExMagick.init!() |> ExMagick.from_pixels!(solid(color, 2, 2), {2, 2})
+        end
+
+      montage = ExMagick.montage!(tiles, columns: 2, spacing: 1)
+
+      assert %{width: 5, height: 5} == ExMagick.size!(montage)
+      assert <<0, 255, 0, 255>> == ExMagick.pixels!(montage, map: :rgba, region: {3, 0, 1, 1})
+      assert <<0, 0, 255, 255>> == ExMagick.pixels!(montage, map: :rgba, region: {1, 4, 1, 1})
+      assert <<_, _, _, 0>> = ExMagick.pixels!(montage, map: :rgba, region: {2, 0, 1, 1})
+    end
+
+    test "rejects empty lists and unknown colors" do
+      tile = ExMagick.init!() |> ExMagick.from_pixels!(solid({0, 0, 0}, 1, 1), {1, 1})
+
+      assert {:error, _} = ExMagick.montage([])
+      assert {:error, _} = ExMagick.montage([tile], background: "no such color")
+    end
+
+    test "checks the grid against the limits before allocating it" do
+      tile = ExMagick.init!() |> ExMagick.from_pixels!(solid({0, 0, 0}, 2, 2), {2, 2})
+      limited = ExMagick.derive!(tile) |> ExMagick.limit!(width: 3)
+
+      assert {:error, {:resource_limit, :width}} =
+               ExMagick.montage([limited, tile], columns: 2)
+
+      assert {:error, {:resource_limit, :height}} =
+               ExMagick.montage([tile, tile], columns: 1, spacing: 1_000_000_000)
+
+      assert {:ok, _} = ExMagick.montage([limited, tile], columns: 1)
+    end
+  end
+
+  describe "limit/2" do
+    test "rejects images past the limits before decoding", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      assert {:error, {:resource_limit, :width}} =
+               ExMagick.init!() |> ExMagick.limit!(width: 100) |> ExMagick.image_load(src)
+
+      assert {:error, {:resource_limit, :pixels}} =
+               ExMagick.init!() |> ExMagick.limit!(pixels: 1000) |> ExMagick.image_load(src)
+
+      image = ExMagick.init!() |> ExMagick.limit!(width: 227, height: 95)
+      assert {:ok, _} = ExMagick.image_load(image, src)
+    end
+
+    test "rejects resizing past the limits", context do
+      image =
+        ExMagick.init!()
+        |> ExMagick.limit!(height: 100)
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert {:error, {:resource_limit, :height}} = ExMagick.size(image, 50, 200)
+      assert {:ok, _} = ExMagick.size(image, 50, 50)
+    end
+
+    test "limits are only lowered and inherited", context do
+      image = ExMagick.init!() |> ExMagick.limit!(width: 100) |> ExMagick.limit!(width: 1000)
+      src = Path.join(context[:images], "elixir.png")
+
+      assert {:error, {:resource_limit, :width}} = ExMagick.image_load(image, src)
+      derived = ExMagick.derive!(image)
+      assert {:error, {:resource_limit, :width}} = ExMagick.image_load(derived, src)
+    end
+
+    test "rejects unknown limits" do
+      assert {:error, _} = ExMagick.init!() |> ExMagick.limit(memory: 10)
+    end
+  end
+
+  describe "set_resource_limits/1" do
+    test "sets the limits of the node" do
+      {:ok, %{width: width}} = ExMagick.resource_limits()
+
+      try do
+        assert :ok == ExMagick.set_resource_limits(width: 10_000)
+        assert {:ok, %{width: 10_000}} = ExMagick.resource_limits()
+      after
+        ExMagick.set_resource_limits(width: width)
+      end
+    end
+
+    test "rejects unknown resources" do
+      assert {:error, _} = ExMagick.set_resource_limits(colors: 10)
+    end
+
+    test "sets none of the limits when one of them is rejected" do
+      {:ok, %{width: width}} = ExMagick.resource_limits()
+
+      try do
+        assert {:error, _} = ExMagick.set_resource_limits(width: 12_345, colors: 10)
+        assert {:ok, %{width: ^width}} = ExMagick.resource_limits()
+      after
+        ExMagick.set_resource_limits(width: width)
+      end
+    end
+
+    test "reports why the configured limits are rejected" do
+      limits = Application.get_env(:exmagick, :resource_limits, [])
+
+      try do
+        Application.put_env(:exmagick, :resource_limits, colors: 10)
+        assert {:error, {:bad_config, reason}} = ExMagick.load()
+        assert to_string(reason) =~ "colors"
+
+        Application.put_env(:exmagick, :resource_limits, width: -1)
+        assert {:error, {:bad_config, _}} = ExMagick.load()
+      after
+        Application.put_env(:exmagick, :resource_limits, limits)
+      end
+    end
+  end
+
+  describe "reset/1 and release/1" do
+    test "reset brings the handle back to its initial state", context do
+      defaults = ExMagick.init!()
+
+      handle =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.attr!(:quality, 20)
+        |> ExMagick.attr!(:density, "300")
+        |> ExMagick.limit!(width: 10)
+
+      assert {:ok, ^handle} = ExMagick.reset(handle)
+      assert {:error, "image not loaded"} == ExMagick.size(handle)
+      assert ExMagick.attr!(defaults, :quality) == ExMagick.attr!(handle, :quality)
+      assert ExMagick.attr!(defaults, :density) == ExMagick.attr!(handle, :density)
+
+      handle = ExMagick.image_load!(handle, Path.join(context[:images], "elixir.png"))
+      assert %{width: 227, height: 95} == ExMagick.size!(handle)
+    end
+
+    test "init reuses released handles", context do
+      {:ok, %{reused: reused, size: size}} = ExMagick.handle_stats()
+      assert size > 0
+
+      assert :ok ==
+               ExMagick.init!()
+               |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+               |> ExMagick.release()
+
+      handle = ExMagick.init!()
+      assert {:error, "image not loaded"} == ExMagick.size(handle)
+      assert {:ok, %{reused: new_reused}} = ExMagick.handle_stats()
+      assert new_reused > reused
+    end
+
+    test "rejects released handles", context do
+      handle = ExMagick.image_load!(ExMagick.init!(), Path.join(context[:images], "elixir.png"))
+      assert :ok == ExMagick.release(handle)
+
+      assert {:error, "invalid handle"} == ExMagick.size(handle)
+      assert {:error, "invalid handle"} == ExMagick.derive(handle)
+      assert {:error, "invalid handle"} == ExMagick.release(handle)
+    end
+
+    test "release waits for the calls using the handle", context do
+      path = Path.join(context[:images], "elixir.png")
+
+      1..32
+      |> Enum.map(fn _ ->
+        Task.async(fn ->
+          handle = ExMagick.image_load!(ExMagick.init!(), path)
+
+          users =
+            Enum.map(1..4, fn _ ->
+              Task.async(fn -> {ExMagick.thumb(handle, 42, 42), ExMagick.size(handle)} end)
+            end)
+
+          assert :ok == ExMagick.release(handle)
+          assert {:error, "image not loaded"} == ExMagick.size(ExMagick.init!())
+          Enum.map(users, &Task.await/1)
+        end)
+      end)
+      |> Enum.flat_map(&Task.await/1)
+      |> Enum.each(fn {thumb, size} ->
+        assert match?({:ok, _}, thumb) or thumb == {:error, "invalid handle"}
+        assert match?({:ok, %{width: _, height: _}}, size) or size == {:error, "invalid handle"}
+      end)
+    end
+  end
+
+  describe "set_cache_size/1" do
+    test "loads a blob from the cache the second time", context do
+      blob = File.read!(Path.join(context[:images], "elixir.png"))
+
+      try do
+        assert :ok == ExMagick.set_cache_size(64 * 1024 * 1024)
+        {:ok, %{hits: hits}} = ExMagick.cache_stats()
+
+        first = ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+        second = ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+        assert {:ok, %{hits: new_hits, entries: entries}} = ExMagick.cache_stats()
+        assert new_hits > hits and entries > 0
+
+        ExMagick.thumb!(first, 10, 10)
+        assert %{width: 227, height: 95} = ExMagick.size!(second)
+        assert ExMagick.image_dump!(second) == ExMagick.image_dump!(ExMagick.derive!(second))
+      after
+        ExMagick.set_cache_size(0)
+      end
+    end
+
+    test "keys the cache by the decode options", context do
+      blob = File.read!(Path.join(context[:images], "elixir.png"))
+
+      try do
+        assert :ok == ExMagick.set_cache_size(64 * 1024 * 1024)
+        ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+        {:ok, %{hits: hits, entries: entries}} = ExMagick.cache_stats()
+
+        ExMagick.init!()
+        |> ExMagick.attr!(:define, "png:ignore-crc=true")
+        |> ExMagick.image_load!({:blob, blob})
+
+        assert {:ok, %{hits: ^hits, entries: new_entries}} = ExMagick.cache_stats()
+        assert new_entries == entries + 1
+      after
+        ExMagick.set_cache_size(0)
+      end
+    end
+
+    test "is bypassed by mapped files", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      try do
+        assert :ok == ExMagick.set_cache_size(64 * 1024 * 1024)
+        {:ok, %{entries: entries}} = ExMagick.cache_stats()
+
+        ExMagick.init!() |> ExMagick.image_load!({:mmap, src})
+        assert {:ok, %{entries: ^entries}} = ExMagick.cache_stats()
+      after
+        ExMagick.set_cache_size(0)
+      end
+    end
+
+    test "releases the images once disabled", context do
+      blob = File.read!(Path.join(context[:images], "elixir.png"))
+      :ok = ExMagick.set_cache_size(64 * 1024 * 1024)
+      ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+
+      assert :ok == ExMagick.set_cache_size(0)
+      assert {:ok, %{size: 0, bytes: 0, entries: 0}} = ExMagick.cache_stats()
+    end
+  end
+
+  describe "stats/0" do
+    test "counts the operations", context do
+      %{load: load, thumb: thumb, dump: dump} = ExMagick.stats!()
+
+      blob =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.thumb!(10, 10)
+        |> ExMagick.image_dump!()
+
+      stats = ExMagick.stats!()
+      assert stats.load.calls > load.calls
+      assert stats.load.pixels >= load.pixels + 227 * 95
+      assert stats.thumb.calls > thumb.calls
+      assert stats.dump.bytes_out >= dump.bytes_out + byte_size(blob)
+      assert is_integer(stats.memory) and is_integer(stats.disk)
+    end
+
+    test "counts the errors" do
+      %{load: load} = ExMagick.stats!()
+      {:error, _} = ExMagick.init!() |> ExMagick.image_load({:blob, "not an image"})
+
+      assert ExMagick.stats!().load.errors > load.errors
+    end
+
+    test "counts the bytes streamed", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+      %{dump: dump} = ExMagick.stats!()
+
+      streamed = image |> ExMagick.dump_stream(chunk_size: 1024) |> Enum.to_list()
+      assert ExMagick.stats!().dump.bytes_out >= dump.bytes_out + IO.iodata_length(streamed)
+    end
+  end
+
+  describe "dump_stream/2" do
+    test "streams the encoded image in chunks", context do
+      image =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.attr!(:magick, "BMP")
+
+      chunks = image |> ExMagick.dump_stream(chunk_size: 1024) |> Enum.to_list()
+
+      assert length(chunks) > 1
+      assert Enum.all?(Enum.drop(chunks, -1), &(byte_size(&1) == 1024))
+
+      streamed = ExMagick.init!() |> ExMagick.image_load!({:blob, IO.iodata_to_binary(chunks)})
+      assert "BMP" == ExMagick.attr!(streamed, :magick)
+      assert %{width: 227, height: 95} == ExMagick.size!(streamed)
+    end
+
+    test "streams formats that seek back", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      for magick <- ["TIFF", "PDF"] do
+        blob =
+          image
+          |> ExMagick.attr!(:magick, magick)
+          |> ExMagick.dump_stream(chunk_size: 512)
+          |> Enum.to_list()
+          |> IO.iodata_to_binary()
+
+        streamed = ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+        assert magick == ExMagick.attr!(streamed, :magick)
+        assert %{width: 227, height: 95} == ExMagick.size!(streamed)
+      end
+    end
+
+    test "stays at most a window ahead of the consumer", context do
+      image =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.attr!(:magick, "BMP")
+
+      image
+      |> ExMagick.dump_stream(chunk_size: 1024, window: 2)
+      |> Enum.each(fn _ ->
+        Process.sleep(1)
+        # the window, then the result and the exit of the encoder
+        {:message_queue_len, pending} = Process.info(self(), :message_queue_len)
+        assert pending <= 4
+      end)
+    end
+
+    test "halting early discards the remaining chunks", context do
+      image = ExMagick.init!() |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+
+      assert [_] = image |> ExMagick.dump_stream(chunk_size: 16) |> Enum.take(1)
+      refute_received _
+    end
+
+    test "raises on errors" do
+      assert_raise RuntimeError, "image not loaded", fn ->
+        ExMagick.init!() |> ExMagick.dump_stream() |> Enum.to_list()
+      end
+    end
+
+    test "gives up once the deadline passes while the consumer lags", context do
+      image =
+        ExMagick.init!()
+        |> ExMagick.image_load!(Path.join(context[:images], "elixir.png"))
+        |> ExMagick.attr!(:magick, "BMP")
+        |> ExMagick.deadline!(100)
+
+      assert_raise RuntimeError, ":timeout", fn ->
+        image
+        |> ExMagick.dump_stream(chunk_size: 1024, window: 1)
+        |> Enum.each(fn _ -> Process.sleep(200) end)
+      end
+    end
+  end
+
+  describe "pipeline/2" do
+    test "thumbnails and dumps in a single call", context do
+      src = Path.join(context[:images], "elixir.png")
+
+      blob =
+        ExMagick.init!()
+        |> ExMagick.pipeline!([{:load, src}, {:thumb, 42, 42}, {:magick, "JPEG"}, :dump])
+
+      image = ExMagick.init!() |> ExMagick.image_load!({:blob, blob})
+      assert "JPEG" == ExMagick.attr!(image, :magick)
+      assert %{width: 42, height: 42} == ExMagick.size!(image)
+    end
+
+    test "returns the handle when not dumping a blob", context do
+      src = Path.join(context[:images], "elixir.png")
+      dst = Path.join(context[:tmpdir], "cropped.png")
+
+      handle = ExMagick.init!()
+      operations = [{:load, src}, {:crop, 0, 0, 100, 10}, {:dump, dst}]
+
+      assert {:ok, ^handle} = ExMagick.pipeline(handle, operations)
+      assert %{width: 100, height: 10} == ExMagick.size!(handle)
+      assert File.exists?(dst)
+    end
+
+    test "reports invalid operations" do
+      assert {:error, _} = ExMagick.init!() |> ExMagick.pipeline([{:rotate, 90}])
+      assert {:error, _} = ExMagick.init!() |> ExMagick.pipeline([:dump, {:thumb, 1, 1}])
+      assert {:error, "image not loaded"} =
+               ExMagick.init!() |> ExMagick.pipeline([{:thumb, 1, 1}])
+    end
+  end
+
+  # a black 1x1 GIF with the given number of frames
+  defp pixel_cache_bytes do
+    %{memory: memory, map: map, disk: disk} = ExMagick.stats!()
+    memory + map + disk
+  end
+
+  defp sample_pixel_cache(parent, peak) do
+    receive do
+      :stop -> send(parent, {:pixel_cache, peak})
+    after
+      1 -> sample_pixel_cache(parent, max(peak, pixel_cache_bytes()))
+    end
+  end
+
+  defp gif(frames) do
+    header = <<"GIF89a", 1::little-16, 1::little-16, 0x80, 0, 0, 0, 0, 0, 255, 255, 255>>
+    frame = <<0x2C, 0::little-16, 0::little-16, 1::little-16, 1::little-16, 0, 2, 2, 0x44, 1, 0>>
+
+    IO.iodata_to_binary([header, List.duplicate(frame, frames), 0x3B])
+  end
+
+  # an optimized 8x8 GIF animation: a black frame, then a white and a
+  # red 2x2 square drawn over it at (2, 2) and (4, 4)
+  defp animation do
+    header = <<"GIF89a", 8::little-16, 8::little-16, 0x81, 0, 0>>
+    colors = <<0, 0, 0, 255, 255, 255, 255, 0, 0, 0, 0, 255>>
+
+    frames =
+      for {x, y, size, color} <- [{0, 0, 8, 0}, {2, 2, 2, 1}, {4, 4, 2, 2}] do
+        # disposal: none, delay: 10
+        control = <<0x21, 0xF9, 4, 4, 10::little-16, 0, 0>>
+        descriptor = <<0x2C, x::little-16, y::little-16, size::little-16, size::little-16, 0>>
+        data = lzw(List.duplicate(color, size * size))
+
+        [control, descriptor, 2, byte_size(data), data, 0]
+      end
+
+    IO.iodata_to_binary([header, colors, frames, 0x3B])
+  end
+
+  # 3-bit LZW codes of 2-bit colors, packed from the lowest bit, with a
+  # clear code every 2 pixels so that the codes never grow
+  defp lzw(pixels) do
+    codes = Enum.flat_map(Enum.chunk_every(pixels, 2), &[4 | &1]) ++ [5]
+
+    {value, bits} =
+      Enum.reduce(codes, {0, 0}, fn code, {value, bits} ->
+        {value + Bitwise.bsl(code, bits), bits + 3}
+      end)
+
+    <<value::little-size(div(bits + 7, 8))-unit(8)>>
+  end
+
+  defp mean_abs_diff(a, b) do
+    diff =
+      Enum.zip(:binary.bin_to_list(a), :binary.bin_to_list(b))
+      |> Enum.reduce(0, fn {x, y}, acc -> acc + abs(x - y) end)
+
+    diff / byte_size(a)
+  end
+
+  defp solid({r, g, b}, width, height), do: :binary.copy(<<r, g, b>>, width * height)
+
+  defp distance(a, b), do: Enum.sum(for <<bit::1 <- <<:erlang.bxor(a, b)::64>> >>, do: bit)
 end